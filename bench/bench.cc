@@ -0,0 +1,450 @@
+// Microbenchmarks of the hot kernels and end-to-end scene renders, reported
+// as JSON for tracking performance between releases.
+//
+//   raytracer_bench [--output results.json] [--filter substring] [--quick]
+//
+// Microbenchmarks report the fastest of several timed runs in ns per
+// operation. Scene benchmarks render Scenes::random_spheres with fixed
+// settings and seed, at the cover's sphere count and scaled up, on every
+// hardware thread, with each integrator: single rays, packets of 8x8 camera
+// rays (scene/..._packets) and wavefront batches (scene/..._wavefront).
+// Their rays are closest-hit rays (path segments), and peak_rss_kb is the
+// peak of the whole process up to that point.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+
+#include "bvh.h"
+#include "camera.h"
+#include "hittable_list.h"
+#include "material.h"
+#include "scenes.h"
+#include "sphere.h"
+#include "sphere_set.h"
+#include "triangle_mesh.h"
+#include "version.h"
+
+namespace {
+  using Clock = std::chrono::steady_clock;
+
+  // Results are folded into this so that the compiler keeps the work
+  volatile double sink = 0;
+
+  // Peak resident set size of the process so far, 0 where unsupported
+  std::uint64_t peak_rss_kb() {
+#if defined(__APPLE__)
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (std::uint64_t)usage.ru_maxrss / 1024; // Bytes on macOS
+#elif defined(__unix__)
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return (std::uint64_t)usage.ru_maxrss;
+#else
+    return 0;
+#endif
+  }
+
+  // One JSON object of a benchmark result, fields in insertion order
+  class JsonObject {
+  public:
+    JsonObject& field(const std::string& key, const std::string& value) {
+      return this->raw(key, "\"" + value + "\"");
+    }
+
+    JsonObject& field(const std::string& key, double value) {
+      std::ostringstream out;
+      out.precision(6);
+      out << value;
+      return this->raw(key, out.str());
+    }
+
+    JsonObject& field(const std::string& key, std::uint64_t value) {
+      return this->raw(key, std::to_string(value));
+    }
+
+    std::string str() const { return "{" + this->body + "}"; }
+
+  private:
+    std::string body;
+
+    JsonObject& raw(const std::string& key, const std::string& value) {
+      if (!this->body.empty()) this->body += ", ";
+      this->body += "\"" + key + "\": " + value;
+      return *this;
+    }
+  };
+
+  struct Options {
+    std::string output_path;
+    std::string filter;
+    bool quick = false;
+  };
+
+  class Suite {
+  public:
+    explicit Suite(const Options& options) : options(options) {}
+
+    bool enabled(const std::string& name) const {
+      return this->options.filter.empty() || name.find(this->options.filter) != std::string::npos;
+    }
+
+    bool quick() const { return this->options.quick; }
+
+    // Times body(n), which runs n operations and returns a value depending on
+    // all of them. n doubles until one run takes long enough to time, then
+    // the fastest of a few runs of that size counts.
+    template <typename Body>
+    void micro(const std::string& name, Body&& body) {
+      if (!this->enabled(name)) return;
+      const double min_seconds = this->options.quick ? 0.01 : 0.05;
+      const int repetitions = this->options.quick ? 3 : 7;
+
+      std::uint64_t operations = 1;
+      double seconds = 0;
+      while (true) {
+        seconds = Suite::time(body, operations);
+        if (seconds >= min_seconds || operations >= (1ull << 40)) break;
+        operations *= 2;
+      }
+      for (int i = 1; i < repetitions; i++) {
+        seconds = std::min(seconds, Suite::time(body, operations));
+      }
+
+      this->add(JsonObject()
+        .field("name", name)
+        .field("kind", std::string("micro"))
+        .field("operations", operations)
+        .field("ns_per_op", seconds * 1e9 / operations));
+    }
+
+    void add(const JsonObject& result) {
+      this->results.push_back(result.str());
+      std::cerr << result.str() << std::endl;
+    }
+
+    std::string json() const {
+      const JsonObject header = JsonObject()
+        .field("version", std::to_string(RAYTRACER_VERSION_MAJOR) + "." + std::to_string(RAYTRACER_VERSION_MINOR))
+        .field("real", std::string(RAYTRACER_REAL_FLOAT ? "float" : "double"))
+        .field("threads", (std::uint64_t)ThreadPool::hardware_threads());
+      std::string out = "{\n  \"build\": " + header.str() + ",\n  \"results\": [\n";
+      for (size_t i = 0; i < this->results.size(); i++) {
+        out += "    " + this->results[i] + (i + 1 < this->results.size() ? ",\n" : "\n");
+      }
+      return out + "  ]\n}\n";
+    }
+
+  private:
+    Options options;
+    std::vector<std::string> results;
+
+    template <typename Body>
+    static double time(Body& body, std::uint64_t operations) {
+      const Clock::time_point start = Clock::now();
+      sink = sink + (double)body(operations);
+      return std::chrono::duration<double>(Clock::now() - start).count();
+    }
+  };
+
+  // Inputs are generated at run time from a fixed seed, so nothing can be
+  // folded at compile time and every run sees the same data
+  constexpr size_t input_count = 1024;
+
+  Vect3 random_vector(Sampler& sampler, double min, double max) {
+    return {(Real)sampler.next_double(min, max), (Real)sampler.next_double(min, max),
+            (Real)sampler.next_double(min, max)};
+  }
+
+  std::vector<Ray> random_rays(Sampler& sampler) {
+    std::vector<Ray> rays;
+    for (size_t i = 0; i < input_count; i++) {
+      rays.emplace_back(random_vector(sampler, -4, 4), random_unit_vector(sampler), (Real)sampler.next_double());
+    }
+    return rays;
+  }
+
+  // A ray towards each of the unit spheres at the origin, most of them hits
+  std::vector<Ray> rays_at_origin(Sampler& sampler) {
+    std::vector<Ray> rays;
+    for (size_t i = 0; i < input_count; i++) {
+      const Point3 origin = 4 * random_unit_vector(sampler);
+      rays.emplace_back(origin, random_vector(sampler, -0.8, 0.8) - origin, 0);
+    }
+    return rays;
+  }
+
+  // Unit sphere at the origin as a latitude-longitude grid of triangles,
+  // 4 * segments * (segments - 1) of them
+  TriangleSet sphere_mesh(int segments) {
+    TriangleSet triangles;
+    for (int i = 0; i <= segments; i++) {
+      const double theta = Constant::pi * i / segments;
+      for (int j = 0; j < 2 * segments; j++) {
+        const double phi = Constant::pi * j / segments;
+        triangles.add_vertex(Point3((Real)(std::sin(theta) * std::cos(phi)), (Real)std::cos(theta),
+                                    (Real)(std::sin(theta) * std::sin(phi))));
+      }
+    }
+    const auto index = [&](int i, int j) { return (std::uint32_t)(i * 2 * segments + j % (2 * segments)); };
+    for (int i = 0; i < segments; i++) {
+      for (int j = 0; j < 2 * segments; j++) {
+        // Those with two corners at a pole would be degenerate
+        if (i > 0) triangles.add(index(i, j), index(i, j + 1), index(i + 1, j + 1));
+        if (i < segments - 1) triangles.add(index(i, j), index(i + 1, j + 1), index(i + 1, j));
+      }
+    }
+    return triangles;
+  }
+
+  void run_micro(Suite& suite) {
+    Sampler sampler(1, 0, 0);
+
+    // AABB slab tests
+    std::vector<BoundingBox> boxes;
+    for (size_t i = 0; i < input_count; i++) {
+      const Vect3 corner = random_vector(sampler, -2, 2);
+      boxes.emplace_back(corner, corner + random_vector(sampler, 0.1, 2));
+    }
+    const std::vector<Ray> rays = random_rays(sampler);
+    std::vector<Vect3> inverse_directions;
+    for (const Ray& ray : rays) {
+      const Vect3& d = ray.direction();
+      inverse_directions.emplace_back(1 / d[0], 1 / d[1], 1 / d[2]);
+    }
+    suite.micro("aabb/slab_precomputed_inverse", [&](std::uint64_t n) {
+      std::uint64_t hits = 0;
+      for (std::uint64_t i = 0; i < n; i++) {
+        const size_t k = i % input_count;
+        hits += boxes[k].hit(rays[k], inverse_directions[k], Interval(0, Constant::infinity)).has_value();
+      }
+      return hits;
+    });
+    suite.micro("aabb/slab_divide_per_call", [&](std::uint64_t n) {
+      std::uint64_t hits = 0;
+      for (std::uint64_t i = 0; i < n; i++) {
+        const size_t k = i % input_count;
+        hits += boxes[k].hit(rays[k], Interval(0, Constant::infinity)).has_value();
+      }
+      return hits;
+    });
+
+    // Sphere intersection
+    const Sphere sphere(Point3(0, 0, 0), 1, 0);
+    const std::vector<Ray> sphere_rays = rays_at_origin(sampler);
+    suite.micro("sphere/intersect", [&](std::uint64_t n) {
+      double total = 0;
+      for (std::uint64_t i = 0; i < n; i++) {
+        Interval ray_t(0, Constant::infinity);
+        Intersection intersection;
+        if (sphere.intersect(sphere_rays[i % input_count], ray_t, intersection)) total += intersection.t;
+      }
+      return total;
+    });
+    suite.micro("sphere/hit", [&](std::uint64_t n) {
+      double total = 0;
+      for (std::uint64_t i = 0; i < n; i++) {
+        const std::optional<HitRecord> record = sphere.hit(sphere_rays[i % input_count], Interval(0, Constant::infinity));
+        if (record.has_value()) total += record->normal.x();
+      }
+      return total;
+    });
+
+    // Triangle mesh intersection through the mesh's BVH, same rays
+    const TriangleMesh mesh(sphere_mesh(64), 0);
+    suite.micro("mesh/intersect", [&](std::uint64_t n) {
+      double total = 0;
+      for (std::uint64_t i = 0; i < n; i++) {
+        Interval ray_t(0, Constant::infinity);
+        Intersection intersection;
+        if (mesh.intersect(sphere_rays[i % input_count], ray_t, intersection)) total += intersection.t;
+      }
+      return total;
+    });
+
+    // Sampling
+    suite.micro("sampling/random_unit_vector", [&](std::uint64_t n) {
+      Sampler local(2, 0, 0);
+      double total = 0;
+      for (std::uint64_t i = 0; i < n; i++) total += random_unit_vector(local).x();
+      return total;
+    });
+
+    // Material scattering, on hits of rays with the unit sphere
+    std::vector<HitRecord> records;
+    std::vector<Ray> incoming;
+    for (const Ray& ray : sphere_rays) {
+      const std::optional<HitRecord> record = sphere.hit(ray, Interval(0, Constant::infinity));
+      if (!record.has_value()) continue;
+      records.push_back(record.value());
+      incoming.push_back(ray);
+    }
+    const auto scatter_benchmark = [&](const std::string& name, const auto& material) {
+      suite.micro("material/" + name + "_scatter", [&](std::uint64_t n) {
+        Sampler local(3, 0, 0);
+        double total = 0;
+        for (std::uint64_t i = 0; i < n; i++) {
+          const size_t k = i % records.size();
+          const std::optional<ScatterRecord> scattered = material.scatter(incoming[k], records[k], local);
+          if (scattered.has_value()) total += scattered->scattered.direction().x();
+        }
+        return total;
+      });
+    };
+    scatter_benchmark("lambertian", Lambertian(Color(0.5, 0.5, 0.5)));
+    scatter_benchmark("metal", Metal(Color(0.7, 0.6, 0.5), 0.2));
+    scatter_benchmark("dielectric", Dielectric(1.5));
+  }
+
+  // BVH build over the bounds of the random sphere scene at several sizes
+  void run_bvh_build(Suite& suite) {
+    const std::vector<int> extents = suite.quick() ? std::vector<int>{11} : std::vector<int>{11, 44, 176};
+    for (const int extent : extents) {
+      const std::string name = "bvh/build_" + std::to_string(extent);
+      if (!suite.enabled(name)) continue;
+
+      MaterialTable materials;
+      SphereSet spheres;
+      Scenes::random_spheres(materials, spheres, extent);
+      std::vector<BoundingBox> bounds(spheres.size());
+      for (size_t i = 0; i < bounds.size(); i++) bounds[i] = spheres.bounding_box(i);
+
+      double best = Constant::infinity;
+      for (int run = 0; run < (suite.quick() ? 1 : 5); run++) {
+        const Clock::time_point start = Clock::now();
+        const BVHTree tree(bounds, SphereBVH::default_settings());
+        best = std::min(best, std::chrono::duration<double>(Clock::now() - start).count());
+        sink = sink + (double)tree.statistics().node_count;
+      }
+      suite.add(JsonObject()
+        .field("name", name)
+        .field("kind", std::string("bvh_build"))
+        .field("primitives", (std::uint64_t)bounds.size())
+        .field("ms", best * 1e3)
+        .field("ns_per_primitive", best * 1e9 / bounds.size()));
+    }
+  }
+
+  // Camera settings that pick how paths are traced, and the suffix of their
+  // benchmark names
+  struct Integrator {
+    std::string suffix;
+    int packet_size;
+    bool wavefront;
+  };
+
+  // End-to-end renders of the random sphere scene with src/main.cc's camera
+  void run_scenes(Suite& suite) {
+    const std::vector<int> extents = suite.quick() ? std::vector<int>{11} : std::vector<int>{11, 22, 44};
+    const std::vector<Integrator> integrators = {{"", 0, false}, {"_packets", 8, false},
+                                                {"_wavefront", 0, true}};
+    for (const int extent : extents) {
+      const std::string scene_name = "scene/random_spheres_" + std::to_string(extent);
+      if (std::none_of(integrators.begin(), integrators.end(), [&](const Integrator& integrator) {
+            return suite.enabled(scene_name + integrator.suffix);
+          })) {
+        continue;
+      }
+
+      MaterialTable materials;
+      SphereSet spheres;
+      Scenes::random_spheres(materials, spheres, extent);
+      const std::uint64_t sphere_count = spheres.size();
+      const Clock::time_point build_start = Clock::now();
+      const HittableList world(std::make_shared<SphereBVH>(std::move(spheres)));
+      const double build_seconds = std::chrono::duration<double>(Clock::now() - build_start).count();
+      const LightList lights;
+
+      for (const Integrator& integrator : integrators) {
+        const std::string name = scene_name + integrator.suffix;
+        if (!suite.enabled(name)) continue;
+
+        Camera camera;
+        camera.image_width = suite.quick() ? 160 : 400;
+        camera.samples_per_pixel = suite.quick() ? 4 : 16;
+        camera.max_ray_depth = 20;
+        camera.look_from = { 13, 2, 3 };
+        camera.look_at = { 0, 0, 0 };
+        camera.v_up = { 0, 1, 0 };
+        camera.vertical_fov = 20;
+        camera.defocus_angle = 0.6;
+        camera.focus_distance = 10.0;
+        camera.seed = 0;
+        camera.output_path = "";
+        camera.packet_size = integrator.packet_size;
+        camera.wavefront = integrator.wavefront;
+        camera.render(world, materials, lights);
+
+        const Camera::RenderStatistics& stats = camera.statistics();
+        suite.add(JsonObject()
+          .field("name", name)
+          .field("kind", std::string("scene"))
+          .field("spheres", sphere_count)
+          .field("width", (std::uint64_t)camera.image_width)
+          .field("samples_per_pixel", (std::uint64_t)camera.samples_per_pixel)
+          .field("build_ms", build_seconds * 1e3)
+          .field("seconds", stats.seconds)
+          .field("rays", stats.rays)
+          .field("mrays_per_s", stats.rays / stats.seconds * 1e-6)
+          .field("ns_per_ray", stats.seconds * 1e9 / stats.rays)
+          .field("peak_rss_kb", peak_rss_kb()));
+      }
+    }
+  }
+}
+
+int main(int argc, char** argv) {
+  Options options;
+  for (int i = 1; i < argc; i++) {
+    if (std::strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+      options.output_path = argv[++i];
+    } else if (std::strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+      options.filter = argv[++i];
+    } else if (std::strcmp(argv[i], "--quick") == 0) {
+      options.quick = true;
+    } else {
+      std::cerr << "Usage: " << argv[0] << " [--output results.json] [--filter substring] [--quick]" << std::endl;
+      return 1;
+    }
+  }
+
+  Suite suite(options);
+  // Results go to cerr as they come; the renderer's logging is silenced
+  std::streambuf* log = std::clog.rdbuf();
+  const auto quiet = [&](auto&& run) {
+    std::clog.rdbuf(nullptr);
+    run(suite);
+    std::clog.rdbuf(log);
+    std::clog.clear();
+  };
+  quiet(run_micro);
+  quiet(run_bvh_build);
+  quiet(run_scenes);
+
+  const std::string json = suite.json();
+  if (options.output_path.empty()) {
+    std::cout << json;
+  } else {
+    std::ofstream out(options.output_path);
+    out << json;
+    if (!out) {
+      std::cerr << "[ERROR] Cannot write " << options.output_path << std::endl;
+      return 1;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,152 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "color.h"
+#include "framebuffer.h"
+
+// Running sum of every sample taken per pixel, with the number of samples,
+// so that a render can be resolved at any point and continued later. Sums
+// are kept in double whatever Real is: a long progressive render adds
+// thousands of samples to each pixel.
+class AccumulationBuffer {
+public:
+  AccumulationBuffer(int width, int height)
+      : buffer_width(width), buffer_height(height),
+        sums((size_t)width * height * 3, 0.0), counts((size_t)width * height, 0) {
+    assert(width > 0 && height > 0 && "[ERROR] Accumulation buffer size out of range");
+  }
+
+  int width() const { return this->buffer_width; }
+  int height() const { return this->buffer_height; }
+
+  // Samples taken so far by pixel (x, y), which is also the index of its
+  // next sample
+  std::uint32_t sample_count(int x, int y) const {
+    return this->counts[(size_t)y * this->buffer_width + x];
+  }
+
+  void add(int x, int y, const Color &sample) {
+    const size_t index = (size_t)y * this->buffer_width + x;
+    double *sum = this->sums.data() + index * 3;
+    sum[0] += sample.x();
+    sum[1] += sample.y();
+    sum[2] += sample.z();
+    this->counts[index]++;
+  }
+
+  std::uint64_t total_samples() const {
+    std::uint64_t total = 0;
+    for (const std::uint32_t count : this->counts) total += count;
+    return total;
+  }
+
+  // Mean of every pixel; black where no sample was taken yet
+  void resolve(Framebuffer &image) const {
+    assert(image.width() == this->buffer_width && image.height() == this->buffer_height &&
+           "[ERROR] Framebuffer does not match the accumulation buffer");
+    for (int y = 0; y < this->buffer_height; y++) {
+      for (int x = 0; x < this->buffer_width; x++) {
+        const size_t index = (size_t)y * this->buffer_width + x;
+        const double *sum = this->sums.data() + index * 3;
+        const double scale = this->counts[index] == 0 ? 0.0 : 1.0 / this->counts[index];
+        float *pixel = image.pixel(x, y);
+        pixel[0] = (float)(sum[0] * scale);
+        pixel[1] = (float)(sum[1] * scale);
+        pixel[2] = (float)(sum[2] * scale);
+      }
+    }
+  }
+
+  // Checkpoint file:
+  //   "RTAB", u32 version, u32 width, u32 height, u64 fingerprint,
+  //   u32 sample count per pixel, 3 doubles of sums per pixel
+  // in host byte order. fingerprint identifies the scene and the settings the
+  // samples were taken with; a checkpoint only resumes a render with the same
+  // one.
+  // Written to a temporary file first and renamed over path, so a render
+  // killed mid-write still leaves the previous checkpoint intact.
+  bool save(const std::string &path, std::uint64_t fingerprint) const {
+    const std::string temporary = path + ".tmp";
+    {
+      std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+      if (!out) {
+        std::cerr << "[ERROR] Cannot open " << temporary << " for writing" << std::endl;
+        return false;
+      }
+      const std::uint32_t header[3] = {AccumulationBuffer::version, (std::uint32_t)this->buffer_width,
+                                       (std::uint32_t)this->buffer_height};
+      out.write(AccumulationBuffer::magic, 4);
+      out.write(reinterpret_cast<const char *>(header), sizeof(header));
+      out.write(reinterpret_cast<const char *>(&fingerprint), sizeof(fingerprint));
+      out.write(reinterpret_cast<const char *>(this->counts.data()), this->counts.size() * sizeof(std::uint32_t));
+      out.write(reinterpret_cast<const char *>(this->sums.data()), this->sums.size() * sizeof(double));
+      if (!out.flush()) {
+        std::cerr << "[ERROR] Cannot write " << temporary << std::endl;
+        return false;
+      }
+    }
+    if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+      // Windows does not rename over an existing file
+      std::remove(path.c_str());
+      if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+        std::cerr << "[ERROR] Cannot move " << temporary << " to " << path << std::endl;
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Replaces the contents with the checkpoint at path. Returns false, and
+  // leaves the buffer alone, if there is none or it was written for another
+  // image size or fingerprint.
+  bool load(const std::string &path, std::uint64_t fingerprint) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) return false;
+
+    char file_magic[4];
+    std::uint32_t header[3];
+    std::uint64_t file_fingerprint;
+    in.read(file_magic, 4);
+    in.read(reinterpret_cast<char *>(header), sizeof(header));
+    in.read(reinterpret_cast<char *>(&file_fingerprint), sizeof(file_fingerprint));
+    if (!in || std::memcmp(file_magic, AccumulationBuffer::magic, 4) != 0 ||
+        header[0] != AccumulationBuffer::version) {
+      std::cerr << "[ERROR] " << path << " is not a checkpoint of this version" << std::endl;
+      return false;
+    }
+    if (header[1] != (std::uint32_t)this->buffer_width || header[2] != (std::uint32_t)this->buffer_height ||
+        file_fingerprint != fingerprint) {
+      std::cerr << "[ERROR] " << path << " was written for another scene or other render settings" << std::endl;
+      return false;
+    }
+
+    std::vector<std::uint32_t> file_counts(this->counts.size());
+    std::vector<double> file_sums(this->sums.size());
+    in.read(reinterpret_cast<char *>(file_counts.data()), file_counts.size() * sizeof(std::uint32_t));
+    in.read(reinterpret_cast<char *>(file_sums.data()), file_sums.size() * sizeof(double));
+    if (!in) {
+      std::cerr << "[ERROR] " << path << " is truncated" << std::endl;
+      return false;
+    }
+    this->counts = std::move(file_counts);
+    this->sums = std::move(file_sums);
+    return true;
+  }
+
+private:
+  static constexpr char magic[4] = {'R', 'T', 'A', 'B'};
+  static constexpr std::uint32_t version = 1;
+
+  int buffer_width;
+  int buffer_height;
+  std::vector<double> sums;
+  std::vector<std::uint32_t> counts;
+};
@@ -3,30 +3,32 @@
 #include "interval.h"
 #include "point3.h"
 #include "ray.h"
+#include "real.h"
 #include <algorithm>
 #include <optional>
 #include <cassert>
 
 // This implements an Axis-aligned Bounding Box (AABB)
-class BoundingBox {
+template <typename T>
+class BoundingBoxT {
 public:
-  Interval x, y, z;
+  IntervalT<T> x, y, z;
 
-  BoundingBox() {}; // Empty by default, as default interval is empty
+  BoundingBoxT() {}; // Empty by default, as default interval is empty
   
-  BoundingBox(const Interval& x, const Interval& y, const Interval& z) : x(x), y(y), z(z) {}
+  BoundingBoxT(const IntervalT<T>& x, const IntervalT<T>& y, const IntervalT<T>& z) : x(x), y(y), z(z) {}
 
-  BoundingBox(const Point3& a, const Point3& b) : 
+  BoundingBoxT(const Vect3T<T>& a, const Vect3T<T>& b) : 
     x(std::min(a[0], b[0]), std::max(a[0], b[0])),
     y(std::min(a[1], b[1]), std::max(a[1], b[1])),
     z(std::min(a[2], b[2]), std::max(a[2], b[2])) {}
 
-  BoundingBox(const BoundingBox& a, const BoundingBox& b) :
-    x(Interval(a.x, b.x)),
-    y(Interval(a.y, b.y)),
-    z(Interval(a.z, b.z)) {}
+  BoundingBoxT(const BoundingBoxT& a, const BoundingBoxT& b) :
+    x(IntervalT<T>(a.x, b.x)),
+    y(IntervalT<T>(a.y, b.y)),
+    z(IntervalT<T>(a.z, b.z)) {}
 
-  const Interval& axis_interval(int n) const {
+  const IntervalT<T>& axis_interval(int n) const {
     assert(0 <= n && n <= 2 && "[ERROR] Value of axis interval out of range");
     if (n == 1)
       return y;
@@ -35,23 +37,45 @@ public:
     return x;
   };
 
-  std::optional<Interval> hit(const Ray& ray, const Interval& ray_t) const {
-    const Point3& ray_origin    = ray.origin();
-    const Vect3&  ray_direction = ray.direction();
+  Vect3T<T> centroid() const {
+    return {(T)0.5 * (x.min + x.max), (T)0.5 * (y.min + y.max), (T)0.5 * (z.min + z.max)};
+  }
+
+  // 0 for empty boxes, so they add nothing to SAH costs
+  T surface_area() const {
+    const T dx = x.size(), dy = y.size(), dz = z.size();
+    if (dx < 0 || dy < 0 || dz < 0) return 0;
+    return 2 * (dx * dy + dy * dz + dz * dx);
+  }
+
+  int longest_axis() const {
+    if (x.size() > y.size()) return x.size() > z.size() ? 0 : 2;
+    return y.size() > z.size() ? 1 : 2;
+  }
+
+  std::optional<IntervalT<T>> hit(const RayT<T>& ray, const IntervalT<T>& ray_t) const {
+    const Vect3T<T>& d = ray.direction();
+    return this->hit(ray, Vect3T<T>(1 / d[0], 1 / d[1], 1 / d[2]), ray_t);
+  }
 
-    Interval result = ray_t;
+  // Slab test with the ray's inverse direction precomputed by the caller, so a
+  // traversal divides once per ray rather than three times per box
+  std::optional<IntervalT<T>> hit(const RayT<T>& ray, const Vect3T<T>& inverse_direction, const IntervalT<T>& ray_t) const {
+    const Vect3T<T>& ray_origin = ray.origin();
+
+    IntervalT<T> result = ray_t;
 
     for (int axis = 0; axis < 3; axis++) {
       // x = q + td
       // t = (x - q) / d
-      const Interval& ax = this->axis_interval(axis);
-      const double adinv = 1.0 / ray_direction[axis];
+      const IntervalT<T>& ax = this->axis_interval(axis);
+      const T adinv = inverse_direction[axis];
 
-      const double t0 = (ax.min - ray_origin[axis]) * adinv;
-      const double t1 = (ax.max - ray_origin[axis]) * adinv;
+      const T t0 = (ax.min - ray_origin[axis]) * adinv;
+      const T t1 = (ax.max - ray_origin[axis]) * adinv;
 
-      const double lower_t = std::min(t0, t1);
-      const double higher_t = std::max(t0, t1);
+      const T lower_t = std::min(t0, t1);
+      const T higher_t = std::max(t0, t1);
 
       if (lower_t > result.min) result.min = lower_t;
       if (higher_t < result.max) result.max = higher_t;
@@ -62,7 +86,59 @@ public:
   }
 };
 
-inline std::ostream &operator<<(std::ostream &out, const BoundingBox& bbox) {
+using BoundingBox = BoundingBoxT<Real>;
+
+// Box moving linearly from begin to end over a time range, e.g. around a
+// moving sphere over the shutter interval. The box at any time lies within
+// the interpolation of begin and end, and so does any union of such boxes.
+struct LinearBounds {
+  BoundingBox begin, end;
+
+  LinearBounds() {} // Empty
+
+  LinearBounds(const BoundingBox& begin, const BoundingBox& end) : begin(begin), end(end) {}
+
+  // Contains both at every time
+  LinearBounds(const LinearBounds& a, const LinearBounds& b) :
+    begin(a.begin, b.begin), end(a.end, b.end) {}
+
+  // The box at fraction u of the time range
+  BoundingBox at(Real u) const {
+    Interval axes[3];
+    for (int axis = 0; axis < 3; axis++) {
+      const Interval& a = this->begin.axis_interval(axis);
+      const Interval& b = this->end.axis_interval(axis);
+      axes[axis] = Interval(a.min + u * (b.min - a.min), a.max + u * (b.max - a.max));
+    }
+    return BoundingBox(axes[0], axes[1], axes[2]);
+  }
+
+  // Everything the box passes through
+  BoundingBox swept() const { return BoundingBox(this->begin, this->end); }
+
+  // Of the box halfway through the time range
+  Point3 centroid() const { return (Real)0.5 * (this->begin.centroid() + this->end.centroid()); }
+
+  // Surface area averaged over the time range: the sides change linearly,
+  // so it integrates exactly. 0 for empty boxes, as for BoundingBox.
+  Real surface_area() const {
+    Real side[3], change[3];
+    for (int axis = 0; axis < 3; axis++) {
+      side[axis] = this->begin.axis_interval(axis).size();
+      change[axis] = this->end.axis_interval(axis).size() - side[axis];
+      if (side[axis] < 0 || side[axis] + change[axis] < 0) return 0;
+    }
+    Real area = 0;
+    for (int i = 0; i < 3; i++) {
+      const int j = (i + 1) % 3;
+      area += side[i] * side[j] + (side[i] * change[j] + change[i] * side[j]) / 2 + change[i] * change[j] / 3;
+    }
+    return 2 * area;
+  }
+};
+
+template <typename T>
+inline std::ostream &operator<<(std::ostream &out, const BoundingBoxT<T>& bbox) {
   return out << "Bounding Box " << bbox.x << ", " << bbox.y << ", " << bbox.z;
 }
 
@@ -0,0 +1,531 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <vector>
+
+#include "bounding_box.h"
+#include "bvh_builder.h"
+#include "bvh_cache.h"
+#include "bvh_node.h"
+#include "hittable_list.h"
+#include "ray_packet.h"
+#include "shared_array.h"
+#include "statistics.h"
+#include "thread_pool.h"
+#include "wide_bvh.h"
+
+// Linearized BVH over primitives known only by their bounding boxes
+// Owners keep their primitives in the order given by primitive_order() so that
+// leaf ranges index them directly.
+//
+// Motion trees, over primitives moving during the shutter interval, bound
+// every node at both ends of its time range and test rays against the bounds
+// at their own time, rather than against everything a primitive sweeps
+// through.
+class BVHTree {
+public:
+  BVHTree() {}
+
+  explicit BVHTree(const std::vector<BoundingBox>& primitive_bounds, const BVHBuildSettings& settings = BVHBuildSettings()) {
+    this->build(primitive_bounds, settings, this->nodes, this->wide4, this->wide8);
+  }
+
+  // Motion tree over primitives bounded at times 0 and 1
+  explicit BVHTree(const std::vector<LinearBounds>& primitive_bounds, const BVHBuildSettings& settings = BVHBuildSettings()) {
+    this->build(primitive_bounds, settings, this->motion_nodes, this->motion4, this->motion8);
+  }
+
+  bool is_motion() const { return !this->motion_nodes.empty(); }
+
+  // primitive_order()[i] is the original index of the primitive now at i.
+  // Motion trees may list a primitive several times, so it can be longer
+  // than the primitive count. Empty for trees read from a cache, whose
+  // primitives are in order already.
+  const std::vector<std::uint32_t>& primitive_order() const { return this->order; }
+
+  // Sections base to base + cache_sections - 1 of a cache file
+  static constexpr std::uint32_t cache_sections = 7;
+
+  void add_to_cache(BVHCache::Writer& writer, std::uint32_t base) const {
+    writer.add(base, &this->stats, 1);
+    writer.add(base + 1, this->nodes);
+    writer.add(base + 2, this->wide4);
+    writer.add(base + 3, this->wide8);
+    writer.add(base + 4, this->motion_nodes);
+    writer.add(base + 5, this->motion4);
+    writer.add(base + 6, this->motion8);
+  }
+
+  // The tree add_to_cache stored, traversed straight from the mapping
+  static std::optional<BVHTree> from_cache(const BVHCache::File& file, std::uint32_t base) {
+    const std::optional<SharedArray<BVHStatistics>> stats = file.section<BVHStatistics>(base);
+    std::optional<SharedArray<BVHNode>> nodes = file.section<BVHNode>(base + 1);
+    std::optional<SharedArray<WideBVHNode<4>>> wide4 = file.section<WideBVHNode<4>>(base + 2);
+    std::optional<SharedArray<WideBVHNode<8>>> wide8 = file.section<WideBVHNode<8>>(base + 3);
+    std::optional<SharedArray<MotionBVHNode>> motion_nodes = file.section<MotionBVHNode>(base + 4);
+    std::optional<SharedArray<WideMotionBVHNode<4>>> motion4 = file.section<WideMotionBVHNode<4>>(base + 5);
+    std::optional<SharedArray<WideMotionBVHNode<8>>> motion8 = file.section<WideMotionBVHNode<8>>(base + 6);
+    if (!stats || stats->size() != 1 || !nodes || !wide4 || !wide8 || !motion_nodes || !motion4 || !motion8 ||
+        nodes->empty() == motion_nodes->empty()) {
+      return std::nullopt;
+    }
+
+    BVHTree tree;
+    tree.stats = (*stats)[0];
+    tree.nodes = std::move(*nodes);
+    tree.wide4 = std::move(*wide4);
+    tree.wide8 = std::move(*wide8);
+    tree.motion_nodes = std::move(*motion_nodes);
+    tree.motion4 = std::move(*motion4);
+    tree.motion8 = std::move(*motion8);
+    return tree;
+  }
+
+  const BVHStatistics& statistics() const { return this->stats; }
+
+  // Bytes held by the nodes and the primitive order
+  size_t memory_bytes() const {
+    return this->nodes.size() * sizeof(BVHNode) +
+           (this->order.size() + this->wide_sources.size()) * sizeof(std::uint32_t) +
+           this->wide4.size() * sizeof(WideBVHNode<4>) + this->wide8.size() * sizeof(WideBVHNode<8>) +
+           this->motion_nodes.size() * sizeof(MotionBVHNode) +
+           this->motion4.size() * sizeof(WideMotionBVHNode<4>) + this->motion8.size() * sizeof(WideMotionBVHNode<8>);
+  }
+
+  // Over the whole shutter interval for motion trees
+  BoundingBox bounding_box() const {
+    if (this->is_motion()) return this->motion_nodes[0].bounding_box().swept();
+    return this->nodes.empty() ? BoundingBox() : this->nodes[0].bounding_box();
+  }
+
+  // Refits the bounds of every node to primitives that moved, keeping the
+  // shape of the tree, e.g. between the frames of an animation.
+  // leaf_bounds(first, count, time_begin, time_end) returns the LinearBounds
+  // of primitives [first, first + count) in leaf order over that part of the
+  // shutter interval; static trees keep their swept box. Subtrees of more
+  // than settings.parallel_threshold nodes are refitted as tasks on pool.
+  // Returns the SAH cost of the refitted tree, to compare with that of the
+  // build in statistics(). Trees read from a cache cannot be refitted.
+  template <typename LeafBounds>
+  double refit(LeafBounds&& leaf_bounds, const BVHBuildSettings& settings, ThreadPool& pool) {
+    Statistics::PhaseTimer timer(Statistics::Phase::Build);
+    if (this->is_motion()) {
+      return this->refit(this->motion_nodes, this->motion4, this->motion8, leaf_bounds, settings, pool);
+    }
+    return this->refit(this->nodes, this->wide4, this->wide8, leaf_bounds, settings, pool);
+  }
+
+  // Iterative closest-hit traversal
+  // intersect(primitive, ray_t) tests one primitive, shrinks ray_t.max when it
+  // finds a closer hit and returns whether it did. Near children go first, so
+  // that shrinking prunes the far ones.
+  template <typename IntersectPrimitive>
+  bool traverse(const Ray& ray, Interval ray_t, IntersectPrimitive&& intersect) const {
+    return this->traverse_leaves(ray, ray_t, [&](std::uint32_t first, std::uint32_t count, Interval& t) {
+      bool hit_anything = false;
+      for (std::uint32_t i = first; i < first + count; i++) {
+        hit_anything |= intersect(i, t);
+      }
+      return hit_anything;
+    });
+  }
+
+  // Same, but intersect_leaf(first, count, ray_t) receives a whole leaf range,
+  // for owners that test several primitives at once
+  template <typename IntersectLeaf>
+  bool traverse_leaves(const Ray& ray, Interval ray_t, IntersectLeaf&& intersect_leaf) const {
+    return this->walk<false>(ray, ray_t, intersect_leaf);
+  }
+
+  // Any-hit traversal for occlusion queries: stops at the first leaf for which
+  // test_leaf(first, count, ray_t) returns true
+  template <typename TestLeaf>
+  bool occluded(const Ray& ray, Interval ray_t, TestLeaf&& test_leaf) const {
+    return this->walk<true>(ray, ray_t, test_leaf);
+  }
+
+  // Packet traversal over the binary nodes: a node is entered when any active
+  // ray of the packet hits it, carrying the mask of rays that may.
+  // intersect_leaf(first, count, mask) tests a leaf against the rays in mask
+  // and narrows their t_max. Children are ordered by the lowest active ray.
+  // Once fewer than packet_split_rays rays are left in the mask, they have
+  // diverged, and each traces the rest of the subtree on its own.
+  // Rays of a packet differ in time, so motion trees trace them one by one.
+  static constexpr int packet_split_rays = 4;
+
+  template <typename IntersectLeaf>
+  void traverse_packet(RayPacket& packet, IntersectLeaf&& intersect_leaf) const {
+    // Ray i alone, through the subtree at root of the binary nodes
+    const auto trace_ray = [&](const auto& nodes, int i, std::uint32_t root) {
+      auto intersect_ray = [&](std::uint32_t first, std::uint32_t count, Interval& t) {
+        const Real before = packet.t_max[i];
+        intersect_leaf(first, count, 1ULL << i);
+        t.max = packet.t_max[i];
+        return t.max < before;
+      };
+      BVHTree::walk_binary<false>(nodes, packet.rays[i], packet.interval(i), intersect_ray, root);
+    };
+    if (this->is_motion()) {
+      for (int ray = 0; ray < packet.size; ray++) trace_ray(this->motion_nodes, ray, 0);
+      return;
+    }
+    if (this->nodes.empty() || packet.size == 0) return;
+
+    struct Entry {
+      std::uint32_t node;
+      std::uint64_t mask;
+    };
+    Entry stack[BVHBuilder::max_depth];
+    int stack_size = 0;
+    Entry current{0, packet.all()};
+
+    while (true) {
+      if (RayPacket::count(current.mask) < packet_split_rays) {
+        for (std::uint64_t rest = current.mask; rest != 0; rest &= rest - 1) {
+          trace_ray(this->nodes, RayPacket::lowest_ray(rest), current.node);
+        }
+        if (stack_size == 0) break;
+        current = stack[--stack_size];
+        continue;
+      }
+      const BVHNode& node = this->nodes[current.node];
+      const std::uint64_t mask = BVHTree::packet_hit(node, packet, current.mask);
+      if (mask != 0) {
+        if (node.is_leaf()) {
+          const std::uint64_t exact = BVHTree::packet_hit_exact(node, packet, mask);
+          if (exact != 0) intersect_leaf(node.offset, (std::uint32_t)node.count, exact);
+        } else {
+          const int lead = RayPacket::lowest_ray(mask);
+          if (packet.inverse_direction[node.axis][lead] < 0) {
+            stack[stack_size++] = Entry{current.node + 1, mask};
+            current = Entry{node.offset, mask};
+          } else {
+            stack[stack_size++] = Entry{node.offset, mask};
+            current = Entry{current.node + 1, mask};
+          }
+          continue;
+        }
+      }
+      if (stack_size == 0) break;
+      current = stack[--stack_size];
+    }
+  }
+
+private:
+  // Either nodes or motion_nodes is filled, and at most one of the wide
+  // arrays, depending on BVHBuildSettings::width
+  SharedArray<BVHNode> nodes;
+  std::vector<std::uint32_t> order;
+  BVHStatistics stats;
+  SharedArray<WideBVHNode<4>> wide4;
+  SharedArray<WideBVHNode<8>> wide8;
+  SharedArray<MotionBVHNode> motion_nodes;
+  SharedArray<WideMotionBVHNode<4>> motion4;
+  SharedArray<WideMotionBVHNode<8>> motion8;
+  // Binary node behind every slot of the wide nodes, for refit
+  std::vector<std::uint32_t> wide_sources;
+
+  template <typename Node, typename Wide4, typename Wide8>
+  void build(const std::vector<typename Node::Box>& primitive_bounds, const BVHBuildSettings& settings,
+             SharedArray<Node>& binary_nodes, SharedArray<Wide4>& wide4_nodes, SharedArray<Wide8>& wide8_nodes) {
+    Statistics::PhaseTimer timer(Statistics::Phase::Build);
+    BVHBuilderT<Node> builder(primitive_bounds, settings);
+    std::vector<Node> binary;
+    builder.build(binary, this->order);
+    this->stats = builder.statistics();
+
+    assert((settings.width == 2 || settings.width == 4 || settings.width == 8) && "[ERROR] BVH width must be 2, 4 or 8");
+    if (settings.width == 4) wide4_nodes = SharedArray<Wide4>(WideBVH::collapse<Wide4>(binary, &this->wide_sources));
+    if (settings.width == 8) wide8_nodes = SharedArray<Wide8>(WideBVH::collapse<Wide8>(binary, &this->wide_sources));
+    binary_nodes = SharedArray<Node>(std::move(binary));
+  }
+
+  template <typename Node, typename Wide4, typename Wide8, typename LeafBounds>
+  double refit(SharedArray<Node>& binary_nodes, SharedArray<Wide4>& wide4_nodes, SharedArray<Wide8>& wide8_nodes,
+               LeafBounds& leaf_bounds, const BVHBuildSettings& settings, ThreadPool& pool) {
+    Node* binary = binary_nodes.writable_data();
+    assert(binary && "[ERROR] Only BVHs built in memory can be refitted");
+    const double cost = BVHTree::refit_subtree(binary, 0, (std::uint32_t)binary_nodes.size(), leaf_bounds,
+                                               settings, pool);
+    BVHTree::refit_wide(wide4_nodes, this->wide_sources, binary, settings, pool);
+    BVHTree::refit_wide(wide8_nodes, this->wide_sources, binary, settings, pool);
+
+    // Normalized like BVHBuilder::statistics; a flat root cannot compare
+    const double root_area = binary[0].bounding_box().surface_area();
+    return root_area > 0 ? cost / root_area : this->stats.sah_cost;
+  }
+
+  // Refits the subtree of node index, which ends before node end, and
+  // returns its SAH cost before normalization. Nodes come after their
+  // parent in depth-first order, so one backwards pass over a subtree
+  // refits children first; only subtrees above parallel_threshold nodes
+  // fork.
+  template <typename Node, typename LeafBounds>
+  static double refit_subtree(Node* nodes, std::uint32_t index, std::uint32_t end, LeafBounds& leaf_bounds,
+                              const BVHBuildSettings& settings, ThreadPool& pool) {
+    const Node& node = nodes[index];
+    if (node.is_leaf() || end - index <= settings.parallel_threshold) {
+      double cost = 0;
+      for (std::uint32_t i = end; i-- > index;) cost += BVHTree::refit_node(nodes, i, leaf_bounds, settings);
+      return cost;
+    }
+    double first_cost = 0;
+    TaskGroup group(pool);
+    group.run([&] { first_cost = BVHTree::refit_subtree(nodes, index + 1, node.offset, leaf_bounds, settings, pool); });
+    const double second_cost = BVHTree::refit_subtree(nodes, node.offset, end, leaf_bounds, settings, pool);
+    group.wait();
+    return first_cost + second_cost + BVHTree::refit_node(nodes, index, leaf_bounds, settings);
+  }
+
+  // Refits one node after its children and returns its share of the SAH cost
+  template <typename Node, typename LeafBounds>
+  static double refit_node(Node* nodes, std::uint32_t index, LeafBounds& leaf_bounds,
+                           const BVHBuildSettings& settings) {
+    Node& node = nodes[index];
+    double area;
+    if constexpr (Node::motion) {
+      const float time_begin = node.time_begin, time_end = node.time_end;
+      if (node.is_leaf()) {
+        node.set_bounds(leaf_bounds(node.offset, (std::uint32_t)node.count, time_begin, time_end), time_begin, time_end);
+      } else if (node.axis == Node::time_axis) {
+        // Children bounded over halves of the time range do not bound it
+        // linearly, so the primitives of either child are bounded again
+        std::uint32_t first = index + 1, last = index + 1;
+        while (!nodes[first].is_leaf()) first++;
+        while (!nodes[last].is_leaf()) last = nodes[last].offset;
+        const std::uint32_t offset = nodes[first].offset;
+        node.set_bounds(leaf_bounds(offset, nodes[last].offset + nodes[last].count - offset, time_begin, time_end),
+                        time_begin, time_end);
+      } else {
+        // Adds a margin for interpolating these bounds on top of the children's
+        node.set_bounds(LinearBounds(nodes[index + 1].bounding_box(), nodes[node.offset].bounding_box()),
+                        time_begin, time_end);
+      }
+      // Rays only visit either half of a time split
+      area = node.bounding_box().surface_area() * (time_end - time_begin);
+    } else {
+      if (node.is_leaf()) {
+        node.set_bounds(leaf_bounds(node.offset, (std::uint32_t)node.count, 0, 1).swept());
+      } else {
+        // Unions of floats are exact
+        const Node& first = nodes[index + 1];
+        const Node& second = nodes[node.offset];
+        for (int axis = 0; axis < 3; axis++) {
+          node.bounds_min[axis] = std::min(first.bounds_min[axis], second.bounds_min[axis]);
+          node.bounds_max[axis] = std::max(first.bounds_max[axis], second.bounds_max[axis]);
+        }
+      }
+      area = node.bounding_box().surface_area();
+    }
+    return area * (node.is_leaf() ? node.count * settings.intersection_cost : settings.traversal_cost);
+  }
+
+  // Copies the refitted bounds of the binary nodes into the wide nodes
+  template <typename Wide, typename Node>
+  static void refit_wide(SharedArray<Wide>& wide_nodes, const std::vector<std::uint32_t>& sources,
+                         const Node* binary, const BVHBuildSettings& settings, ThreadPool& pool) {
+    if (wide_nodes.empty()) return;
+    Wide* wide = wide_nodes.writable_data();
+    assert(wide && sources.size() == wide_nodes.size() * Wide::width && "[ERROR] Wide BVH cannot be refitted");
+    const size_t count = wide_nodes.size();
+    const size_t block = std::max<size_t>(settings.parallel_threshold, 1);
+    TaskGroup group(pool);
+    for (size_t first = 0; first < count; first += block) {
+      group.run([&, first] {
+        for (size_t i = first; i < std::min(first + block, count); i++) {
+          for (int slot = 0; slot < Wide::width; slot++) {
+            const std::uint32_t source = sources[i * Wide::width + slot];
+            if (source != WideBVH::no_source) wide[i].set_child_bounds(slot, binary[source]);
+          }
+        }
+      });
+    }
+    group.wait();
+  }
+
+  template <bool AnyHit, typename IntersectLeaf>
+  bool walk(const Ray& ray, Interval ray_t, IntersectLeaf& intersect_leaf) const {
+    if (!this->wide4.empty()) return WideBVH::traverse<AnyHit>(this->wide4, ray, ray_t, intersect_leaf);
+    if (!this->wide8.empty()) return WideBVH::traverse<AnyHit>(this->wide8, ray, ray_t, intersect_leaf);
+    if (!this->motion4.empty()) return WideBVH::traverse<AnyHit>(this->motion4, ray, ray_t, intersect_leaf);
+    if (!this->motion8.empty()) return WideBVH::traverse<AnyHit>(this->motion8, ray, ray_t, intersect_leaf);
+    if (this->is_motion()) return BVHTree::walk_binary<AnyHit>(this->motion_nodes, ray, ray_t, intersect_leaf);
+    return BVHTree::walk_binary<AnyHit>(this->nodes, ray, ray_t, intersect_leaf);
+  }
+
+  template <bool AnyHit, typename Node, typename IntersectLeaf>
+  static bool walk_binary(const SharedArray<Node>& nodes, const Ray& ray, Interval ray_t,
+                          IntersectLeaf& intersect_leaf, std::uint32_t root = 0) {
+    if (nodes.empty()) return false;
+    const Point3& origin = ray.origin();
+    const Vect3& direction = ray.direction();
+    const Vect3 inverse_direction(1.0 / direction[0], 1.0 / direction[1], 1.0 / direction[2]);
+    // Time splits order their children by time instead
+    const bool direction_negative[4] = { direction[0] < 0, direction[1] < 0, direction[2] < 0, false };
+
+    std::uint32_t stack[BVHBuilder::max_depth];
+    int stack_size = 0;
+    std::uint32_t current = root;
+    bool hit_anything = false;
+    Statistics::TraversalTally tally;
+
+    while (true) {
+      const Node& node = nodes[current];
+      tally.visit(1);
+      if (BVHTree::hit(node, origin, inverse_direction, ray.time(), ray_t)) {
+        if (node.is_leaf()) {
+          const bool hit_leaf = intersect_leaf(node.offset, (std::uint32_t)node.count, ray_t);
+          if (AnyHit && hit_leaf) return true;
+          hit_anything |= hit_leaf;
+        } else {
+          // First child is the lower one along the split axis
+          if (direction_negative[node.axis]) {
+            stack[stack_size++] = current + 1;
+            current = node.offset;
+          } else {
+            stack[stack_size++] = node.offset;
+            current = current + 1;
+          }
+          continue;
+        }
+      }
+      if (stack_size == 0) break;
+      current = stack[--stack_size];
+    }
+    return hit_anything;
+  }
+
+  static bool hit(const BVHNode& node, const Point3& origin, const Vect3& inverse_direction, Real,
+                  const Interval& ray_t) {
+    return node.hit(origin, inverse_direction, ray_t).has_value();
+  }
+
+  static bool hit(const MotionBVHNode& node, const Point3& origin, const Vect3& inverse_direction, Real time,
+                  const Interval& ray_t) {
+    return node.covers(time) && node.hit(origin, inverse_direction, time, ray_t).has_value();
+  }
+
+  // Any-active-ray test (Wald et al. 2001): rays are tested in order until one
+  // hits, and that ray plus every later active ray enter the node untested.
+  // Coherent packets thus pay about one slab test per node; leaves filter the
+  // mask exactly before testing primitives.
+  static std::uint64_t packet_hit(const BVHNode& node, const RayPacket& packet, std::uint64_t mask) {
+    for (std::uint64_t rest = mask; rest != 0; rest &= rest - 1) {
+      const int i = RayPacket::lowest_ray(rest);
+      if (BVHTree::slab_test(node, packet, i)) return rest;
+    }
+    return 0;
+  }
+
+  // Exact mask of the rays in mask that overlap the node bounds
+  static std::uint64_t packet_hit_exact(const BVHNode& node, const RayPacket& packet, std::uint64_t mask) {
+    std::uint64_t result = 0;
+    for (std::uint64_t rest = mask; rest != 0; rest &= rest - 1) {
+      const int i = RayPacket::lowest_ray(rest);
+      if (BVHTree::slab_test(node, packet, i)) result |= 1ULL << i;
+    }
+    return result;
+  }
+
+  static bool slab_test(const BVHNode& node, const RayPacket& packet, int i) {
+    float t_enter = packet.t_min_lane[i];
+    float t_exit = packet.t_max_lane[i];
+    for (int axis = 0; axis < 3; axis++) {
+      const float t0 = (node.bounds_min[axis] - packet.origin[axis][i]) * packet.inverse_direction[axis][i];
+      const float t1 = (node.bounds_max[axis] - packet.origin[axis][i]) * packet.inverse_direction[axis][i];
+      t_enter = std::max(t_enter, std::min(t0, t1));
+      t_exit = std::min(t_exit, std::max(t0, t1));
+    }
+    return t_enter <= t_exit * WideBVH::exit_scale;
+  }
+};
+
+// Bounding Volume Hierarchy over arbitrary Hittables, e.g. the top level
+// over Instances
+class BVH final : public Hittable {
+public:
+  // constructor: copy construct HittableList
+  BVH(HittableList list, const BVHBuildSettings& settings = BVHBuildSettings())
+      : objects(std::move(list.objects)), settings(settings) {
+    this->rebuild();
+  }
+
+  // Builds the tree again over the objects' current bounding boxes, e.g.
+  // after instances moved. Only boxes are read, so trees inside the
+  // objects are not rebuilt.
+  void rebuild() {
+    std::vector<BoundingBox> bounds;
+    bounds.reserve(this->objects.size());
+    for (const std::shared_ptr<Hittable>& object : this->objects) {
+      bounds.push_back(object->bounding_box());
+    }
+    this->tree = BVHTree(bounds, this->settings);
+    std::clog << "[LOG] " << this->tree.statistics() << std::endl;
+
+    // Store primitives in leaf order
+    std::vector<std::shared_ptr<Hittable>> ordered;
+    ordered.reserve(this->objects.size());
+    for (std::uint32_t index : this->tree.primitive_order()) {
+      ordered.push_back(std::move(this->objects[index]));
+    }
+    this->objects = std::move(ordered);
+    this->bbox = this->tree.bounding_box();
+  }
+
+  bool intersect(const Ray& ray, Interval& ray_t, Intersection& intersection) const override {
+    const bool hit_anything = this->tree.traverse(ray, ray_t, [&](std::uint32_t primitive, Interval& t) {
+      return this->objects[primitive]->intersect(ray, t, intersection);
+    });
+    if (hit_anything) ray_t.max = intersection.t;
+    return hit_anything;
+  }
+
+  // Intersections name the primitive's own object, never the BVH
+  HitRecord finalize(const Ray& ray, const Intersection& intersection) const override {
+    assert(intersection.object != this && "[ERROR] Aggregates cannot finalize hits");
+    return intersection.object->finalize(ray, intersection);
+  }
+
+  bool occluded(const Ray& ray, const Interval ray_t) const override {
+    return this->tree.occluded(ray, ray_t, [&](std::uint32_t first, std::uint32_t count, Interval& t) {
+      for (std::uint32_t i = first; i < first + count; i++) {
+        if (this->objects[i]->occluded(ray, t)) return true;
+      }
+      return false;
+    });
+  }
+
+  // Objects reached by enough rays of the packet trace the whole packet with
+  // their own packet traversal: the rays that missed the object's box are
+  // dropped at its root. Fewer rays are traced one by one.
+  void intersect_packet(RayPacket& packet, Intersection* intersections) const override {
+    this->tree.traverse_packet(packet, [&](std::uint32_t first, std::uint32_t count, std::uint64_t mask) {
+      for (std::uint32_t i = first; i < first + count; i++) {
+        if (RayPacket::count(mask) >= BVHTree::packet_split_rays) {
+          this->objects[i]->intersect_packet(packet, intersections);
+          continue;
+        }
+        for (std::uint64_t rest = mask; rest != 0; rest &= rest - 1) {
+          const int ray = RayPacket::lowest_ray(rest);
+          Interval t = packet.interval(ray);
+          if (this->objects[i]->intersect(packet.rays[ray], t, intersections[ray])) packet.narrow(ray, t.max);
+        }
+      }
+    });
+  }
+
+  BoundingBox bounding_box() const override {
+    return this->bbox;
+  };
+
+private:
+  std::vector<std::shared_ptr<Hittable>> objects;
+  BVHBuildSettings settings;
+  BVHTree tree;
+  BoundingBox bbox;
+};
@@ -0,0 +1,439 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "bounding_box.h"
+#include "bvh_node.h"
+#include "thread_pool.h"
+
+struct BVHBuildSettings {
+  // Leaves may hold up to this many primitives (at most 65535)
+  int max_leaf_size = 4;
+  int bin_count = 16; // At most BVHBuilder::max_bin_count
+  // Relative costs of one node visit and one primitive test in the SAH
+  double traversal_cost = 1.0;
+  double intersection_cost = 1.0;
+  // 2 keeps the binary tree; 4 or 8 collapse it into a wide BVH traversed
+  // with one SIMD slab test per node (SSE for 4, AVX for 8, else scalar)
+  int width = 4;
+  // 0 means one thread per hardware thread
+  int thread_count = 0;
+  // Ranges smaller than this are built by the thread that reaches them
+  size_t parallel_threshold = 4096;
+  // Motion BVHs may split a node's time range in half instead of its
+  // primitives, where that is cheaper, up to this many times between the
+  // root and a leaf. Both halves reference every primitive of the node.
+  int max_time_splits = 3;
+};
+
+struct BVHStatistics {
+  size_t primitive_count = 0;
+  size_t node_count = 0;
+  size_t leaf_count = 0;
+  size_t largest_leaf = 0;
+  int max_depth = 0;
+  size_t time_split_count = 0;
+  double average_leaf_depth = 0;
+  double average_leaf_size = 0;
+  // Expected cost of a random ray hitting the root, in SAH units
+  double sah_cost = 0;
+  double build_seconds = 0;
+};
+
+inline std::ostream &operator<<(std::ostream &out, const BVHStatistics& stats) {
+  return out << "BVH " << stats.primitive_count << " primitives, "
+             << stats.node_count << " nodes, " << stats.leaf_count << " leaves"
+             << " (average " << stats.average_leaf_size << ", largest " << stats.largest_leaf << " primitives)"
+             << ", depth " << stats.max_depth << " (leaf average " << stats.average_leaf_depth << ")"
+             << (stats.time_split_count > 0 ? ", " + std::to_string(stats.time_split_count) + " time splits" : "")
+             << ", SAH cost " << stats.sah_cost
+             << ", built in " << stats.build_seconds * 1000 << " ms";
+}
+
+// Top-down binned Surface Area Heuristic builder (Wald 2007)
+// Subtrees above parallel_threshold primitives are built as separate tasks;
+// the result is then flattened into depth-first order. The tree only depends
+// on the input, never on the thread count.
+//
+// Node is BVHNode, over BoundingBoxes, or MotionBVHNode, over the
+// LinearBounds of primitives moving during the shutter interval [0, 1]
+// (Gruenschloss et al. 2011, "MSBVH"). Motion trees weigh their splits by the
+// area averaged over time, and may split in time where primitives moving
+// apart make that cheaper than any split in space; the primitives of a time
+// split are then copied and bounded over each half.
+template <typename Node>
+class BVHBuilderT {
+public:
+  using Box = typename Node::Box;
+  static constexpr int max_depth = 64;
+  static constexpr int max_bin_count = 64;
+
+  BVHBuilderT(const std::vector<Box>& bounds, const BVHBuildSettings& settings) :
+    bounds(bounds), settings(settings) {
+    assert(!bounds.empty() && "[ERROR] BVH needs at least one primitive");
+    assert(1 <= settings.max_leaf_size && settings.max_leaf_size <= 65535 && "[ERROR] Leaf size out of range");
+    assert(2 <= settings.bin_count && settings.bin_count <= max_bin_count && "[ERROR] Bin count out of range");
+  }
+
+  // order lists the primitives of every leaf in turn, as indices into
+  // bounds; primitives of time splits appear more than once
+  void build(std::vector<Node>& nodes, std::vector<std::uint32_t>& order) {
+    const auto start_time = std::chrono::steady_clock::now();
+
+    this->primitives.resize(this->bounds.size());
+    for (size_t i = 0; i < this->bounds.size(); i++) {
+      this->primitives[i] = BuildPrimitive{this->bounds[i], this->bounds[i].centroid(), (std::uint32_t)i};
+    }
+
+    const unsigned threads = this->settings.thread_count > 0
+        ? (unsigned)this->settings.thread_count
+        : ThreadPool::hardware_threads();
+    std::unique_ptr<BuildNode> root;
+    {
+      ThreadPool pool(threads - 1);
+      BuildPrimitive* first = this->primitives.data();
+      root = this->build_recursive(pool, first, first + this->primitives.size(), 0, TimeRange{0, 1}, 0);
+    }
+
+    nodes.clear();
+    nodes.reserve(this->node_count);
+    order.clear();
+    order.reserve(this->primitives.size());
+    BVHBuilderT::flatten(*root, nodes, order);
+
+    this->stats = BVHBuilderT::statistics(nodes, this->settings);
+    this->stats.build_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+  }
+
+  const BVHStatistics& statistics() const { return this->stats; }
+
+  // Tree quality of an already built node array
+  static BVHStatistics statistics(const std::vector<Node>& nodes, const BVHBuildSettings& settings) {
+    BVHStatistics stats;
+    if (nodes.empty()) return stats;
+
+    stats.node_count = nodes.size();
+    const double root_area = nodes[0].bounding_box().surface_area();
+    double leaf_depth_sum = 0;
+
+    std::vector<std::pair<std::uint32_t, int>> stack = {{0, 0}};
+    while (!stack.empty()) {
+      const auto [index, depth] = stack.back();
+      stack.pop_back();
+      const Node& node = nodes[index];
+      double area_ratio = root_area > 0 ? node.bounding_box().surface_area() / root_area : 1;
+      // Rays only visit either half of a time split
+      if constexpr (Node::motion) area_ratio *= node.time_end - node.time_begin;
+
+      stats.max_depth = std::max(stats.max_depth, depth);
+      if (node.is_leaf()) {
+        stats.leaf_count++;
+        stats.primitive_count += node.count;
+        stats.largest_leaf = std::max(stats.largest_leaf, (size_t)node.count);
+        leaf_depth_sum += depth;
+        stats.sah_cost += area_ratio * node.count * settings.intersection_cost;
+      } else {
+        if constexpr (Node::motion) stats.time_split_count += node.axis == Node::time_axis;
+        stats.sah_cost += area_ratio * settings.traversal_cost;
+        stack.push_back({index + 1, depth + 1});
+        stack.push_back({node.offset, depth + 1});
+      }
+    }
+    stats.average_leaf_depth = leaf_depth_sum / stats.leaf_count;
+    stats.average_leaf_size = (double)stats.primitive_count / stats.leaf_count;
+    return stats;
+  }
+
+private:
+  // Partitioned in place while building, so every pass reads memory linearly
+  struct BuildPrimitive {
+    Box bbox;
+    Point3 centroid;
+    std::uint32_t index;
+  };
+
+  struct TimeRange {
+    float begin, end;
+  };
+
+  struct BuildNode {
+    Box bbox;
+    TimeRange time{0, 1};
+    std::unique_ptr<BuildNode> children[2];
+    // Leaves only
+    const BuildPrimitive* first = nullptr;
+    size_t count = 0;
+    int axis = 0;
+    // Time splits only: the primitives of the later half
+    std::vector<BuildPrimitive> copies;
+  };
+
+  struct Split {
+    BuildPrimitive* mid;
+    int axis;
+    // Relative SAH cost, infinite for fallback median splits
+    double cost;
+  };
+
+  struct Bin {
+    Box bbox;
+    size_t count = 0;
+  };
+
+  const std::vector<Box>& bounds;
+  const BVHBuildSettings settings;
+  std::vector<BuildPrimitive> primitives;
+  std::atomic<size_t> node_count{0};
+  BVHStatistics stats;
+
+  // Builds the subtree over [begin, end), bounded over time (always [0, 1]
+  // for BVHNodes) after time_splits splits in time on the way from the root
+  std::unique_ptr<BuildNode> build_recursive(ThreadPool& pool, BuildPrimitive* begin, BuildPrimitive* end,
+                                             int depth, TimeRange time, int time_splits) {
+    const size_t object_span = (size_t)(end - begin);
+    assert(object_span > 0 && "[ERROR] Object Span out of range");
+    this->node_count.fetch_add(1, std::memory_order_relaxed);
+
+    std::unique_ptr<BuildNode> node = std::make_unique<BuildNode>();
+    node->time = time;
+    BoundingBox centroid_bounds;
+    for (const BuildPrimitive* primitive = begin; primitive < end; primitive++) {
+      node->bbox = Box(node->bbox, primitive->bbox);
+      const Point3& c = primitive->centroid;
+      centroid_bounds = BoundingBox(centroid_bounds, BoundingBox(c, c));
+    }
+
+    const size_t max_leaf_size = (size_t)this->settings.max_leaf_size;
+    if (object_span == 1) {
+      return BVHBuilderT::make_leaf(std::move(node), begin, object_span);
+    }
+
+    int axis = centroid_bounds.longest_axis();
+    const Interval& extent = centroid_bounds.axis_interval(axis);
+    BuildPrimitive* mid;
+
+    if (extent.size() <= 0) {
+      // All centroids coincide: nothing to bin
+      if (object_span <= max_leaf_size) return BVHBuilderT::make_leaf(std::move(node), begin, object_span);
+      mid = begin + object_span / 2;
+    } else if (depth >= max_depth / 2) {
+      // Degenerate input: median splits bound the remaining depth to log2(n)
+      if (object_span <= max_leaf_size) return BVHBuilderT::make_leaf(std::move(node), begin, object_span);
+      mid = BVHBuilderT::median_split(begin, end, axis);
+    } else {
+      const std::optional<Split> split = this->sah_split(node->bbox, centroid_bounds, begin, end);
+      if (!split.has_value()) return BVHBuilderT::make_leaf(std::move(node), begin, object_span);
+      if constexpr (Node::motion) {
+        if (time_splits < this->settings.max_time_splits &&
+            this->time_split_cost(node->bbox, begin, end, time) < split->cost) {
+          return this->time_split(pool, std::move(node), begin, end, depth, time_splits);
+        }
+      }
+      mid = split->mid;
+      axis = split->axis;
+      if (mid == begin || mid == end) mid = BVHBuilderT::median_split(begin, end, axis);
+    }
+
+    node->axis = axis;
+    this->build_children(pool, *node, begin, mid, mid, end, depth, time, time, time_splits);
+    return node;
+  }
+
+  // Builds children over [first_begin, first_end) during first_time and
+  // [second_begin, second_end) during second_time, as tasks if large
+  void build_children(ThreadPool& pool, BuildNode& node,
+                      BuildPrimitive* first_begin, BuildPrimitive* first_end,
+                      BuildPrimitive* second_begin, BuildPrimitive* second_end,
+                      int depth, TimeRange first_time, TimeRange second_time, int time_splits) {
+    const auto build_first = [&] {
+      node.children[0] = this->build_recursive(pool, first_begin, first_end, depth + 1, first_time, time_splits);
+    };
+    const auto build_second = [&] {
+      node.children[1] = this->build_recursive(pool, second_begin, second_end, depth + 1, second_time, time_splits);
+    };
+    if ((size_t)(first_end - first_begin) + (size_t)(second_end - second_begin) >= this->settings.parallel_threshold) {
+      TaskGroup group(pool);
+      group.run(build_first);
+      build_second();
+      group.wait();
+    } else {
+      build_first();
+      build_second();
+    }
+  }
+
+  static std::unique_ptr<BuildNode> make_leaf(std::unique_ptr<BuildNode> node, const BuildPrimitive* first,
+                                              size_t count) {
+    node->first = first;
+    node->count = count;
+    return node;
+  }
+
+  static BuildPrimitive* median_split(BuildPrimitive* begin, BuildPrimitive* end, int axis) {
+    BuildPrimitive* mid = begin + (end - begin) / 2;
+    std::nth_element(begin, mid, end, [axis](const BuildPrimitive& a, const BuildPrimitive& b) {
+      return a.centroid[axis] < b.centroid[axis];
+    });
+    return mid;
+  }
+
+  // Bins centroids along all three axes and partitions at the cheapest plane.
+  // Returns nothing when a leaf is cheaper and allowed.
+  std::optional<Split> sah_split(const Box& bbox, const BoundingBox& centroid_bounds,
+                                 BuildPrimitive* begin, BuildPrimitive* end) {
+    const size_t object_span = (size_t)(end - begin);
+    // Small ranges gain nothing from more bins than primitives
+    const int bin_count = (int)std::min<size_t>(this->settings.bin_count, std::max<size_t>(object_span, 2));
+
+    double best_cost = std::numeric_limits<double>::infinity();
+    int best_axis = -1, best_bin = 0;
+
+    // One pass over the primitives fills the bins of all three axes
+    thread_local Bin bins[3][max_bin_count];
+    double scale[3];
+    for (int axis = 0; axis < 3; axis++) {
+      std::fill(bins[axis], bins[axis] + bin_count, Bin());
+      const double size = centroid_bounds.axis_interval(axis).size();
+      scale[axis] = size > 0 ? bin_count / size : 0;
+    }
+    for (const BuildPrimitive* primitive = begin; primitive < end; primitive++) {
+      for (int axis = 0; axis < 3; axis++) {
+        const double offset = primitive->centroid[axis] - centroid_bounds.axis_interval(axis).min;
+        Bin& bin = bins[axis][std::min(bin_count - 1, (int)(offset * scale[axis]))];
+        bin.bbox = Box(bin.bbox, primitive->bbox);
+        bin.count++;
+      }
+    }
+
+    double right_area[max_bin_count];
+    size_t right_count[max_bin_count];
+    for (int axis = 0; axis < 3; axis++) {
+      if (scale[axis] == 0) continue;
+
+      // Sweep right to left, then left to right; a plane after bin i splits
+      // bins [0, i] from [i + 1, bin_count)
+      Box accumulated;
+      size_t count = 0;
+      for (int i = bin_count - 1; i > 0; i--) {
+        accumulated = Box(accumulated, bins[axis][i].bbox);
+        count += bins[axis][i].count;
+        right_area[i] = accumulated.surface_area();
+        right_count[i] = count;
+      }
+      accumulated = Box();
+      count = 0;
+      for (int i = 0; i < bin_count - 1; i++) {
+        accumulated = Box(accumulated, bins[axis][i].bbox);
+        count += bins[axis][i].count;
+        const double cost = accumulated.surface_area() * count + right_area[i + 1] * right_count[i + 1];
+        if (count > 0 && right_count[i + 1] > 0 && cost < best_cost) {
+          best_cost = cost;
+          best_axis = axis;
+          best_bin = i;
+        }
+      }
+    }
+
+    const double area = bbox.surface_area();
+    const double split_cost = this->settings.traversal_cost
+        + this->settings.intersection_cost * (area > 0 ? best_cost / area : object_span);
+    const double leaf_cost = this->settings.intersection_cost * object_span;
+    if (object_span <= (size_t)this->settings.max_leaf_size && leaf_cost <= split_cost) return std::nullopt;
+    if (best_axis < 0) {
+      const int axis = centroid_bounds.longest_axis();
+      return Split{BVHBuilderT::median_split(begin, end, axis), axis, std::numeric_limits<double>::infinity()};
+    }
+
+    const double min = centroid_bounds.axis_interval(best_axis).min;
+    BuildPrimitive* middle = std::partition(begin, end, [&](const BuildPrimitive& primitive) {
+      const int b = std::min(bin_count - 1, (int)((primitive.centroid[best_axis] - min) * scale[best_axis]));
+      return b <= best_bin;
+    });
+    return Split{middle, best_axis, split_cost};
+  }
+
+  // Relative SAH cost of splitting time in half, comparable to Split::cost.
+  // A ray at a uniformly random time enters either half as often.
+  double time_split_cost(const Box& bbox, const BuildPrimitive* begin, const BuildPrimitive* end,
+                         TimeRange time) const {
+    const float middle = 0.5f * (time.begin + time.end);
+    Box halves[2];
+    for (const BuildPrimitive* primitive = begin; primitive < end; primitive++) {
+      const Box& motion = this->bounds[primitive->index];
+      const BoundingBox at_middle = motion.at(middle);
+      halves[0] = Box(halves[0], Box(motion.at(time.begin), at_middle));
+      halves[1] = Box(halves[1], Box(at_middle, motion.at(time.end)));
+    }
+    const double area = bbox.surface_area();
+    const double object_span = (double)(end - begin);
+    const double half_cost = 0.5 * (halves[0].surface_area() + halves[1].surface_area()) * object_span;
+    return this->settings.traversal_cost
+        + this->settings.intersection_cost * (area > 0 ? half_cost / area : object_span);
+  }
+
+  // Gives [begin, end) to both halves of time, each bounded over its half:
+  // the first child works on it in place, the second on copies
+  std::unique_ptr<BuildNode> time_split(ThreadPool& pool, std::unique_ptr<BuildNode> node,
+                                        BuildPrimitive* begin, BuildPrimitive* end, int depth, int time_splits) {
+    const TimeRange time = node->time;
+    const float middle = 0.5f * (time.begin + time.end);
+    const TimeRange first_time{time.begin, middle}, second_time{middle, time.end};
+    node->axis = Node::time_axis;
+    node->copies.assign(begin, end);
+    BuildPrimitive* copies_begin = node->copies.data();
+    BuildPrimitive* copies_end = copies_begin + node->copies.size();
+    this->bound_over(begin, end, first_time);
+    this->bound_over(copies_begin, copies_end, second_time);
+    this->build_children(pool, *node, begin, end, copies_begin, copies_end, depth, first_time, second_time,
+                         time_splits + 1);
+    return node;
+  }
+
+  // Bounds primitives over time, a part of the shutter interval
+  void bound_over(BuildPrimitive* begin, BuildPrimitive* end, TimeRange time) const {
+    for (BuildPrimitive* primitive = begin; primitive < end; primitive++) {
+      const Box& motion = this->bounds[primitive->index];
+      primitive->bbox = Box(motion.at(time.begin), motion.at(time.end));
+      primitive->centroid = primitive->bbox.centroid();
+    }
+  }
+
+  // Depth-first: the first child directly follows its parent, and leaves
+  // take their primitives from the end of order
+  static std::uint32_t flatten(const BuildNode& build_node, std::vector<Node>& nodes, std::vector<std::uint32_t>& order) {
+    const std::uint32_t index = (std::uint32_t)nodes.size();
+    nodes.emplace_back();
+    if constexpr (Node::motion) {
+      nodes[index].set_bounds(build_node.bbox, build_node.time.begin, build_node.time.end);
+    } else {
+      nodes[index].set_bounds(build_node.bbox);
+    }
+
+    if (!build_node.children[0]) {
+      nodes[index].offset = (std::uint32_t)order.size();
+      nodes[index].count = (std::uint16_t)build_node.count;
+      for (size_t i = 0; i < build_node.count; i++) order.push_back(build_node.first[i].index);
+      return index;
+    }
+
+    BVHBuilderT::flatten(*build_node.children[0], nodes, order);
+    const std::uint32_t second = BVHBuilderT::flatten(*build_node.children[1], nodes, order);
+    nodes[index].offset = second;
+    nodes[index].count = 0;
+    nodes[index].axis = (std::uint8_t)build_node.axis;
+    return index;
+  }
+};
+
+using BVHBuilder = BVHBuilderT<BVHNode>;
+using MotionBVHBuilder = BVHBuilderT<MotionBVHNode>;
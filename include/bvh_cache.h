@@ -0,0 +1,201 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "mapped_file.h"
+#include "real.h"
+#include "shared_array.h"
+
+// Cache files of built acceleration structures and the primitive arrays
+// they index, which later runs map and trace from directly instead of
+// rebuilding. The file is a list of numbered sections of plain arrays:
+//   "RTBC", u32 version, u64 key, u32 sizeof(Real), u32 section count,
+//   per section {u32 id, u32 element size, u64 offset, u64 count},
+//   section data, each starting on a 64-byte boundary
+// in host byte order. Sections refer to each other by index only, never by
+// address, so the mapping can land anywhere and needs no fix-up. key
+// identifies what the cache was built from (see hash); a cache with another
+// key, version or Real is stale and ignored.
+namespace BVHCache {
+  // Raised whenever a layout or a build algorithm changes
+  constexpr std::uint32_t version = 2;
+  constexpr size_t alignment = 64;
+
+  // 64-bit hash of bytes, continuing from seed, eight bytes at a time.
+  // Hashing a long input in pieces gives the same result as long as every
+  // piece but the last is a multiple of eight bytes long.
+  inline std::uint64_t hash(const void* data, size_t size, std::uint64_t seed = 0x9e3779b97f4a7c15ull) {
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    std::uint64_t state = seed;
+    const auto mix = [&state](std::uint64_t word) {
+      word *= 0xbf58476d1ce4e5b9ull;
+      word ^= word >> 31;
+      state = (state ^ word) * 0x94d049bb133111ebull;
+      state ^= state >> 29;
+    };
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+      std::uint64_t word;
+      std::memcpy(&word, bytes + i, 8);
+      mix(word);
+    }
+    if (i < size) {
+      std::uint64_t word = 0;
+      std::memcpy(&word, bytes + i, size - i);
+      mix(word ^ ((std::uint64_t)(size - i) << 56));
+    }
+    return state;
+  }
+
+  namespace detail {
+    struct Header {
+      char magic[4];
+      std::uint32_t version;
+      std::uint64_t key;
+      std::uint32_t real_size;
+      std::uint32_t section_count;
+    };
+
+    struct Section {
+      std::uint32_t id;
+      std::uint32_t element_size;
+      std::uint64_t offset;
+      std::uint64_t count;
+    };
+  }
+
+  // Collects sections, then writes them in one go. Arrays are referenced,
+  // not copied, and have to outlive write.
+  class Writer {
+  public:
+    template <typename T>
+    void add(std::uint32_t id, const T* data, size_t count) {
+      static_assert(std::is_trivially_copyable<T>::value, "Cache sections hold plain data");
+      this->sections.push_back(Pending{id, (std::uint32_t)sizeof(T), data, count});
+    }
+
+    template <typename T>
+    void add(std::uint32_t id, const SharedArray<T>& array) {
+      this->add(id, array.data(), array.size());
+    }
+
+    // Written to a temporary file first and renamed over path, so that
+    // concurrent runs never map a half-written cache
+    bool write(const std::string& path, std::uint64_t key) const {
+      const std::string temporary = path + ".tmp";
+      {
+        std::ofstream out(temporary, std::ios::binary | std::ios::trunc);
+        if (!out) {
+          std::cerr << "[ERROR] Cannot open " << temporary << " for writing" << std::endl;
+          return false;
+        }
+
+        detail::Header header{{'R', 'T', 'B', 'C'}, version, key, (std::uint32_t)sizeof(Real),
+                              (std::uint32_t)this->sections.size()};
+        std::vector<detail::Section> table;
+        std::uint64_t offset = Writer::align(sizeof(header) + this->sections.size() * sizeof(detail::Section));
+        for (const Pending& section : this->sections) {
+          table.push_back(detail::Section{section.id, section.element_size, offset, section.count});
+          offset = Writer::align(offset + section.element_size * section.count);
+        }
+
+        out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        out.write(reinterpret_cast<const char*>(table.data()), (std::streamsize)(table.size() * sizeof(detail::Section)));
+        for (size_t i = 0; i < this->sections.size(); i++) {
+          Writer::pad(out, table[i].offset);
+          out.write(static_cast<const char*>(this->sections[i].data),
+                    (std::streamsize)(this->sections[i].element_size * this->sections[i].count));
+        }
+        if (!out) {
+          std::cerr << "[ERROR] Cannot write " << temporary << std::endl;
+          return false;
+        }
+      }
+      std::remove(path.c_str());
+      if (std::rename(temporary.c_str(), path.c_str()) != 0) {
+        std::cerr << "[ERROR] Cannot move " << temporary << " to " << path << std::endl;
+        return false;
+      }
+      return true;
+    }
+
+  private:
+    struct Pending {
+      std::uint32_t id;
+      std::uint32_t element_size;
+      const void* data;
+      size_t count;
+    };
+
+    std::vector<Pending> sections;
+
+    static std::uint64_t align(std::uint64_t offset) {
+      return (offset + alignment - 1) / alignment * alignment;
+    }
+
+    static void pad(std::ofstream& out, std::uint64_t offset) {
+      static const char zeros[alignment] = {};
+      const std::uint64_t position = (std::uint64_t)out.tellp();
+      if (position < offset) out.write(zeros, (std::streamsize)(offset - position));
+    }
+  };
+
+  // A mapped cache file whose header has been checked
+  class File {
+  public:
+    // Nothing if path is missing, unreadable or stale for key
+    static std::optional<File> open(const std::string& path, std::uint64_t key) {
+      File file;
+      file.mapping = MappedFile::open(path);
+      if (!file.mapping) return std::nullopt;
+
+      const MappedFile& mapping = *file.mapping;
+      detail::Header header;
+      if (mapping.size() < sizeof(header)) return std::nullopt;
+      std::memcpy(&header, mapping.data(), sizeof(header));
+      if (std::memcmp(header.magic, "RTBC", 4) != 0 || header.version != version || header.key != key ||
+          header.real_size != sizeof(Real)) {
+        return std::nullopt;
+      }
+      if (mapping.size() < sizeof(header) + (std::uint64_t)header.section_count * sizeof(detail::Section)) {
+        return std::nullopt;
+      }
+      file.sections.resize(header.section_count);
+      std::memcpy(file.sections.data(), mapping.data() + sizeof(header), header.section_count * sizeof(detail::Section));
+      for (const detail::Section& section : file.sections) {
+        if (section.element_size == 0 || section.offset % alignment != 0 || section.offset > mapping.size() ||
+            section.count > (mapping.size() - section.offset) / section.element_size) {
+          return std::nullopt;
+        }
+      }
+      return file;
+    }
+
+    // The array stored under id, pointing into the mapping, or nothing if
+    // there is no such section of T
+    template <typename T>
+    std::optional<SharedArray<T>> section(std::uint32_t id) const {
+      static_assert(std::is_trivially_copyable<T>::value, "Cache sections hold plain data");
+      for (const detail::Section& section : this->sections) {
+        if (section.id != id) continue;
+        if (section.element_size != sizeof(T)) return std::nullopt;
+        const T* data = reinterpret_cast<const T*>(this->mapping->data() + section.offset);
+        return SharedArray<T>(data, (size_t)section.count, this->mapping);
+      }
+      return std::nullopt;
+    }
+
+  private:
+    std::shared_ptr<const MappedFile> mapping;
+    std::vector<detail::Section> sections;
+  };
+}
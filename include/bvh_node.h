@@ -1,79 +1,158 @@
 #pragma once
 
-#include "hittable_list.h"
-#include "util.h"
 #include <algorithm>
-#include <cassert>
-#include <cstdlib>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
 #include <optional>
 
-// Bounding Volume Hierarchy Node
-class BVHNode final : public Hittable {
-public:
-  // constructor: copy construct HittableList
-  BVHNode(HittableList list) : BVHNode(list.objects, 0, list.objects.size(), 0) {}
-
-  // Start inclusive, end exclusive
-  BVHNode(std::vector<std::shared_ptr<Hittable>>& objects, size_t start, size_t end, int depth) {
-    int axis = Utility::random_int(0, 2); // Choose a random axis
-
-    Comparator comparator(axis);
-
-    size_t object_span = end - start;
-    assert(object_span > 0 && "[ERROR] Object Span out of range");
-
-    if (object_span == 1) {
-      this->left = this->right = objects[start];
-    } else if (object_span == 2) {
-      this->left = objects[start];
-      this->right = objects[end - 1];
-    } else {
-      std::sort(std::begin(objects) + start, std::begin(objects) + end, comparator);
-      int mid = start + object_span / 2;
-      this->left = std::make_shared<BVHNode>(objects, start, mid, depth + 1);
-      this->right = std::make_shared<BVHNode>(objects, mid, end, depth + 1);
+#include "bounding_box.h"
+#include "real.h"
+
+// Compact BVH node, two per cache line
+// Bounds are floats rounded outwards, so they never shrink the Real box.
+// Interior nodes keep their first child right after themselves (depth-first
+// order) and the index of the second child in offset. Leaves reference
+// primitives [offset, offset + count).
+struct BVHNode {
+  using Box = BoundingBox;
+  static constexpr bool motion = false;
+
+  float bounds_min[3];
+  float bounds_max[3];
+  std::uint32_t offset;
+  std::uint16_t count; // 0 for interior nodes
+  std::uint8_t axis;   // Split axis of interior nodes
+  std::uint8_t padding;
+
+  bool is_leaf() const { return this->count > 0; }
+
+  void set_bounds(const BoundingBox& bbox) {
+    for (int axis = 0; axis < 3; axis++) {
+      const Interval& interval = bbox.axis_interval(axis);
+      this->bounds_min[axis] = BVHNode::round_down(interval.min);
+      this->bounds_max[axis] = BVHNode::round_up(interval.max);
     }
+  }
 
-    this->bbox = BoundingBox(left->bounding_box(), right->bounding_box());
+  BoundingBox bounding_box() const {
+    return BoundingBox(
+      Interval(this->bounds_min[0], this->bounds_max[0]),
+      Interval(this->bounds_min[1], this->bounds_max[1]),
+      Interval(this->bounds_min[2], this->bounds_max[2])
+    );
   }
 
-  std::optional<HitRecord> hit(const Ray& ray, const Interval ray_t) const override {
-    std::optional<Interval> hit_bbox = this->bbox.hit(ray, ray_t);
-    if (!hit_bbox.has_value()) { return std::nullopt; }
+  // Slab test against a precomputed inverse ray direction. Returns the entry
+  // distance, or nothing if the box is missed within ray_t.
+  std::optional<Real> hit(const Point3& origin, const Vect3& inverse_direction, const Interval& ray_t) const {
+    Real t_enter = ray_t.min;
+    Real t_exit = ray_t.max;
+    for (int axis = 0; axis < 3; axis++) {
+      const Real t0 = (this->bounds_min[axis] - origin[axis]) * inverse_direction[axis];
+      const Real t1 = (this->bounds_max[axis] - origin[axis]) * inverse_direction[axis];
+      t_enter = std::max(t_enter, std::min(t0, t1));
+      t_exit = std::min(t_exit, std::max(t0, t1));
+    }
+    if (t_enter > t_exit) return std::nullopt;
+    return t_enter;
+  }
 
-    std::optional<HitRecord> hit_left = this->left->hit(ray, ray_t);
+  // Nearest floats below and above value
+  static float round_down(Real value) {
+    const float f = (float)value;
+    return (Real)f > value ? BVHNode::next_float(f, -1) : f;
+  }
 
-    // If it already hit left child, the upper bound of t will be that of left hit result
-    // If ray hits right child, that means it hits right child before left child
-    std::optional<HitRecord> hit_right = this->right->hit(
-      ray, 
-      Interval(ray_t.min, hit_left.has_value() ? hit_left->t : ray_t.max)
-    );
+  static float round_up(Real value) {
+    const float f = (float)value;
+    return (Real)f < value ? BVHNode::next_float(f, 1) : f;
+  }
 
-    if (!hit_left.has_value() && !hit_right.has_value()) return std::nullopt;
-    if (hit_right.has_value()) return hit_right;
+  // std::nextafter(f, direction * infinity) by stepping the bits, without
+  // the libm call: refits round the bounds of every node every frame
+  static float next_float(float f, int direction) {
+    if (f == 0) return direction * std::numeric_limits<float>::denorm_min();
+    std::uint32_t bits;
+    std::memcpy(&bits, &f, sizeof(bits));
+    bits += (f > 0) == (direction > 0) ? 1 : -1;
+    std::memcpy(&f, &bits, sizeof(bits));
+    return f;
+  }
+};
+
+static_assert(sizeof(BVHNode) == 32, "BVHNode should stay 32 bytes");
 
-    return hit_left;
-  };
+// Node of a motion BVH, one per cache line: its bounds at the start and at
+// the end of its time range, interpolated to the time of each ray. Interior
+// nodes either split their primitives along axis, like BVHNode, or, with
+// axis time_axis, their time range in half: the first child then covers the
+// earlier half, the second the later one, and both hold every primitive.
+struct MotionBVHNode {
+  using Box = LinearBounds;
+  static constexpr bool motion = true;
+  static constexpr std::uint8_t time_axis = 3;
 
-  BoundingBox bounding_box() const override {
-    return this->bbox;
-  };
+  float bounds_min[2][3];
+  float bounds_max[2][3];
+  float time_begin, time_end;
+  std::uint32_t offset;
+  std::uint16_t count; // 0 for interior nodes
+  std::uint8_t axis;
+  std::uint8_t padding;
 
-private:
-  std::shared_ptr<Hittable> left;
-  std::shared_ptr<Hittable> right;
-  BoundingBox bbox;
+  bool is_leaf() const { return this->count > 0; }
 
-  struct Comparator {
-    const int axis_index;
-    Comparator(int axis_index) : axis_index(axis_index) {
-      assert(0 <= axis_index && axis_index <= 2 && "[ERROR] Axis index out of range\n");
+  void set_bounds(const LinearBounds& bounds, float time_begin, float time_end) {
+    this->time_begin = time_begin;
+    this->time_end = time_end;
+    for (int axis = 0; axis < 3; axis++) {
+      const Interval& begin = bounds.begin.axis_interval(axis);
+      const Interval& end = bounds.end.axis_interval(axis);
+      // Interpolating the float bounds rounds by a few ulps of the larger
+      // end, which the margin absorbs
+      const float margin = 4 * std::numeric_limits<float>::epsilon() * (float)std::fmax(
+        std::fmax(std::fabs(begin.min), std::fabs(end.min)), std::fmax(std::fabs(begin.max), std::fabs(end.max)));
+      this->bounds_min[0][axis] = BVHNode::round_down(begin.min) - margin;
+      this->bounds_min[1][axis] = BVHNode::round_down(end.min) - margin;
+      this->bounds_max[0][axis] = BVHNode::round_up(begin.max) + margin;
+      this->bounds_max[1][axis] = BVHNode::round_up(end.max) + margin;
     }
-    bool operator() (const std::shared_ptr<Hittable> a, const std::shared_ptr<Hittable> b) {
-      const Interval a_axis_interval = a->bounding_box().axis_interval(this->axis_index);
-      const Interval b_axis_interval = b->bounding_box().axis_interval(this->axis_index);
-      return a_axis_interval.min < b_axis_interval.min;
+  }
+
+  LinearBounds bounding_box() const {
+    BoundingBox ends[2];
+    for (int end = 0; end < 2; end++) {
+      ends[end] = BoundingBox(
+        Interval(this->bounds_min[end][0], this->bounds_max[end][0]),
+        Interval(this->bounds_min[end][1], this->bounds_max[end][1]),
+        Interval(this->bounds_min[end][2], this->bounds_max[end][2])
+      );
     }
-  };
+    return LinearBounds(ends[0], ends[1]);
+  }
+
+  bool covers(Real time) const { return this->time_begin <= time && time <= this->time_end; }
+
+  // Slab test against the bounds at time, which has to be covered
+  std::optional<Real> hit(const Point3& origin, const Vect3& inverse_direction, Real time,
+                          const Interval& ray_t) const {
+    const Real span = this->time_end - this->time_begin;
+    const Real u = span > 0 ? std::fmin((time - this->time_begin) / span, (Real)1) : 0;
+    Real t_enter = ray_t.min;
+    Real t_exit = ray_t.max;
+    for (int axis = 0; axis < 3; axis++) {
+      const Real low = this->bounds_min[0][axis] + u * (this->bounds_min[1][axis] - this->bounds_min[0][axis]);
+      const Real high = this->bounds_max[0][axis] + u * (this->bounds_max[1][axis] - this->bounds_max[0][axis]);
+      const Real t0 = (low - origin[axis]) * inverse_direction[axis];
+      const Real t1 = (high - origin[axis]) * inverse_direction[axis];
+      t_enter = std::max(t_enter, std::min(t0, t1));
+      t_exit = std::min(t_exit, std::max(t0, t1));
+    }
+    if (t_enter > t_exit) return std::nullopt;
+    return t_enter;
+  }
 };
+
+static_assert(sizeof(MotionBVHNode) == 64, "MotionBVHNode should stay 64 bytes");
@@ -1,14 +1,61 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <chrono>
 #include <cmath>
+#include <cstdint>
 #include <fstream>
+#include <memory>
 #include <optional>
+#include <ostream>
+#include <string>
+#include <vector>
 
+#include "accumulation.h"
 #include "color.h"
+#include "framebuffer.h"
 #include "hittable.h"
+#include "image_writer.h"
+#include "light.h"
 #include "material.h"
+#include "progress.h"
+#include "ray_packet.h"
+#include "russian_roulette.h"
+#include "sampler.h"
+#include "statistics.h"
+#include "stop_signal.h"
+#include "thread_pool.h"
 #include "util.h"
 #include "vect3.h"
+#include "wavefront.h"
+
+// Worker threads and an image buffer that renders share through
+// Camera::context instead of setting up their own, e.g. the frames of an
+// animation. The thread calling render works as well, so the pool has one
+// worker less than threads.
+class RenderContext {
+public:
+  // 0 threads means one per hardware thread
+  explicit RenderContext(unsigned threads = 0)
+      : pool((threads > 0 ? threads : ThreadPool::hardware_threads()) - 1) {}
+
+  ThreadPool &thread_pool() { return this->pool; }
+  unsigned threads() const { return this->pool.size() + 1; }
+
+  // Allocated again only when the size changes
+  Framebuffer &framebuffer(int width, int height) {
+    if (this->image.width() != width || this->image.height() != height) {
+      this->image = Framebuffer(width, height);
+    }
+    return this->image;
+  }
+
+private:
+  ThreadPool pool;
+  Framebuffer image;
+};
 
 class Camera {
 public:
@@ -24,30 +71,305 @@ public:
   double defocus_angle = 0;
   double focus_distance = 10.0;
 
-  void render(const Hittable &world) {
+  // Russian roulette: after russian_roulette_depth bounces, paths end at
+  // random with a probability that grows as their throughput falls, and
+  // survivors are weighted up to compensate, so dim paths stop early and
+  // max_ray_depth can be raised at little cost. The average path length is
+  // logged at the end of a render.
+  bool russian_roulette = true;
+  int russian_roulette_depth = 5;
+
+  // Light from rays that leave the scene: a sky gradient, or
+  // background_color when sky is off (e.g. indoor scenes lit by emissive
+  // materials). Emitters added to the LightList passed to render are also
+  // sampled directly at every diffuse hit (next-event estimation).
+  bool sky = true;
+  Color background_color{0, 0, 0};
+
+  // Parallel rendering: the image is split into square tiles that a
+  // work-stealing pool renders. 0 threads means one per hardware thread.
+  // Random numbers are keyed by (seed, pixel, sample, bounce), so the image
+  // depends on the seed only, never on the thread count or tile order.
+  int thread_count = 0;
+  int tile_size = 32;
+  std::uint64_t seed = 0;
+  // Threads and buffers kept from render to render; thread_count is then
+  // the context's
+  std::shared_ptr<RenderContext> context;
+
+  // Packet tracing of camera rays: 0 traces every ray on its own, 4 or 8
+  // traces the rays of 4x4 or 8x8 pixel blocks (one sample index at a time)
+  // through the BVH together. The image is the same either way, unless
+  // share_lens_sample gives every ray of a packet the same point on the lens,
+  // which keeps defocused packets coherent but correlates their noise.
+  int packet_size = 0;
+  bool share_lens_sample = false;
+
+  // Wavefront integrator: each tile traces batches of up to
+  // wavefront_batch_size paths one bounce at a time, in separate stages,
+  // instead of recursing per path. Per-stage timings are logged at the end.
+  // Sorting rays between bounces only pays off once traversal dominates,
+  // i.e. for scenes much larger than the BVH's cache footprint.
+  bool wavefront = false;
+  int wavefront_batch_size = 1 << 16;
+  bool wavefront_sort_rays = false;
+
+  // Adaptive sampling: every pixel takes at least adaptive_min_samples, then
+  // passes of adaptive_pass_samples go to the pixels whose estimated noise in
+  // the gamma-encoded output is still above noise_threshold, noisiest first,
+  // up to adaptive_max_samples per pixel (0: 4 * samples_per_pixel). A tile
+  // never spends more than samples_per_pixel per pixel overall. Takes
+  // precedence over packet_size and wavefront.
+  // sample_heatmap_path, if set, receives the samples taken per pixel in
+  // every channel of a PFM image, whatever its extension: the counts are
+  // written linear and unclamped, as the 8-bit formats could not.
+  bool adaptive_sampling = false;
+  int adaptive_min_samples = 16;
+  int adaptive_max_samples = 0;
+  int adaptive_pass_samples = 8;
+  double noise_threshold = 0.01;
+  std::string sample_heatmap_path = "";
+
+  // Progressive rendering: passes of progressive_pass_samples over the whole
+  // frame, summed into an accumulation buffer, until every pixel has
+  // samples_per_pixel. With a checkpoint_path the buffer is saved there every
+  // checkpoint_interval seconds, on SIGTERM or SIGINT, and at the end, along
+  // with the image so far; a render with the same settings resumes from it
+  // and continues every pixel's sample sequence where it stopped, so raising
+  // samples_per_pixel refines a finished render. time_budget (seconds, 0 for
+  // none) stops the render and writes the best image available. Takes
+  // precedence over adaptive_sampling, packet_size and wavefront.
+  bool progressive = false;
+  int progressive_pass_samples = 1;
+  std::string checkpoint_path = "";
+  double checkpoint_interval = 60;
+  double time_budget = 0;
+  // Identifies the scene in the settings of checkpoints, so that one taken
+  // of another scene, or before this one changed, is not resumed. Set by
+  // whoever builds the scene (SceneFile::geometry_hash).
+  std::uint64_t scene_hash = 0;
+
+  // Output image. Auto picks the format from the extension of output_path;
+  // an empty path writes no image. With stream_tiles, PPM and PFM files are
+  // updated as each tile finishes.
+  std::string output_path = "image.ppm";
+  ImageFormat output_format = ImageFormat::Auto;
+  bool stream_tiles = true;
+
+  // Totals of the last render. rays counts closest-hit rays, i.e. path
+  // segments, and leaves out the shadow rays of light sampling.
+  struct RenderStatistics {
+    std::uint64_t paths = 0;
+    std::uint64_t rays = 0;
+    double seconds = 0;
+  };
+
+  const RenderStatistics &statistics() const { return this->render_statistics; }
+
+  // Where to write the counters of builds configured with
+  // RAYTRACER_STATISTICS as JSON; empty for the log summary only. They cover
+  // the whole program up to the end of the render, BVH builds included.
+  std::string statistics_path = "";
+
+  // One tile of the image, for renders split across processes (see
+  // render_cluster.h): prepare_tiles() sets the camera up and returns the
+  // number of tiles, which trace_tile then renders one by one, each exactly
+  // as render() would. Progressive rendering and the sample heatmap are
+  // render()'s own.
+  struct Tile {
+    int x0, y0, x1, y1;
+
+    size_t pixel_count() const { return (size_t)(this->x1 - this->x0) * (this->y1 - this->y0); }
+  };
+
+  // Paths and rays a tile took, and with adaptive sampling its samples
+  struct TileStatistics {
+    std::uint64_t paths = 0;
+    std::uint64_t rays = 0;
+    std::uint64_t samples = 0;
+  };
+
+  int prepare_tiles() {
     this->initialize();
+    return this->tile_count();
+  }
 
-    std::ofstream out_file{"image.ppm"};
-    out_file << "P3\n"
-             << this->image_width << " " << this->image_height << "\n255\n";
-    for (int j = 0; j < this->image_height; j++) {
-      std::clog << "[LOG] Scanlines remaining: " << (this->image_height - j)
-                << std::endl;
-      for (int i = 0; i < this->image_width; i++) {
-        Color pixel_color{0, 0, 0};
-        for (int sample = 0; sample < this->samples_per_pixel; sample++) {
-          Ray r = this->get_ray(i, j);
-          pixel_color += this->ray_color(r, this->max_ray_depth, world);
+  // Once prepared
+  int height() const { return this->image_height; }
+
+  Tile tile(int index) const {
+    const int tiles_x = (this->image_width + this->tile_size - 1) / this->tile_size;
+    const int x0 = (index % tiles_x) * this->tile_size;
+    const int y0 = (index / tiles_x) * this->tile_size;
+    return {x0, y0, std::min(x0 + this->tile_size, this->image_width),
+            std::min(y0 + this->tile_size, this->image_height)};
+  }
+
+  TileStatistics trace_tile(const Hittable &world, const MaterialTable &materials, const LightList &lights,
+                            int index, Framebuffer &image, WavefrontStatistics &wavefront_stats,
+                            Framebuffer *heatmap = nullptr) const {
+    const Tile bounds = this->tile(index);
+    PathCounter paths;
+    std::uint64_t samples = 0;
+    if (this->adaptive_sampling) {
+      samples = this->render_tile_adaptive(world, materials, lights, bounds.x0, bounds.y0, bounds.x1, bounds.y1,
+                                           image, heatmap, paths);
+    } else if (this->wavefront) {
+      this->render_tile_wavefront(world, materials, lights, bounds.x0, bounds.y0, bounds.x1, bounds.y1, image,
+                                  wavefront_stats, paths);
+    } else {
+      this->render_tile(world, materials, lights, bounds.x0, bounds.y0, bounds.x1, bounds.y1, image, paths);
+    }
+    return {paths.paths, paths.segments, samples};
+  }
+
+  // Returns false if the image could not be written to output_path, the
+  // sample heatmap to sample_heatmap_path or the counters to statistics_path
+  bool render(const Hittable &world, const MaterialTable &materials, const LightList &lights) {
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    this->initialize();
+    if (this->progressive) {
+      const bool written = this->render_progressive(world, materials, lights);
+      this->render_statistics.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+      return written;
+    }
+
+    const std::shared_ptr<RenderContext> context = this->render_context();
+    Framebuffer &image = context->framebuffer(this->image_width, this->image_height);
+
+    const ImageFormat format = ImageWriter::resolve_format(this->output_path, this->output_format);
+    std::unique_ptr<TileStreamWriter> stream;
+    if (this->stream_tiles && !this->output_path.empty() && ImageWriter::supports_streaming(format)) {
+      stream = std::make_unique<TileStreamWriter>(image, this->output_path, format);
+    }
+
+    const int tile_count = this->tile_count();
+
+    std::clog << "[LOG] Rendering " << tile_count << " tiles on " << context->threads()
+              << " threads" << std::endl;
+
+    // The calling thread works through the queue as well while it waits
+    TaskGroup tiles(context->thread_pool());
+    ProgressReporter progress("Rendering", (std::uint64_t)tile_count, "tiles");
+    WavefrontStatistics wavefront_stats;
+    std::atomic<std::uint64_t> samples_taken{0};
+    PathStatistics path_stats;
+    std::unique_ptr<Framebuffer> heatmap;
+    if (this->adaptive_sampling && !this->sample_heatmap_path.empty()) {
+      heatmap = std::make_unique<Framebuffer>(this->image_width, this->image_height);
+    }
+
+    for (int tile = 0; tile < tile_count; tile++) {
+      tiles.run([&, tile] {
+        const TileStatistics taken = this->trace_tile(world, materials, lights, tile, image, wavefront_stats,
+                                                      heatmap.get());
+        samples_taken += taken.samples;
+        path_stats.add({taken.paths, taken.rays});
+        if (stream) {
+          const Tile bounds = this->tile(tile);
+          stream->write_tile(bounds.x0, bounds.y0, bounds.x1, bounds.y1);
         }
-        pixel_color *= this->pixel_sample_scales;
-        pixel_color.write_color(out_file);
+        progress.advance();
+      });
+    }
+    {
+      Statistics::PhaseTimer timer(Statistics::Phase::Trace);
+      tiles.wait();
+    }
+    progress.finish();
+
+    bool heatmap_written = true;
+    if (this->adaptive_sampling) {
+      std::clog << "[LOG] Adaptive sampling: " << (double)samples_taken.load() / ((double)this->image_width * this->image_height)
+                << " samples per pixel on average" << std::endl;
+      if (heatmap && !ImageWriter::write(*heatmap, this->sample_heatmap_path, ImageFormat::PFM)) {
+        std::cerr << "[ERROR] Cannot write the sample heatmap to " << this->sample_heatmap_path << std::endl;
+        heatmap_written = false;
       }
+    } else if (this->wavefront) {
+      std::clog << "[LOG] " << wavefront_stats << std::endl;
     }
 
+    std::clog << "[LOG] " << path_stats << std::endl;
+    this->render_statistics = {path_stats.paths.load(), path_stats.segments.load(),
+                               std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count()};
+
+    // Streamed tiles stop being written once the file fails
+    bool written = !stream || stream->good();
+    if (!stream && !this->output_path.empty()) {
+      Statistics::PhaseTimer timer(Statistics::Phase::Output);
+      written = ImageWriter::write(image, this->output_path, format);
+    }
+
+    const bool statistics_written = this->report_statistics();
+    if (!written) {
+      std::cerr << "[ERROR] Cannot write the image to " << this->output_path << std::endl;
+      return false;
+    }
+    if (!statistics_written) return false;
+    if (!heatmap_written) return false;
     std::clog << "[LOG] Done" << std::endl;
+    return true;
   };
 
 private:
+  RenderStatistics render_statistics;
+
+  // The shared context, or one for this render only
+  std::shared_ptr<RenderContext> render_context() const {
+    if (this->context) return this->context;
+    return std::make_shared<RenderContext>(this->thread_count > 0 ? (unsigned)this->thread_count : 0);
+  }
+
+  int tile_count() const {
+    const int tiles_x = (this->image_width + this->tile_size - 1) / this->tile_size;
+    const int tiles_y = (this->image_height + this->tile_size - 1) / this->tile_size;
+    return tiles_x * tiles_y;
+  }
+
+  // Logs the counters of a RAYTRACER_STATISTICS build and writes them to
+  // statistics_path
+  // False if the counters could not be written to statistics_path
+  bool report_statistics() const {
+    if (!Statistics::enabled) return true;
+    Statistics::Report report = Statistics::collect();
+    for (int type = 0; type < (int)MaterialType::Count; type++) {
+      report.material_names.push_back(material_type_name((MaterialType)type));
+    }
+    std::clog << "[LOG] " << report << std::endl;
+    if (this->statistics_path.empty()) return true;
+    std::ofstream file(this->statistics_path);
+    file << report.json();
+    if (!file) {
+      std::cerr << "[ERROR] Cannot open statistics file " << this->statistics_path << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  // Paths traced and rays (path segments) they took, counted per tile
+  struct PathCounter {
+    std::uint64_t paths = 0;
+    std::uint64_t segments = 0;
+  };
+
+  // PathCounter totals over all threads
+  struct PathStatistics {
+    std::atomic<std::uint64_t> paths{0};
+    std::atomic<std::uint64_t> segments{0};
+
+    void add(const PathCounter &counter) {
+      this->paths.fetch_add(counter.paths, std::memory_order_relaxed);
+      this->segments.fetch_add(counter.segments, std::memory_order_relaxed);
+    }
+
+    friend std::ostream &operator<<(std::ostream &out, const PathStatistics &stats) {
+      const std::uint64_t paths = stats.paths.load();
+      return out << "Average path length: "
+                 << (paths == 0 ? 0.0 : (double)stats.segments.load() / paths) << " rays";
+    }
+  };
+
   Point3 center{0, 0, 0};
   double pixel_sample_scales;
   int image_height;
@@ -102,50 +424,462 @@ private:
     this->pixel_sample_scales = 1.0 / this->samples_per_pixel;
   };
 
-  Ray get_ray(int i, int j) const {
-    const Vect3 offset = this->sample_square();
+  bool render_progressive(const Hittable &world, const MaterialTable &materials,
+                          const LightList &lights) {
+    using Clock = std::chrono::steady_clock;
+    const Clock::time_point start = Clock::now();
+    const auto seconds_since = [](Clock::time_point time) {
+      return std::chrono::duration<double>(Clock::now() - time).count();
+    };
+    const double pixel_count = (double)this->image_width * this->image_height;
+
+    AccumulationBuffer accumulation(this->image_width, this->image_height);
+    const std::shared_ptr<RenderContext> context = this->render_context();
+    Framebuffer &image = context->framebuffer(this->image_width, this->image_height);
+    const std::uint64_t fingerprint = this->settings_fingerprint();
+    if (!this->checkpoint_path.empty() && accumulation.load(this->checkpoint_path, fingerprint)) {
+      std::clog << "[LOG] Resuming from " << this->checkpoint_path << " at "
+                << accumulation.total_samples() / pixel_count << " samples per pixel" << std::endl;
+    }
+
+    const ImageFormat format = ImageWriter::resolve_format(this->output_path, this->output_format);
+    // False if the image could not be written; checkpoints report their own
+    // errors and only cost the resume
+    const auto save = [&] {
+      if (!this->checkpoint_path.empty()) accumulation.save(this->checkpoint_path, fingerprint);
+      if (this->output_path.empty()) return true;
+      Statistics::PhaseTimer timer(Statistics::Phase::Output);
+      accumulation.resolve(image);
+      return ImageWriter::write(image, this->output_path, format);
+    };
+
+    const int tile_count = this->tile_count();
+
+    std::clog << "[LOG] Rendering progressively in passes of " << this->progressive_pass_samples
+              << " samples on " << context->threads() << " threads" << std::endl;
+
+    ThreadPool &pool = context->thread_pool();
+    StopSignal::Scope stop_signal;
+    const auto out_of_time = [&] {
+      return StopSignal::requested() || (this->time_budget > 0 && seconds_since(start) >= this->time_budget);
+    };
+
+    PathStatistics path_stats;
+    Clock::time_point last_checkpoint = Clock::now();
+    for (int pass = 1;; pass++) {
+      TaskGroup tiles(pool);
+      std::atomic<std::uint64_t> samples_taken{0};
+      for (int tile = 0; tile < tile_count; tile++) {
+        tiles.run([&, tile] {
+          // Tiles of a cut-short pass keep fewer samples, which the
+          // per-pixel counts account for
+          if (out_of_time()) return;
+          const Tile bounds = this->tile(tile);
+          PathCounter paths;
+          samples_taken += this->render_tile_progressive(world, materials, lights, bounds.x0, bounds.y0, bounds.x1,
+                                                         bounds.y1, accumulation, paths);
+          path_stats.add(paths);
+        });
+      }
+      {
+        Statistics::PhaseTimer timer(Statistics::Phase::Trace);
+        tiles.wait();
+      }
+      if (samples_taken == 0) break;
+
+      std::clog << "[LOG] Pass " << pass << ": " << accumulation.total_samples() / pixel_count
+                << " samples per pixel" << std::endl;
+      if (!this->checkpoint_path.empty() && seconds_since(last_checkpoint) >= this->checkpoint_interval) {
+        save();
+        last_checkpoint = Clock::now();
+      }
+    }
+
+    if (StopSignal::requested()) {
+      std::clog << "[LOG] Stopped by signal" << std::endl;
+    } else if (out_of_time()) {
+      std::clog << "[LOG] Time budget of " << this->time_budget << " s reached" << std::endl;
+    }
+    std::clog << "[LOG] " << path_stats << std::endl;
+    this->render_statistics.paths = path_stats.paths.load();
+    this->render_statistics.rays = path_stats.segments.load();
+    const bool written = save();
+    const bool statistics_written = this->report_statistics();
+    if (!written) {
+      std::cerr << "[ERROR] Cannot write the image to " << this->output_path << std::endl;
+      return false;
+    }
+    if (!statistics_written) return false;
+    std::clog << "[LOG] Done" << std::endl;
+    return true;
+  };
+
+  // Adds up to progressive_pass_samples samples to each pixel of the tile
+  // that has fewer than samples_per_pixel. Returns the number taken.
+  std::uint64_t render_tile_progressive(const Hittable &world, const MaterialTable &materials, const LightList &lights,
+                                        int x0, int y0, int x1, int y1,
+                                        AccumulationBuffer &accumulation, PathCounter &paths) const {
+    std::uint64_t samples_taken = 0;
+    for (int j = y0; j < y1; j++) {
+      for (int i = x0; i < x1; i++) {
+        const std::uint32_t first_sample = accumulation.sample_count(i, j);
+        const std::uint32_t target = (std::uint32_t)std::max(this->samples_per_pixel, 0);
+        if (first_sample >= target) continue;
+        const std::uint32_t count = std::min((std::uint32_t)std::max(this->progressive_pass_samples, 1),
+                                             target - first_sample);
+        for (std::uint32_t sample = first_sample; sample < first_sample + count; sample++) {
+          Sampler sampler(this->seed, (size_t)j * this->image_width + i, sample);
+          const Ray r = this->get_ray(i, j, sampler);
+          accumulation.add(i, j, this->ray_color(r, world, materials, lights, sampler, paths));
+        }
+        samples_taken += count;
+      }
+    }
+    return samples_taken;
+  };
+
+  // FNV-1a hash of every setting that changes what a sample computes, and of
+  // the scene_hash, for matching checkpoints to renders. samples_per_pixel
+  // is left out on purpose.
+  std::uint64_t settings_fingerprint() const {
+    std::uint64_t hash = 14695981039346656037ull;
+    const auto mix = [&hash](const auto &value) {
+      const unsigned char *bytes = reinterpret_cast<const unsigned char *>(&value);
+      for (size_t i = 0; i < sizeof(value); i++) {
+        hash = (hash ^ bytes[i]) * 1099511628211ull;
+      }
+    };
+    mix(sizeof(Real));
+    mix(this->scene_hash);
+    mix(this->image_width);
+    mix(this->image_height);
+    mix(this->max_ray_depth);
+    mix(this->roulette_depth());
+    mix(this->seed);
+    mix(this->vertical_fov);
+    mix(this->defocus_angle);
+    mix(this->focus_distance);
+    mix(this->sky);
+    for (int channel = 0; channel < 3; channel++) mix(this->background_color[channel]);
+    for (int axis = 0; axis < 3; axis++) {
+      mix(this->look_from[axis]);
+      mix(this->look_at[axis]);
+      mix(this->v_up[axis]);
+    }
+    return hash;
+  };
+
+  void render_tile(const Hittable &world, const MaterialTable &materials, const LightList &lights,
+                   int x0, int y0, int x1, int y1, Framebuffer &image, PathCounter &paths) const {
+    if (this->packet_size > 0) {
+      this->render_tile_packets(world, materials, lights, x0, y0, x1, y1, image, paths);
+      return;
+    }
+
+    for (int j = y0; j < y1; j++) {
+      for (int i = x0; i < x1; i++) {
+        const size_t pixel_index = (size_t)j * this->image_width + i;
+        Color pixel_color{0, 0, 0};
+        for (int sample = 0; sample < this->samples_per_pixel; sample++) {
+          Sampler sampler(this->seed, pixel_index, (std::uint32_t)sample);
+          Ray r = this->get_ray(i, j, sampler);
+          pixel_color += this->ray_color(r, world, materials, lights, sampler, paths);
+        }
+        pixel_color *= this->pixel_sample_scales;
+        image.set_pixel(i, j, pixel_color);
+      }
+    }
+  };
+
+  void render_tile_packets(const Hittable &world, const MaterialTable &materials, const LightList &lights,
+                           int x0, int y0, int x1, int y1, Framebuffer &image, PathCounter &paths) const {
+    assert((this->packet_size == 4 || this->packet_size == 8) && "[ERROR] Packet size must be 4 or 8");
+    const int block = this->packet_size;
+
+    for (int by = y0; by < y1; by += block) {
+      for (int bx = x0; bx < x1; bx += block) {
+        const int bw = std::min(block, x1 - bx);
+        const int bh = std::min(block, y1 - by);
+        Color pixel_colors[RayPacket::max_size];
+
+        for (int sample = 0; sample < this->samples_per_pixel; sample++) {
+          RayPacket packet;
+          const size_t first_pixel = (size_t)by * this->image_width + bx;
+          Sampler lens_sampler(this->seed, first_pixel, (std::uint32_t)sample);
+          const Point3 lens_origin = this->defocus_angle <= 0 ? this->center
+                                                              : this->defocus_disk_sample(lens_sampler);
+          for (int j = by; j < by + bh; j++) {
+            for (int i = bx; i < bx + bw; i++) {
+              Sampler sampler(this->seed, (size_t)j * this->image_width + i, (std::uint32_t)sample);
+              Ray ray = this->get_ray(i, j, sampler);
+              if (this->share_lens_sample) {
+                const Point3 pixel_sample = ray.origin() + ray.direction();
+                ray = Ray(lens_origin, pixel_sample - lens_origin, ray.time());
+              }
+              packet.add(ray, Interval(0, Constant::infinity));
+            }
+          }
+
+          Intersection intersections[RayPacket::max_size];
+          if (this->max_ray_depth > 0) {
+            world.intersect_packet(packet, intersections);
+          }
+
+          for (int k = 0; k < packet.size; k++) {
+            const int i = bx + k % bw, j = by + k / bw;
+            // Continues exactly where ray_color would: the camera dimension
+            // is used up, so a fresh sampler jumps straight to bounce 0
+            Sampler sampler(this->seed, (size_t)j * this->image_width + i, (std::uint32_t)sample);
+            if (this->max_ray_depth > 0) {
+              sampler.start_dimension(1);
+              std::optional<HitRecord> record;
+              if (intersections[k].has_value()) {
+                record = intersections[k].object->finalize(packet.rays[k], intersections[k]);
+              }
+              pixel_colors[k] += this->trace_path(packet.rays[k], record, world, materials, lights, sampler, paths);
+            }
+          }
+        }
+
+        for (int k = 0; k < bw * bh; k++) {
+          image.set_pixel(bx + k % bw, by + k / bw, pixel_colors[k] * this->pixel_sample_scales);
+        }
+      }
+    }
+  };
+
+  void render_tile_wavefront(const Hittable &world, const MaterialTable &materials, const LightList &lights,
+                             int x0, int y0, int x1, int y1,
+                             Framebuffer &image, WavefrontStatistics &stats, PathCounter &paths) const {
+    assert(this->wavefront_batch_size > 0 && "[ERROR] Wavefront batch size must be positive");
+    const int tile_width = x1 - x0;
+    const size_t pixel_count = (size_t)tile_width * (y1 - y0);
+    const int batch_samples = std::clamp((int)(this->wavefront_batch_size / pixel_count), 1,
+                                         std::max(this->samples_per_pixel, 1));
+
+    WavefrontIntegrator integrator(world, materials, lights, this->max_ray_depth, this->roulette_depth(),
+                                   this->wavefront_sort_rays, stats);
+    std::vector<Color> pixel_colors(pixel_count);
+
+    for (int first_sample = 0; first_sample < this->samples_per_pixel; first_sample += batch_samples) {
+      const int sample_count = std::min(batch_samples, this->samples_per_pixel - first_sample);
+
+      // Path p * pixel_count + k is sample first_sample + p of pixel k
+      integrator.trace(
+          (size_t)sample_count * pixel_count,
+          [&](size_t path) {
+            const size_t k = path % pixel_count;
+            const int i = x0 + (int)(k % tile_width), j = y0 + (int)(k / tile_width);
+            const std::uint32_t sample = (std::uint32_t)(first_sample + path / pixel_count);
+            Sampler sampler(this->seed, (size_t)j * this->image_width + i, sample);
+            const Ray ray = this->get_ray(i, j, sampler);
+            return PathStart{ray, sampler};
+          },
+          [this](const Ray &ray) { return this->background(ray); });
+
+      // Samples are summed in order, as the recursive integrator does
+      StageTimer timer(stats, WavefrontStage::Accumulate, integrator.paths().size());
+      for (size_t path = 0; path < integrator.paths().size(); path++) {
+        pixel_colors[path % pixel_count] += integrator.paths().radiance(path);
+      }
+      paths.paths += integrator.paths().size();
+    }
+    paths.segments += integrator.segments_traced();
+
+    for (size_t k = 0; k < pixel_count; k++) {
+      image.set_pixel(x0 + (int)(k % tile_width), y0 + (int)(k / tile_width),
+                      pixel_colors[k] * this->pixel_sample_scales);
+    }
+  };
+
+  // Running estimate of one pixel (Welford's algorithm on the luminance)
+  struct PixelEstimate {
+    Color sum{0, 0, 0};
+    double mean = 0;
+    double m2 = 0;
+    int count = 0;
+
+    void add(const Color &sample) {
+      this->sum += sample;
+      const double luminance = sample.luminance();
+      this->count++;
+      const double delta = luminance - this->mean;
+      this->mean += delta / this->count;
+      this->m2 += delta * (luminance - this->mean);
+    }
+
+    // Standard error of the mean, carried through the gamma-2 output
+    // encoding: d(sqrt(L)) = dL / (2 sqrt(L))
+    double error() const {
+      if (this->count < 2) return Constant::infinity;
+      const double standard_error = std::sqrt(this->m2 / ((double)(this->count - 1) * this->count));
+      return standard_error / (2 * std::sqrt(std::max(this->mean, 1e-4)));
+    }
+  };
+
+  // Returns the number of samples taken
+  std::uint64_t render_tile_adaptive(const Hittable &world, const MaterialTable &materials, const LightList &lights,
+                                     int x0, int y0, int x1, int y1,
+                                     Framebuffer &image, Framebuffer *heatmap, PathCounter &paths) const {
+    const int max_samples = this->adaptive_max_samples > 0 ? this->adaptive_max_samples
+                                                           : 4 * this->samples_per_pixel;
+    const int min_samples = std::clamp(this->adaptive_min_samples, 1, max_samples);
+    const int pass_samples = std::max(this->adaptive_pass_samples, 1);
+    const int tile_width = x1 - x0;
+    const size_t pixel_count = (size_t)tile_width * (y1 - y0);
+    const std::uint64_t budget = (std::uint64_t)std::max(this->samples_per_pixel, min_samples) * pixel_count;
+
+    std::vector<PixelEstimate> estimates(pixel_count);
+    std::uint64_t spent = 0;
+    // Samples continue the pixel's sequence, so the image only depends on
+    // the seed and the settings
+    const auto take_samples = [&](size_t k, int count) {
+      const int i = x0 + (int)(k % tile_width), j = y0 + (int)(k / tile_width);
+      PixelEstimate &estimate = estimates[k];
+      for (int n = 0; n < count; n++) {
+        Sampler sampler(this->seed, (size_t)j * this->image_width + i, (std::uint32_t)estimate.count);
+        const Ray r = this->get_ray(i, j, sampler);
+        estimate.add(this->ray_color(r, world, materials, lights, sampler, paths));
+      }
+      spent += count;
+    };
+
+    std::vector<std::uint32_t> active(pixel_count);
+    for (size_t k = 0; k < pixel_count; k++) {
+      active[k] = (std::uint32_t)k;
+      take_samples(k, min_samples);
+    }
+
+    std::vector<std::pair<double, std::uint32_t>> ranked;
+    while (spent < budget) {
+      ranked.clear();
+      for (const std::uint32_t k : active) {
+        const double error = estimates[k].error();
+        if (estimates[k].count < max_samples && error > this->noise_threshold) ranked.push_back({-error, k});
+      }
+      if (ranked.empty()) break;
+      std::sort(ranked.begin(), ranked.end());
+
+      active.clear();
+      for (const auto &[negative_error, k] : ranked) {
+        if (spent >= budget) break;
+        take_samples(k, std::min(pass_samples, max_samples - estimates[k].count));
+        active.push_back(k);
+      }
+    }
+
+    for (size_t k = 0; k < pixel_count; k++) {
+      const int i = x0 + (int)(k % tile_width), j = y0 + (int)(k / tile_width);
+      image.set_pixel(i, j, estimates[k].sum / (Real)estimates[k].count);
+      if (heatmap) {
+        const Real count = (Real)estimates[k].count;
+        heatmap->set_pixel(i, j, Color(count, count, count));
+      }
+    }
+    return spent;
+  };
+
+  // Draws from the camera dimension (0) of the sampler
+  Ray get_ray(int i, int j, Sampler &sampler) const {
+    const Vect3 offset = this->sample_square(sampler);
     const Point3 pixel_sample = this->pixel00_location +
                                 ((i + offset.x()) * this->pixel_delta_u) +
                                 ((j + offset.y()) * this->pixel_delta_v);
 
     const Point3 ray_origin =
-        (this->defocus_angle <= 0) ? this->center : this->defocus_disk_sample();
+        (this->defocus_angle <= 0) ? this->center : this->defocus_disk_sample(sampler);
     const Vect3 ray_direction = pixel_sample - ray_origin;
-    const double ray_time = Utility::random_double();
+    const Real ray_time = (Real)sampler.next_double();
     return { ray_origin, ray_direction, ray_time };
   };
 
-  Vect3 sample_square() const {
+  Vect3 sample_square(Sampler &sampler) const {
     return Vect3(
-        Utility::random_double() - 0.5, 
-        Utility::random_double() - 0.5,
+        (Real)(sampler.next_double() - 0.5), 
+        (Real)(sampler.next_double() - 0.5),
         0);
   };
 
-  Point3 defocus_disk_sample() const {
-    const Point3 p = random_in_unit_disk();
+  Point3 defocus_disk_sample(Sampler &sampler) const {
+    const Point3 p = random_in_unit_disk(sampler);
     return this->center + (p[0] * this->defocus_disk_horizontal_radius) +
            (p[1] * this->defocus_disk_vertical_radius);
   };
 
-  Color ray_color(const Ray &ray, int ray_depth, const Hittable &world) {
-    if (ray_depth <= 0) {
+  // Radiance along a camera ray
+  Color ray_color(const Ray &ray, const Hittable &world, const MaterialTable &materials,
+                  const LightList &lights, Sampler &sampler, PathCounter &paths) const {
+    if (this->max_ray_depth <= 0) {
       return {0, 0, 0};
     }
-    std::optional<HitRecord> record =
-        world.hit(ray, {0.001, Constant::infinity});
-    if (record.has_value()) {
-      std::optional<ScatterRecord> scatter_result =
-          record->material->scatter(ray, record.value());
-      if (scatter_result.has_value()) {
-        const Ray scattered = scatter_result.value().scattered;
-        const Color attenuation = scatter_result.value().attenuation;
-        return attenuation * this->ray_color(scattered, ray_depth - 1, world);
+    // Dimension 0 is the camera sample, bounce n draws from dimension n + 1
+    sampler.start_dimension(1);
+    // Secondary rays start past the surface's error bound
+    // (HitRecord::spawn_origin), so no hit distance has to be excluded
+    const std::optional<HitRecord> record =
+        world.hit(ray, Interval(0, Constant::infinity));
+    return this->trace_path(ray, record, world, materials, lights, sampler, paths);
+  };
+
+  // Radiance along ray given its closest hit, if any, found with the sampler
+  // at dimension 1. Follows the path in a loop, carrying its throughput
+  // forward, rather than recursing per bounce. At diffuse hits a light is
+  // also sampled directly, and emission found either way is weighted by
+  // multiple importance sampling.
+  Color trace_path(Ray ray, std::optional<HitRecord> record, const Hittable &world,
+                   const MaterialTable &materials, const LightList &lights, Sampler &sampler,
+                   PathCounter &paths) const {
+    paths.paths++;
+    Color radiance{0, 0, 0};
+    Color throughput{1, 1, 1};
+    // Density the last bounce picked ray with; 0 for the camera ray
+    Real bsdf_pdf = 0;
+    for (int bounce = 0;; bounce++) {
+      paths.segments++;
+      Statistics::count(bounce == 0 ? Statistics::Counter::PrimaryRays : Statistics::Counter::SecondaryRays);
+      if (!record.has_value()) {
+        Statistics::count_path_length(bounce + 1);
+        return radiance + throughput * this->background(ray);
       }
-      return {0, 0, 0};
+      Statistics::count_material_hit((int)materials.type(record->material));
+      radiance += throughput * emitted_radiance(materials, lights, ray, record.value(), bsdf_pdf);
+
+      const std::optional<ScatterRecord> scatter_result =
+          materials.scatter(ray, record.value(), sampler);
+      if (!scatter_result.has_value() || bounce + 1 >= this->max_ray_depth) {
+        Statistics::count_path_length(bounce + 1);
+        return radiance;
+      }
+      const bool diffuse = materials.is_diffuse(record->material);
+      if (diffuse && !lights.empty()) {
+        radiance += throughput * sample_direct_light(world, materials, lights, ray, record.value(), sampler);
+      }
+      bsdf_pdf = diffuse ? materials.pdf(record.value(), scatter_result->scattered.direction()) : 0;
+
+      throughput = throughput * scatter_result->attenuation;
+      if (!::russian_roulette(throughput, bounce + 1, this->roulette_depth(), sampler)) {
+        Statistics::count_path_length(bounce + 1);
+        return radiance;
+      }
+
+      ray = scatter_result->scattered;
+      sampler.start_dimension((std::uint32_t)(bounce + 2));
+      record = world.hit(ray, Interval(0, Constant::infinity));
+    }
+  };
+
+  // Bounces before Russian roulette applies; max_ray_depth when it is off
+  int roulette_depth() const {
+    return this->russian_roulette ? this->russian_roulette_depth : this->max_ray_depth;
+  };
+
+  // Radiance of rays that leave the scene
+  Color background(const Ray &ray) const {
+    if (!this->sky) {
+      return this->background_color;
     }
     const Vect3 unit_direction = unit_vector(ray.direction());
-    const double a = 0.5 * (unit_direction.y() + 1.0);
+    const Real a = (Real)0.5 * (unit_direction.y() + 1);
     return (1.0 - a) * Color(1.0, 1.0, 1.0) + a * Color(0.5, 0.7, 1.0);
   };
 };
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "color.h"
+
+// In-memory linear radiance image, 3 floats per pixel, rows top to bottom
+class Framebuffer {
+public:
+  Framebuffer() {}
+  Framebuffer(int width, int height)
+      : image_width(width), image_height(height),
+        pixels((size_t)width * height * 3, 0.0f) {
+    assert(width > 0 && height > 0 && "[ERROR] Framebuffer size out of range");
+  }
+
+  int width() const { return this->image_width; }
+  int height() const { return this->image_height; }
+
+  void set_pixel(int x, int y, const Color &color) {
+    float *p = this->pixel(x, y);
+    p[0] = (float)color.x();
+    p[1] = (float)color.y();
+    p[2] = (float)color.z();
+  }
+
+  Color get_pixel(int x, int y) const {
+    const float *p = this->pixel(x, y);
+    return {p[0], p[1], p[2]};
+  }
+
+  float *pixel(int x, int y) {
+    return this->pixels.data() + ((size_t)y * this->image_width + x) * 3;
+  }
+
+  const float *pixel(int x, int y) const {
+    return this->pixels.data() + ((size_t)y * this->image_width + x) * 3;
+  }
+
+  const float *data() const { return this->pixels.data(); }
+  float *data() { return this->pixels.data(); }
+
+  // Gamma-encodes and quantizes count floats starting at the first channel of
+  // (x, y) into out. It is one branch-free pass over a flat float array, which
+  // the compiler turns into packed sqrt/min/convert instructions.
+  void quantize(int x, int y, size_t count, std::uint8_t *out) const {
+    const float *in = this->pixel(x, y);
+    for (size_t i = 0; i < count; i++) {
+      // Gamma 2: the same encoding as Color::linear_to_gamma. The comparison
+      // maps NaN to 0 too, which std::max would pass on to the conversion.
+      const float linear = in[i] > 0.0f ? in[i] : 0.0f;
+      const float gamma = std::sqrt(linear);
+      out[i] = (std::uint8_t)(256.0f * std::min(gamma, 0.999f));
+    }
+  }
+
+  // Whole image as 8-bit gamma-encoded RGB
+  std::vector<std::uint8_t> quantize() const {
+    std::vector<std::uint8_t> bytes(this->pixels.size());
+    this->quantize(0, 0, bytes.size(), bytes.data());
+    return bytes;
+  }
+
+private:
+  int image_width = 0;
+  int image_height = 0;
+  std::vector<float> pixels;
+};
@@ -3,32 +3,52 @@
 #include "bounding_box.h"
 #include "point3.h"
 #include "ray.h"
+#include "ray_packet.h"
 #include "vect3.h"
 #include "interval.h"
+#include "real.h"
 
-#include <memory>
+#include <cstdint>
 #include <optional>
 
-class Material;
-
 struct HitRecord {
-  double t;
+  Real t;
   Point3 p;
+  // Conservative bound on the rounding error of each coordinate of p
+  Vect3 p_error;
   Vect3 normal;
-  std::shared_ptr<Material> material;
+  // Id in the scene's MaterialTable
+  std::uint32_t material;
   bool front_face;
 
   HitRecord() = delete;
   // HitRecord(double t, const Point3& p, const Vect3& normal) : t(t), p(p), normal(normal), front_face(false) {}
 
   HitRecord(
-    double t, const Point3& p, const Ray& ray, 
+    Real t, const Point3& p, const Vect3& p_error, const Ray& ray, 
     const Vect3& outward_normal, 
-    std::shared_ptr<Material> material
-  ) : t(t), p(p), material(material) {
+    std::uint32_t material
+  ) : t(t), p(p), p_error(p_error), material(material) {
     this->set_face_normal(ray, outward_normal);
   }
 
+  // Origin for a ray leaving the surface in direction: p pushed along the
+  // normal, to the side direction points to, just past its error bound and
+  // rounded away from the surface (pbrt's OffsetRayOrigin). Rays spawned
+  // from it can then be traced from t = 0 without hitting this surface
+  // again, in either precision and at any scene scale.
+  Point3 spawn_origin(const Vect3& direction) const {
+    const Real distance = dot(abs(this->normal), this->p_error);
+    Vect3 offset = distance * this->normal;
+    if (dot(direction, this->normal) < 0) offset = -offset;
+    Point3 origin = this->p + offset;
+    for (int axis = 0; axis < 3; axis++) {
+      if (offset[axis] > 0) origin[axis] = Utility::next_real_up(origin[axis]);
+      else if (offset[axis] < 0) origin[axis] = Utility::next_real_down(origin[axis]);
+    }
+    return origin;
+  }
+
   void set_face_normal(const Ray& ray, const Vect3& outward_normal) {
     // Sets the hit record normal
     // NOTE: Assumption: outward_normal has unit length
@@ -38,11 +58,59 @@ struct HitRecord {
 
 };
 
+class Hittable;
+
+// Closest hit found so far, as left by the cheap intersection pass: only the
+// distance and which primitive of which object. object is the primitive's
+// own Hittable (never an aggregate), which computes the surface attributes.
+// For hits inside an Instance, object is the Instance and instanced the
+// primitive's own Hittable.
+struct Intersection {
+  Real t = 0;
+  std::uint32_t primitive = 0;
+  const Hittable* object = nullptr;
+  const Hittable* instanced = nullptr;
+
+  bool has_value() const { return this->object != nullptr; }
+};
+
+// Intersection is two-phase: intersect only narrows ray_t and records the
+// primitive, and finalize builds the HitRecord of the winning hit once.
 class Hittable {
 public:
   virtual ~Hittable() = default;
 
-  virtual std::optional<HitRecord> hit(const Ray& ray, const Interval ray_t) const = 0;
+  // Closest hit in ray_t, with its surface attributes
+  std::optional<HitRecord> hit(const Ray& ray, Interval ray_t) const {
+    Intersection intersection;
+    if (!this->intersect(ray, ray_t, intersection)) return std::nullopt;
+    return intersection.object->finalize(ray, intersection);
+  }
+
+  // On a hit closer than ray_t.max, shrinks ray_t.max to it, overwrites
+  // intersection and returns true. Otherwise leaves both alone.
+  virtual bool intersect(const Ray& ray, Interval& ray_t, Intersection& intersection) const = 0;
+
+  // Surface attributes of an intersection whose object is this
+  virtual HitRecord finalize(const Ray& ray, const Intersection& intersection) const = 0;
+
+  // Whether anything is hit in ray_t, for shadow and visibility rays.
+  // Implementations stop at the first hit they find.
+  virtual bool occluded(const Ray& ray, Interval ray_t) const {
+    Intersection intersection;
+    return this->intersect(ray, ray_t, intersection);
+  }
+
+  // intersect for a packet of rays, narrowing each ray's t_max. By default
+  // every ray is traced on its own.
+  virtual void intersect_packet(RayPacket& packet, Intersection* intersections) const {
+    for (int i = 0; i < packet.size; i++) {
+      Interval ray_t = packet.interval(i);
+      if (this->intersect(packet.rays[i], ray_t, intersections[i])) {
+        packet.narrow(i, ray_t.max);
+      }
+    }
+  }
 
   virtual BoundingBox bounding_box() const = 0;
 };
@@ -2,6 +2,7 @@
 
 #include "hittable.h"
 
+#include <cassert>
 #include <optional>
 #include <memory>
 #include <vector>
@@ -21,18 +22,31 @@ public:
     this->bbox = BoundingBox(this->bbox, object->bounding_box());
   }
 
-  std::optional<HitRecord> hit(const Ray& ray, const Interval ray_t) const override {
-    std::optional<HitRecord> result = std::nullopt;
-    double closest_so_far = ray_t.max;
+  bool intersect(const Ray& ray, Interval& ray_t, Intersection& intersection) const override {
+    bool hit_anything = false;
+    for (const std::shared_ptr<Hittable>& object: objects) {
+      hit_anything |= object->intersect(ray, ray_t, intersection);
+    }
+    return hit_anything;
+  }
+
+  // Intersections name the primitive's own object, never the list
+  HitRecord finalize(const Ray& ray, const Intersection& intersection) const override {
+    assert(intersection.object != this && "[ERROR] Aggregates cannot finalize hits");
+    return intersection.object->finalize(ray, intersection);
+  }
+
+  bool occluded(const Ray& ray, const Interval ray_t) const override {
+    for (const std::shared_ptr<Hittable>& object: objects) {
+      if (object->occluded(ray, ray_t)) return true;
+    }
+    return false;
+  }
 
+  void intersect_packet(RayPacket& packet, Intersection* intersections) const override {
     for (const std::shared_ptr<Hittable>& object: objects) {
-      std::optional<HitRecord> hitRecord = object->hit(ray, { ray_t.min, closest_so_far });
-      if (hitRecord.has_value()) {
-        closest_so_far = hitRecord->t;
-        result = std::move(hitRecord);
-      }
+      object->intersect_packet(packet, intersections);
     }
-    return result;
   }
 
   BoundingBox bounding_box() const override { return this->bbox; }
@@ -0,0 +1,225 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cctype>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "framebuffer.h"
+
+// Output formats:
+//  PPM: binary P6, 8-bit gamma-encoded
+//  PFM: little-endian float RGB, linear, for HDR post-processing
+//  PNG: 8-bit gamma-encoded RGB
+enum class ImageFormat { Auto, PPM, PFM, PNG };
+
+namespace ImageWriter {
+  // Auto picks the format from the file extension, PPM if unknown
+  inline ImageFormat resolve_format(const std::string &path, ImageFormat format) {
+    if (format != ImageFormat::Auto) return format;
+
+    const size_t dot = path.find_last_of('.');
+    std::string extension = dot == std::string::npos ? "" : path.substr(dot + 1);
+    for (char &c : extension) c = (char)std::tolower((unsigned char)c);
+
+    if (extension == "pfm") return ImageFormat::PFM;
+    if (extension == "png") return ImageFormat::PNG;
+    return ImageFormat::PPM;
+  }
+
+  // Formats whose pixels sit at fixed file offsets can be written tile by tile
+  inline bool supports_streaming(ImageFormat format) {
+    return format == ImageFormat::PPM || format == ImageFormat::PFM;
+  }
+
+  inline std::string header(const Framebuffer &image, ImageFormat format) {
+    const std::string size = std::to_string(image.width()) + " " + std::to_string(image.height()) + "\n";
+    if (format == ImageFormat::PFM) {
+      // Negative scale marks little-endian data
+      return "PF\n" + size + "-1.0\n";
+    }
+    return "P6\n" + size + "255\n";
+  }
+
+  // PFM stores rows bottom to top
+  inline size_t row_offset(const Framebuffer &image, ImageFormat format, int y) {
+    if (format == ImageFormat::PFM) {
+      return (size_t)(image.height() - 1 - y) * image.width() * 3 * sizeof(float);
+    }
+    return (size_t)y * image.width() * 3;
+  }
+
+  inline void write_row(std::ostream &out, const Framebuffer &image, ImageFormat format,
+                        int x0, int x1, int y, std::vector<std::uint8_t> &scratch) {
+    const size_t count = (size_t)(x1 - x0) * 3;
+    if (format == ImageFormat::PFM) {
+      static_assert(sizeof(float) == 4, "PFM needs 32-bit floats");
+      // Assumes a little-endian host, as the header declares
+      out.write(reinterpret_cast<const char *>(image.pixel(x0, y)), count * sizeof(float));
+      return;
+    }
+    scratch.resize(count);
+    image.quantize(x0, y, count, scratch.data());
+    out.write(reinterpret_cast<const char *>(scratch.data()), count);
+  }
+
+  namespace detail {
+    inline std::uint32_t crc32(const std::uint8_t *data, size_t size, std::uint32_t crc = 0) {
+      static const std::array<std::uint32_t, 256> table = [] {
+        std::array<std::uint32_t, 256> t{};
+        for (std::uint32_t n = 0; n < 256; n++) {
+          std::uint32_t c = n;
+          for (int k = 0; k < 8; k++) c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+          t[n] = c;
+        }
+        return t;
+      }();
+      crc = ~crc;
+      for (size_t i = 0; i < size; i++) crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+      return ~crc;
+    }
+
+    inline void put_u32_be(std::vector<std::uint8_t> &out, std::uint32_t v) {
+      out.push_back((std::uint8_t)(v >> 24));
+      out.push_back((std::uint8_t)(v >> 16));
+      out.push_back((std::uint8_t)(v >> 8));
+      out.push_back((std::uint8_t)v);
+    }
+
+    inline void write_png_chunk(std::ostream &out, const char type[4], const std::vector<std::uint8_t> &data) {
+      std::vector<std::uint8_t> chunk;
+      chunk.reserve(data.size() + 12);
+      put_u32_be(chunk, (std::uint32_t)data.size());
+      chunk.insert(chunk.end(), type, type + 4);
+      chunk.insert(chunk.end(), data.begin(), data.end());
+      put_u32_be(chunk, crc32(chunk.data() + 4, chunk.size() - 4));
+      out.write(reinterpret_cast<const char *>(chunk.data()), chunk.size());
+    }
+  }
+
+  // PNG with a zlib stream of stored (uncompressed) deflate blocks: no
+  // compression library needed, and any PNG reader accepts it
+  inline void write_png(std::ostream &out, const Framebuffer &image) {
+    const std::vector<std::uint8_t> rgb = image.quantize();
+    const size_t row_size = (size_t)image.width() * 3;
+
+    // Filter type 0 (None) before every row
+    std::vector<std::uint8_t> raw;
+    raw.reserve((row_size + 1) * image.height());
+    for (int y = 0; y < image.height(); y++) {
+      raw.push_back(0);
+      raw.insert(raw.end(), rgb.begin() + y * row_size, rgb.begin() + (y + 1) * row_size);
+    }
+
+    std::vector<std::uint8_t> zlib = {0x78, 0x01};
+    std::uint32_t adler_a = 1, adler_b = 0;
+    for (size_t i = 0; i < raw.size(); i++) {
+      adler_a = (adler_a + raw[i]) % 65521;
+      adler_b = (adler_b + adler_a) % 65521;
+    }
+    size_t position = 0;
+    do {
+      const size_t block = std::min<size_t>(65535, raw.size() - position);
+      const bool last = position + block == raw.size();
+      zlib.push_back(last ? 1 : 0);
+      zlib.push_back((std::uint8_t)block);
+      zlib.push_back((std::uint8_t)(block >> 8));
+      zlib.push_back((std::uint8_t)~block);
+      zlib.push_back((std::uint8_t)(~block >> 8));
+      zlib.insert(zlib.end(), raw.begin() + position, raw.begin() + position + block);
+      position += block;
+    } while (position < raw.size());
+    detail::put_u32_be(zlib, (adler_b << 16) | adler_a);
+
+    std::vector<std::uint8_t> ihdr;
+    detail::put_u32_be(ihdr, (std::uint32_t)image.width());
+    detail::put_u32_be(ihdr, (std::uint32_t)image.height());
+    ihdr.insert(ihdr.end(), {8, 2, 0, 0, 0}); // 8-bit RGB, no interlace
+
+    static const std::uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+    out.write(reinterpret_cast<const char *>(signature), sizeof(signature));
+    detail::write_png_chunk(out, "IHDR", ihdr);
+    detail::write_png_chunk(out, "IDAT", zlib);
+    detail::write_png_chunk(out, "IEND", {});
+  }
+
+  // Writes the whole image. Returns false if the file could not be written.
+  inline bool write(const Framebuffer &image, const std::string &path, ImageFormat format) {
+    format = resolve_format(path, format);
+    std::ofstream out(path, std::ios::binary);
+    if (!out) {
+      std::cerr << "[ERROR] Cannot open " << path << " for writing" << std::endl;
+      return false;
+    }
+
+    if (format == ImageFormat::PNG) {
+      write_png(out, image);
+    } else {
+      out << header(image, format);
+      std::vector<std::uint8_t> scratch;
+      for (int i = 0; i < image.height(); i++) {
+        // PFM rows go bottom to top
+        const int y = format == ImageFormat::PFM ? image.height() - 1 - i : i;
+        write_row(out, image, format, 0, image.width(), y, scratch);
+      }
+    }
+    return (bool)out;
+  }
+}
+
+// Writes finished tiles straight into their place in the output file, so a
+// crashed or killed render still leaves every completed tile on disk.
+// Thread safe; only for formats where supports_streaming() holds.
+class TileStreamWriter {
+public:
+  TileStreamWriter(const Framebuffer &image, const std::string &path, ImageFormat format)
+      : image(image), format(ImageWriter::resolve_format(path, format)) {
+    assert(ImageWriter::supports_streaming(this->format) && "[ERROR] Format cannot be streamed");
+
+    const std::string header = ImageWriter::header(image, this->format);
+    this->data_offset = header.size();
+
+    // Lay the whole file out up front (black image), then patch tiles in
+    std::ofstream create(path, std::ios::binary | std::ios::trunc);
+    create << header;
+    std::vector<std::uint8_t> scratch;
+    for (int y = 0; y < image.height(); y++) {
+      ImageWriter::write_row(create, image, this->format, 0, image.width(), y, scratch);
+    }
+    create.close();
+
+    this->out.open(path, std::ios::binary | std::ios::in | std::ios::out);
+    if (!this->out) {
+      std::cerr << "[ERROR] Cannot open " << path << " for writing" << std::endl;
+    }
+  }
+
+  bool good() const { return (bool)this->out; }
+
+  void write_tile(int x0, int y0, int x1, int y1) {
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if (!this->out) return;
+
+    const size_t pixel_size = this->format == ImageFormat::PFM ? 3 * sizeof(float) : 3;
+    for (int y = y0; y < y1; y++) {
+      const size_t offset = this->data_offset + ImageWriter::row_offset(this->image, this->format, y) + x0 * pixel_size;
+      this->out.seekp((std::streamoff)offset);
+      ImageWriter::write_row(this->out, this->image, this->format, x0, x1, y, this->scratch);
+    }
+    this->out.flush();
+  }
+
+private:
+  const Framebuffer &image;
+  ImageFormat format;
+  size_t data_offset = 0;
+  std::fstream out;
+  std::mutex mutex;
+  std::vector<std::uint8_t> scratch;
+};
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <memory>
+#include <optional>
+
+#include "hittable.h"
+#include "real.h"
+#include "transform.h"
+
+// One placement of shared geometry: object, e.g. a TriangleMesh with its own
+// BVH (the bottom level), mapped into the scene by transform. Rays are
+// mapped into the object's space rather than the geometry into the scene's,
+// so that any number of instances share one copy of the geometry and its
+// tree, and moving an instance only changes its transform and box.
+// Instances go into a BVH (the top level), which rebuilds over their boxes
+// alone. Instances cannot be nested.
+class Instance final : public Hittable {
+public:
+  // material, if given, replaces the object's own on every hit
+  Instance(std::shared_ptr<const Hittable> object, const Transform& transform,
+           std::optional<std::uint32_t> material = std::nullopt)
+      : object(std::move(object)), material(material) {
+    this->set_transform(transform);
+  }
+
+  const Transform& transform() const { return this->object_to_world; }
+
+  // Moves the instance; the BVH holding it has to be rebuilt
+  void set_transform(const Transform& transform) {
+    this->object_to_world = transform;
+    this->bbox = transform.bounding_box(this->object->bounding_box());
+  }
+
+  bool intersect(const Ray& ray, Interval& ray_t, Intersection& intersection) const override {
+    Real shift;
+    const Ray local = this->object_to_world.inverse_ray(ray, shift);
+    Interval local_t(std::max<Real>(ray_t.min - shift, 0), ray_t.max - shift);
+    if (!this->object->intersect(local, local_t, intersection)) return false;
+    assert(intersection.instanced == nullptr && "[ERROR] Instances cannot be nested");
+    intersection.t += shift;
+    intersection.instanced = intersection.object;
+    intersection.object = this;
+    ray_t.max = intersection.t;
+    return true;
+  }
+
+  // The object's surface attributes, mapped back into the scene
+  HitRecord finalize(const Ray& ray, const Intersection& intersection) const override {
+    Real shift;
+    const Ray local = this->object_to_world.inverse_ray(ray, shift);
+    Intersection inner = intersection;
+    inner.t -= shift;
+    inner.object = intersection.instanced;
+    inner.instanced = nullptr;
+    const HitRecord record = inner.object->finalize(local, inner);
+
+    Vect3 p_error;
+    const Point3 p = this->object_to_world.point(record.p, record.p_error, p_error);
+    const Vect3 outward_normal = record.front_face ? record.normal : -record.normal;
+    const Vect3 normal = unit_vector(this->object_to_world.normal(outward_normal));
+    return HitRecord(intersection.t, p, p_error, ray, normal, this->material.value_or(record.material));
+  }
+
+  bool occluded(const Ray& ray, const Interval ray_t) const override {
+    Real shift;
+    const Ray local = this->object_to_world.inverse_ray(ray, shift);
+    return this->object->occluded(local, Interval(std::max<Real>(ray_t.min - shift, 0), ray_t.max - shift));
+  }
+
+  BoundingBox bounding_box() const override {
+    return this->bbox;
+  }
+
+private:
+  std::shared_ptr<const Hittable> object;
+  Transform object_to_world;
+  std::optional<std::uint32_t> material;
+  BoundingBox bbox;
+};
@@ -1,38 +1,44 @@
 #pragma once
 
 #include "constant.h"
+#include "real.h"
 #include <algorithm>
+#include <limits>
 #include <ostream>
 
-class Interval {
+template <typename T>
+class IntervalT {
 public:
-  double min, max;
+  T min, max;
 
-  constexpr Interval() : min(+Constant::infinity), max(-Constant::infinity) {} // Empty by default
-  constexpr Interval(double min, double max) : min(min), max(max) {} // Empty by default
+  constexpr IntervalT() : min(+std::numeric_limits<T>::infinity()), max(-std::numeric_limits<T>::infinity()) {} // Empty by default
+  constexpr IntervalT(T min, T max) : min(min), max(max) {} // Empty by default
   
-  constexpr Interval(const Interval& a, const Interval& b):
+  constexpr IntervalT(const IntervalT& a, const IntervalT& b):
     min(std::min(a.min, b.min)), max(std::max(a.max, b.max)) {};
   
-  constexpr Interval expand(double delta) const { 
-    const double padding = delta / 2;
-    return Interval{min - padding, max + padding};
+  constexpr IntervalT expand(T delta) const { 
+    const T padding = delta / 2;
+    return IntervalT{min - padding, max + padding};
   };
   
-  constexpr double size() const { return max - min; };
+  constexpr T size() const { return max - min; };
 
-  constexpr bool contains(double x) const { return min <= x && x <= max; };
-  constexpr bool surrounds(double x) const { return min < x && x < max; };
-  constexpr double clamp(double x) const {
+  constexpr bool contains(T x) const { return min <= x && x <= max; };
+  constexpr bool surrounds(T x) const { return min < x && x < max; };
+  constexpr T clamp(T x) const {
     if (x < min) return min;
     if (x > max) return max;
     return x;
   };
 };
 
-constexpr const Interval universe_interval{-Constant::infinity,Constant::infinity};
-constexpr const Interval empty_interval{Constant::infinity,-Constant::infinity};
+using Interval = IntervalT<Real>;
 
-inline std::ostream &operator<<(std::ostream &out, const Interval& interval) {
+constexpr const Interval universe_interval{-std::numeric_limits<Real>::infinity(), std::numeric_limits<Real>::infinity()};
+constexpr const Interval empty_interval{std::numeric_limits<Real>::infinity(), -std::numeric_limits<Real>::infinity()};
+
+template <typename T>
+inline std::ostream &operator<<(std::ostream &out, const IntervalT<T>& interval) {
   return out << "(" << interval.min << ", " << interval.max << ")";
 }
@@ -0,0 +1,162 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <optional>
+#include <unordered_map>
+#include <vector>
+
+#include "color.h"
+#include "constant.h"
+#include "hittable.h"
+#include "interval.h"
+#include "material.h"
+#include "ray.h"
+#include "real.h"
+#include "sampler.h"
+#include "statistics.h"
+#include "vect3.h"
+
+// Direction towards a point on a light, as seen from a shading point
+struct LightSample {
+  Vect3 direction; // Unit length
+  Real distance;
+  // Solid-angle density of picking direction, light choice included
+  Real pdf;
+  std::uint32_t material;
+};
+
+// Emissive sphere, sampled by the cone of directions it subtends (pbrt
+// 6.2.3), which for a small or distant sphere is far better than sampling
+// its area. Lights are stationary.
+class SphereLight {
+public:
+  SphereLight(const Point3& center, Real radius, std::uint32_t material) :
+    center(center), radius(radius), material(material) {}
+
+  std::uint32_t material_id() const { return this->material; }
+
+  // None from inside the sphere, which has no cone to sample
+  std::optional<LightSample> sample(const Point3& p, Sampler& sampler) const {
+    const Vect3 to_center = this->center - p;
+    const Real distance_squared = to_center.length_squared();
+    const Real radius_squared = this->radius * this->radius;
+    if (distance_squared <= radius_squared) return std::nullopt;
+
+    const Real one_minus_cos_max = SphereLight::one_minus_cos_max(distance_squared, radius_squared);
+    const Real cos_theta = 1 - (Real)sampler.next_double() * one_minus_cos_max;
+    const Real sin_theta = std::sqrt(std::max((Real)0, 1 - cos_theta * cos_theta));
+    const Real phi = (Real)(2 * Constant::pi * sampler.next_double());
+
+    // Orthonormal basis around the axis to the center (Duff et al. 2017)
+    const Real distance = std::sqrt(distance_squared);
+    const Vect3 w = to_center / distance;
+    const Real sign = std::copysign((Real)1, w.z());
+    const Real a = -1 / (sign + w.z());
+    const Real b = w.x() * w.y() * a;
+    const Vect3 u(1 + sign * w.x() * w.x() * a, sign * b, -sign * w.x());
+    const Vect3 v(b, sign + w.y() * w.y() * a, -w.y());
+    const Vect3 direction = unit_vector(sin_theta * std::cos(phi) * u + sin_theta * std::sin(phi) * v + cos_theta * w);
+
+    // Nearest intersection with the sphere along direction
+    const Real offset_squared = std::max((Real)0, radius_squared - distance_squared * sin_theta * sin_theta);
+    const Real hit_distance = distance * cos_theta - std::sqrt(offset_squared);
+    return LightSample{direction, hit_distance, 1 / (2 * (Real)Constant::pi * one_minus_cos_max), this->material};
+  }
+
+  // Density with which sample picks any direction towards the sphere from p
+  Real pdf(const Point3& p) const {
+    const Real distance_squared = (this->center - p).length_squared();
+    const Real radius_squared = this->radius * this->radius;
+    if (distance_squared <= radius_squared) return 0;
+    return 1 / (2 * (Real)Constant::pi * SphereLight::one_minus_cos_max(distance_squared, radius_squared));
+  }
+
+private:
+  Point3 center;
+  Real radius;
+  std::uint32_t material;
+
+  // 1 - cos(theta_max) without the cancellation of subtracting it from 1
+  static Real one_minus_cos_max(Real distance_squared, Real radius_squared) {
+    const Real sin_squared_max = radius_squared / distance_squared;
+    return sin_squared_max / (1 + std::sqrt(1 - sin_squared_max));
+  }
+};
+
+// Emitters of a scene that the integrator samples directly, built alongside
+// the Hittable that holds their geometry. Each light has a material of its
+// own, through which hits on it are matched to the light.
+class LightList {
+public:
+  void add(const SphereLight& light) {
+    assert(this->by_material.count(light.material_id()) == 0 && "[ERROR] Lights cannot share a material");
+    this->by_material[light.material_id()] = (std::uint32_t)this->spheres.size();
+    this->spheres.push_back(light);
+  }
+
+  bool empty() const { return this->spheres.empty(); }
+  size_t size() const { return this->spheres.size(); }
+
+  // Direction towards one light, picked uniformly
+  std::optional<LightSample> sample(const Point3& p, Sampler& sampler) const {
+    if (this->spheres.empty()) return std::nullopt;
+    const size_t index = std::min((size_t)(sampler.next_double() * this->spheres.size()), this->spheres.size() - 1);
+    std::optional<LightSample> sample = this->spheres[index].sample(p, sampler);
+    if (sample.has_value()) sample->pdf /= (Real)this->spheres.size();
+    return sample;
+  }
+
+  // Density with which sample, from p, picks the direction that hit record.
+  // Zero for surfaces that are not lights in this list.
+  Real pdf(const Point3& p, const HitRecord& record) const {
+    const auto light = this->by_material.find(record.material);
+    if (light == this->by_material.end()) return 0;
+    return this->spheres[light->second].pdf(p) / (Real)this->spheres.size();
+  }
+
+private:
+  std::vector<SphereLight> spheres;
+  std::unordered_map<std::uint32_t, std::uint32_t> by_material;
+};
+
+// Multiple importance sampling weight of a strategy with density f against
+// one with density g (Veach's power heuristic, beta = 2)
+inline Real power_heuristic(Real f, Real g) {
+  const Real f2 = f * f, g2 = g * g;
+  return f2 + g2 > 0 ? f2 / (f2 + g2) : 0;
+}
+
+// Radiance emitted towards the origin of ray by the surface it hit, weighted
+// against light sampling. bsdf_pdf is the density with which the previous
+// bounce picked ray, or 0 if light sampling could not have found this path
+// (camera rays and bounces off non-diffuse materials), which gives the
+// emission full weight.
+inline Color emitted_radiance(const MaterialTable& materials, const LightList& lights,
+                              const Ray& ray, const HitRecord& record, Real bsdf_pdf) {
+  const Color emission = materials.emitted(record);
+  if (bsdf_pdf <= 0 || (emission.x() == 0 && emission.y() == 0 && emission.z() == 0)) return emission;
+  return power_heuristic(bsdf_pdf, lights.pdf(ray.origin(), record)) * emission;
+}
+
+// Next-event estimation: light reaching the hit record from a sampled point
+// on a light and scattered back along ray, weighted against finding the same
+// light by BSDF sampling. Only for is_diffuse materials.
+inline Color sample_direct_light(const Hittable& world, const MaterialTable& materials, const LightList& lights,
+                                 const Ray& ray, const HitRecord& record, Sampler& sampler) {
+  const std::optional<LightSample> sample = lights.sample(record.p, sampler);
+  if (!sample.has_value() || sample->pdf <= 0) return {0, 0, 0};
+  const Color bsdf_cosine = materials.evaluate(record, sample->direction);
+  if (bsdf_cosine.x() == 0 && bsdf_cosine.y() == 0 && bsdf_cosine.z() == 0) return {0, 0, 0};
+
+  // Shadow ray, stopped just short of the light so as not to hit it
+  const Ray shadow(record.spawn_origin(sample->direction), sample->direction, ray.time());
+  Statistics::count(Statistics::Counter::ShadowRays);
+  if (world.occluded(shadow, Interval(0, sample->distance * (Real)(1 - 1e-3)))) return {0, 0, 0};
+
+  // Sampled points face the shading point, so the light shows its front face
+  const Real weight = power_heuristic(sample->pdf, materials.pdf(record, sample->direction));
+  return (weight / sample->pdf) * bsdf_cosine * materials.emission(sample->material);
+}
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Read-only memory mapping of a whole file. The OS reads pages in as they
+// are first touched and may drop them again under memory pressure, so a
+// mapping can be larger than RAM.
+class MappedFile {
+public:
+  // Nothing if the file cannot be opened or mapped, or is empty
+  static std::shared_ptr<const MappedFile> open(const std::string& path) {
+    std::shared_ptr<MappedFile> file(new MappedFile());
+#ifdef _WIN32
+    const HANDLE handle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                                      FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (handle == INVALID_HANDLE_VALUE) return nullptr;
+    LARGE_INTEGER size;
+    if (GetFileSizeEx(handle, &size) && size.QuadPart > 0) {
+      file->mapping = CreateFileMappingA(handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+      if (file->mapping != nullptr) {
+        file->bytes = MapViewOfFile(file->mapping, FILE_MAP_READ, 0, 0, 0);
+        file->length = (size_t)size.QuadPart;
+      }
+    }
+    CloseHandle(handle);
+#else
+    const int descriptor = ::open(path.c_str(), O_RDONLY);
+    if (descriptor < 0) return nullptr;
+    struct stat status;
+    if (fstat(descriptor, &status) == 0 && status.st_size > 0) {
+      void* bytes = mmap(nullptr, (size_t)status.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+      if (bytes != MAP_FAILED) {
+        file->bytes = bytes;
+        file->length = (size_t)status.st_size;
+      }
+    }
+    // The mapping stays valid without the descriptor
+    close(descriptor);
+#endif
+    if (file->bytes == nullptr) return nullptr;
+    return file;
+  }
+
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  ~MappedFile() {
+#ifdef _WIN32
+    if (this->bytes != nullptr) UnmapViewOfFile(this->bytes);
+    if (this->mapping != nullptr) CloseHandle(this->mapping);
+#else
+    if (this->bytes != nullptr) munmap(this->bytes, this->length);
+#endif
+  }
+
+  const unsigned char* data() const { return static_cast<const unsigned char*>(this->bytes); }
+  size_t size() const { return this->length; }
+
+private:
+  void* bytes = nullptr;
+  size_t length = 0;
+#ifdef _WIN32
+  HANDLE mapping = nullptr;
+#endif
+
+  MappedFile() {}
+};
@@ -1,10 +1,17 @@
 #pragma once
 
+#include <cassert>
+#include <cmath>
+#include <cstdint>
 #include <optional>
+#include <vector>
 
+#include "constant.h"
 #include "hittable.h"
 #include "color.h"
 #include "ray.h"
+#include "real.h"
+#include "sampler.h"
 #include "vect3.h"
 
 struct ScatterRecord {
@@ -12,82 +19,190 @@ struct ScatterRecord {
   const Color attenuation;
 };
 
-class Material {
-public:
-  virtual ~Material() = default;
-
-  virtual std::optional<ScatterRecord> scatter(const Ray& ray_in, const HitRecord& record) const {
-    (void)ray_in;
-    (void)record;
-    return std::nullopt;
+// Concrete material kinds. Together with a slot in the table of that kind
+// they make up a material, so scattering is a switch rather than a virtual
+// call and batched shading can group hits by the code they will run.
+enum class MaterialType : std::uint8_t { Lambertian, Metal, Dielectric, DiffuseLight, Count };
+
+inline const char* material_type_name(MaterialType type) {
+  switch (type) {
+    case MaterialType::Lambertian: return "lambertian";
+    case MaterialType::Metal: return "metal";
+    case MaterialType::Dielectric: return "dielectric";
+    case MaterialType::DiffuseLight: return "diffuse_light";
+    default: return "unknown";
   }
-};
+}
 
-class Lambertian: public Material {
-public:
-  Lambertian(const Color& albedo) :albedo(albedo) {};
+struct Lambertian {
+  Color albedo;
+
+  Lambertian(const Color& albedo) : albedo(albedo) {};
 
-  std::optional<ScatterRecord> scatter(const Ray& ray_in, const HitRecord& record) const override {
+  std::optional<ScatterRecord> scatter(const Ray& ray_in, const HitRecord& record, Sampler& sampler) const {
     (void)ray_in;
-    Vect3 scatter_direction = record.normal + random_unit_vector();
+    Vect3 scatter_direction = record.normal + random_unit_vector(sampler);
     if (scatter_direction.near_zero()) {
       scatter_direction = record.normal;
     }
-    return ScatterRecord {Ray(record.p, scatter_direction), this->albedo };
+    return ScatterRecord {Ray(record.spawn_origin(scatter_direction), scatter_direction), this->albedo };
   }
 
-private:
-  const Color albedo;
+  // BSDF times the cosine with the normal, for light leaving along direction:
+  // albedo / pi * cosine, which is albedo times the pdf
+  Color evaluate(const HitRecord& record, const Vect3& direction) const {
+    return this->albedo * Lambertian::pdf(record, direction);
+  }
+
+  // Solid-angle density with which scatter picks direction (cosine-weighted)
+  static Real pdf(const HitRecord& record, const Vect3& direction) {
+    const Real cosine = dot(record.normal, unit_vector(direction));
+    return cosine > 0 ? cosine / (Real)Constant::pi : 0;
+  }
 };
 
-class Metal: public Material {
-public:
-  Metal(const Color& albedo, double fuzz = 0) : albedo(albedo), fuzz(fuzz < 1 ? fuzz : 1) {}
+struct Metal {
+  Color albedo;
+  Real fuzz;
+
+  Metal(const Color& albedo, Real fuzz = 0) : albedo(albedo), fuzz(fuzz < 1 ? fuzz : 1) {}
 
-  std::optional<ScatterRecord> scatter(const Ray& ray_in, const HitRecord& record) const override {
+  std::optional<ScatterRecord> scatter(const Ray& ray_in, const HitRecord& record, Sampler& sampler) const {
     Vect3 reflected = reflect(ray_in.direction(), record.normal);
-    reflected = unit_vector(reflected) + (this->fuzz * random_unit_vector());
-    Ray scattered { record.p, reflected, ray_in.time() };
+    reflected = unit_vector(reflected) + (this->fuzz * random_unit_vector(sampler));
+    Ray scattered { record.spawn_origin(reflected), reflected, ray_in.time() };
     if (dot(scattered.direction(), record.normal) <= 0) {
       return std::nullopt;
     }
     return ScatterRecord{scattered, this->albedo};
   }
-
-private:
-  const Color albedo;
-  const double fuzz;
 };
 
-class Dielectric : public Material {
-public:
-  Dielectric(double refraction_index) : refraction_index(refraction_index) {}
-  
-  std::optional<ScatterRecord> scatter(const Ray& ray_in, const HitRecord& record) const override {
+struct Dielectric {
+  Real refraction_index;
+
+  Dielectric(Real refraction_index) : refraction_index(refraction_index) {}
+
+  std::optional<ScatterRecord> scatter(const Ray& ray_in, const HitRecord& record, Sampler& sampler) const {
     // Assuming air eta is 1.0
-    const double etai_over_etat = record.front_face ? (1.0 / this->refraction_index) : this->refraction_index;
+    const Real etai_over_etat = record.front_face ? (1 / this->refraction_index) : this->refraction_index;
 
     const Vect3 unit_direction = unit_vector(ray_in.direction());
-    const double cos_theta = std::fmin(dot(-unit_direction, record.normal), 1.0);
-    const double sin_theta = std::sqrt(1 - cos_theta * cos_theta);
-    const bool cannot_refract = etai_over_etat * sin_theta > 1.0;
-    const Vect3 direction = (cannot_refract || reflectance(cos_theta, etai_over_etat) > Utility::random_double()) ? 
-      reflect(unit_direction, record.normal) : 
+    const Real cos_theta = std::fmin(dot(-unit_direction, record.normal), (Real)1);
+    const Real sin_theta = std::sqrt(1 - cos_theta * cos_theta);
+    const bool cannot_refract = etai_over_etat * sin_theta > 1;
+    const Vect3 direction = (cannot_refract || reflectance(cos_theta, etai_over_etat) > sampler.next_double()) ?
+      reflect(unit_direction, record.normal) :
       refract(unit_direction, record.normal, etai_over_etat);
 
-    return ScatterRecord { Ray(record.p, direction, ray_in.time()), Color {1.0, 1.0, 1.0} };
+    return ScatterRecord { Ray(record.spawn_origin(direction), direction, ray_in.time()), Color {1.0, 1.0, 1.0} };
   }
 
 private:
-  const double refraction_index;
-
-  static double reflectance(const double cosine, const double refraction_index) {
+  static Real reflectance(const Real cosine, const Real refraction_index) {
     // Schlick's approximation for reflectance
-    double r0 = (1 - refraction_index) / (1 + refraction_index);
+    Real r0 = (1 - refraction_index) / (1 + refraction_index);
     r0 = r0 * r0;
     return r0 + (1 - r0) * std::pow(1 - cosine, 5);
 
   }
 };
 
+// Emits radiance from the front face of its surface and scatters nothing
+struct DiffuseLight {
+  Color emission;
+
+  DiffuseLight(const Color& emission) : emission(emission) {}
+
+  Color emitted(const HitRecord& record) const {
+    return record.front_face ? this->emission : Color(0, 0, 0);
+  }
+};
+
+// Every material of a scene, one array per type. Hits refer to materials by
+// the 32-bit id that add returns.
+class MaterialTable {
+public:
+  std::uint32_t add(const Lambertian& material) {
+    return this->add(MaterialType::Lambertian, this->lambertians, material);
+  }
+
+  std::uint32_t add(const Metal& material) {
+    return this->add(MaterialType::Metal, this->metals, material);
+  }
+
+  std::uint32_t add(const Dielectric& material) {
+    return this->add(MaterialType::Dielectric, this->dielectrics, material);
+  }
+
+  std::uint32_t add(const DiffuseLight& material) {
+    return this->add(MaterialType::DiffuseLight, this->lights, material);
+  }
+
+  size_t size() const { return this->types.size(); }
 
+  MaterialType type(std::uint32_t id) const {
+    assert(id < this->types.size() && "[ERROR] Material id out of range");
+    return this->types[id];
+  }
+
+  std::optional<ScatterRecord> scatter(const Ray& ray_in, const HitRecord& record, Sampler& sampler) const {
+    assert(record.material < this->types.size() && "[ERROR] Material id out of range");
+    const std::uint32_t slot = this->slots[record.material];
+    switch (this->types[record.material]) {
+      case MaterialType::Lambertian: return this->lambertians[slot].scatter(ray_in, record, sampler);
+      case MaterialType::Metal: return this->metals[slot].scatter(ray_in, record, sampler);
+      case MaterialType::Dielectric: return this->dielectrics[slot].scatter(ray_in, record, sampler);
+      default: return std::nullopt;
+    }
+  }
+
+  // Radiance leaving the surface at record towards the ray that hit it
+  Color emitted(const HitRecord& record) const {
+    if (this->type(record.material) != MaterialType::DiffuseLight) return {0, 0, 0};
+    return this->lights[this->slots[record.material]].emitted(record);
+  }
+
+  // Radiance a light emits from its front face; zero for other materials
+  Color emission(std::uint32_t id) const {
+    if (this->type(id) != MaterialType::DiffuseLight) return {0, 0, 0};
+    return this->lights[this->slots[id]].emission;
+  }
+
+  // Whether scatter picks directions from a density that evaluate and pdf
+  // describe. The others (mirrors, glass, lights) are left out of light
+  // sampling.
+  bool is_diffuse(std::uint32_t id) const {
+    return this->type(id) == MaterialType::Lambertian;
+  }
+
+  // BSDF times cosine for light leaving along direction; zero unless is_diffuse
+  Color evaluate(const HitRecord& record, const Vect3& direction) const {
+    if (!this->is_diffuse(record.material)) return {0, 0, 0};
+    return this->lambertians[this->slots[record.material]].evaluate(record, direction);
+  }
+
+  // Solid-angle density of scatter picking direction; zero unless is_diffuse
+  Real pdf(const HitRecord& record, const Vect3& direction) const {
+    if (!this->is_diffuse(record.material)) return 0;
+    return Lambertian::pdf(record, direction);
+  }
+
+private:
+  std::vector<MaterialType> types;
+  // Index into the array of the material's type
+  std::vector<std::uint32_t> slots;
+
+  std::vector<Lambertian> lambertians;
+  std::vector<Metal> metals;
+  std::vector<Dielectric> dielectrics;
+  std::vector<DiffuseLight> lights;
+
+  template <typename T>
+  std::uint32_t add(MaterialType type, std::vector<T>& materials, const T& material) {
+    this->types.push_back(type);
+    this->slots.push_back((std::uint32_t)materials.size());
+    materials.push_back(material);
+    return (std::uint32_t)(this->types.size() - 1);
+  }
+};
@@ -0,0 +1,180 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "text_file.h"
+#include "thread_pool.h"
+#include "triangle_mesh.h"
+
+// Wavefront OBJ geometry: vertex positions ('v x y z') and faces
+// ('f 1 2 3', 'f 1/1/1 2/2/2 3/3/3', ...), whose polygons are split into
+// triangle fans. Indices count from 1, or back from the last vertex so far
+// when negative. Texture coordinates, normals, groups and materials are
+// skipped.
+//
+// Files are read like text scene files: in blocks whose lines are parsed on
+// every thread, straight into TriangleSet arrays.
+namespace ObjFile {
+  namespace detail {
+    // What one thread parsed out of a run of whole lines
+    struct Chunk {
+      std::vector<Point3> vertices;
+      // Indices from 0, except at the positions listed in relative, which
+      // count from the first vertex of the chunk (negative for earlier ones)
+      std::vector<std::int64_t> indices;
+      std::vector<size_t> relative;
+      // Lines are counted from the start of the chunk, starting at 1
+      std::uint64_t lines = 0;
+      std::uint64_t error_line = 0;
+      std::string error;
+    };
+
+    inline bool fail(Chunk& chunk, const std::string& message) {
+      chunk.error_line = chunk.lines;
+      chunk.error = message;
+      return false;
+    }
+
+    // Vertex index of one corner of a face, from e.g. "7", "7/2" or "-1//3"
+    inline bool parse_corner(std::string_view token, Chunk& chunk, std::int64_t corner[2]) {
+      std::int64_t index;
+      if (!TextFile::Tokens::parse(token.substr(0, token.find('/')), index) || index == 0) {
+        return fail(chunk, "bad face corner '" + std::string(token) + "'");
+      }
+      if (index > 0) {
+        corner[0] = index - 1;
+        corner[1] = 0;
+      } else {
+        corner[0] = (std::int64_t)chunk.vertices.size() + index;
+        corner[1] = 1;
+      }
+      return true;
+    }
+
+    inline void parse_chunk(const char* begin, const char* end, Chunk& chunk) {
+      for (const char* line = begin; line < end;) {
+        const char* line_end = std::find(line, end, '\n');
+        chunk.lines++;
+        TextFile::Tokens tokens(line, line_end);
+        const std::string_view keyword = tokens.next();
+
+        if (keyword == "v") {
+          // Anything after x y z, such as w or a color, is skipped
+          double values[3];
+          for (double& value : values) {
+            if (!tokens.number(value)) {
+              fail(chunk, "v needs three numbers");
+              return;
+            }
+          }
+          chunk.vertices.emplace_back((Real)values[0], (Real)values[1], (Real)values[2]);
+        } else if (keyword == "f") {
+          // Fan around the first corner
+          std::int64_t corners[3][2];
+          int count = 0;
+          for (std::string_view token = tokens.next(); !token.empty(); token = tokens.next()) {
+            if (!parse_corner(token, chunk, corners[std::min(count, 2)])) return;
+            if (++count < 3) continue;
+            for (int i = 0; i < 3; i++) {
+              if (corners[i][1] != 0) chunk.relative.push_back(chunk.indices.size());
+              chunk.indices.push_back(corners[i][0]);
+            }
+            std::copy_n(corners[2], 2, corners[1]);
+          }
+          if (count < 3) {
+            fail(chunk, "f needs at least three corners");
+            return;
+          }
+        }
+
+        if (line_end == end) break;
+        line = line_end + 1;
+      }
+    }
+  }
+
+  // Loads the triangles of an OBJ file, parsing on threads threads (0 for
+  // every hardware thread). Problems are reported to cerr with line
+  // numbers.
+  inline std::optional<TriangleSet> load(const std::string& path, unsigned threads = 0) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+      std::cerr << "[ERROR] Cannot open " << path << std::endl;
+      return std::nullopt;
+    }
+    const auto fail = [&](std::uint64_t line, const std::string& message) {
+      std::cerr << "[ERROR] " << path;
+      if (line > 0) std::cerr << ":" << line;
+      std::cerr << ": " << message << std::endl;
+      return false;
+    };
+
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    ThreadPool pool((threads > 0 ? threads : ThreadPool::hardware_threads()) - 1);
+    // 64 KiB of text at least per task
+    const size_t chunks_per_block = std::min<size_t>((pool.size() + 1) * 4, TextFile::block_size >> 16);
+    TriangleSet triangles;
+    std::uint64_t next_line = 1;
+
+    const bool read = TextFile::read_blocks(in, path, [&](const char* begin, const char* end, std::uint64_t remaining) {
+      const std::vector<const char*> bounds = TextFile::split_lines(begin, end, chunks_per_block);
+      std::vector<detail::Chunk> chunks(bounds.size() - 1);
+      {
+        TaskGroup tasks(pool);
+        for (size_t i = 0; i < chunks.size(); i++) {
+          tasks.run([&, i] { detail::parse_chunk(bounds[i], bounds[i + 1], chunks[i]); });
+        }
+      }
+
+      const bool first_block = next_line == 1;
+      for (detail::Chunk& chunk : chunks) {
+        if (!chunk.error.empty()) return fail(next_line + chunk.error_line - 1, chunk.error);
+        const std::int64_t first_vertex = (std::int64_t)triangles.vertices.size();
+        for (const size_t i : chunk.relative) chunk.indices[i] += first_vertex;
+        for (const std::int64_t index : chunk.indices) {
+          // Checked against the final vertex count once all are read
+          if (index < 0 || index > (std::int64_t)UINT32_MAX) {
+            return fail(0, "face refers to vertex " + std::to_string(index + 1));
+          }
+          triangles.indices.push_back((std::uint32_t)index);
+        }
+        triangles.vertices.insert(triangles.vertices.end(), chunk.vertices.begin(), chunk.vertices.end());
+        next_line += chunk.lines;
+        chunk = detail::Chunk();
+      }
+      // Sizes the arrays for the whole file from the first block, as the
+      // scene loader does
+      if (first_block && remaining > 0) {
+        const double scale = (1.0 + (double)remaining / (end - begin)) * 1.02;
+        triangles.vertices.reserve((size_t)(triangles.vertices.size() * scale));
+        triangles.indices.reserve((size_t)(triangles.indices.size() * scale));
+      }
+      return true;
+    });
+    if (!read) return std::nullopt;
+
+    for (const std::uint32_t index : triangles.indices) {
+      if (index >= triangles.vertices.size()) {
+        fail(0, "face refers to vertex " + std::to_string((std::uint64_t)index + 1) + " of only " +
+                std::to_string(triangles.vertices.size()));
+        return std::nullopt;
+      }
+    }
+    if (triangles.size() == 0) {
+      fail(0, "no faces");
+      return std::nullopt;
+    }
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::clog << "[LOG] Loaded " << triangles.size() << " triangles and " << triangles.vertices.size()
+              << " vertices from " << path << " in " << seconds << " s" << std::endl;
+    return triangles;
+  }
+}
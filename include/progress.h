@@ -0,0 +1,70 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+
+// Thread-safe progress log that prints at most once per interval, whatever
+// the number of threads advancing it, so that logging never throttles a
+// render. Lines look like
+//   [LOG] Rendering: 42% (120/286 tiles), 3.1 s elapsed, 4.2 s left
+class ProgressReporter {
+public:
+  ProgressReporter(const std::string& label, std::uint64_t total, const std::string& unit,
+                   double interval_seconds = 1.0) :
+    label(label), unit(unit), total(total), interval(interval_seconds),
+    start(std::chrono::steady_clock::now()), last_report(start) {}
+
+  ProgressReporter(const ProgressReporter&) = delete;
+  ProgressReporter& operator=(const ProgressReporter&) = delete;
+
+  void advance(std::uint64_t amount = 1) {
+    const std::uint64_t done = this->completed.fetch_add(amount, std::memory_order_relaxed) + amount;
+    const Clock::time_point now = Clock::now();
+    {
+      // Threads that find the log busy or the interval not yet over move on
+      std::unique_lock<std::mutex> lock(this->mutex, std::try_to_lock);
+      if (!lock.owns_lock() || seconds(now - this->last_report) < this->interval) return;
+      this->last_report = now;
+    }
+    this->print(done, now);
+  }
+
+  // Logs the final count once every unit is done
+  void finish() {
+    this->print(this->completed.load(), Clock::now());
+  }
+
+private:
+  using Clock = std::chrono::steady_clock;
+
+  const std::string label;
+  const std::string unit;
+  const std::uint64_t total;
+  const double interval;
+  const Clock::time_point start;
+  std::atomic<std::uint64_t> completed{0};
+  std::mutex mutex;
+  Clock::time_point last_report;
+
+  static double seconds(Clock::duration duration) {
+    return std::chrono::duration<double>(duration).count();
+  }
+
+  void print(std::uint64_t done, Clock::time_point now) const {
+    const double elapsed = seconds(now - this->start);
+    const double fraction = this->total == 0 ? 1.0 : (double)done / this->total;
+    std::ostringstream line;
+    line << std::fixed << std::setprecision(1) << "[LOG] " << this->label << ": " << (int)(fraction * 100) << "% ("
+         << done << "/" << this->total << " " << this->unit << "), " << elapsed << " s elapsed";
+    if (done > 0 && done < this->total) line << ", " << elapsed / fraction - elapsed << " s left";
+    line << "\n";
+    // One write per line, so lines from several threads do not interleave
+    std::clog << line.str();
+  }
+};
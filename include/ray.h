@@ -1,26 +1,30 @@
 #pragma once
 
+#include "real.h"
 #include "vect3.h"
 #include "point3.h"
 
-class Ray {
+template <typename T>
+class RayT {
 public:
-  Ray() {};
+  RayT() {};
 
-  Ray(const Point3& origin, const Vect3& direction): orig(origin), dir(direction), tm(0) {};
-  Ray(const Point3& origin, const Vect3& direction, double time): orig(origin), dir(direction), tm(time) {};
+  RayT(const Vect3T<T>& origin, const Vect3T<T>& direction): orig(origin), dir(direction), tm(0) {};
+  RayT(const Vect3T<T>& origin, const Vect3T<T>& direction, T time): orig(origin), dir(direction), tm(time) {};
 
-  const Point3& origin() const { return orig;};
-  const Vect3& direction() const { return dir; };
+  const Vect3T<T>& origin() const { return orig;};
+  const Vect3T<T>& direction() const { return dir; };
 
-  double time() const { return this->tm; };
+  T time() const { return this->tm; };
 
-  Point3 at(double t) const {
+  Vect3T<T> at(T t) const {
     return orig + t * dir;
   }
   
 private:
-  Point3 orig;
-  Vect3 dir;
-  double tm;
+  Vect3T<T> orig;
+  Vect3T<T> dir;
+  T tm;
 };
+
+using Ray = RayT<Real>;
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+#include "interval.h"
+#include "ray.h"
+#include "real.h"
+
+// Up to 64 coherent rays traced together, e.g. the camera rays of an 8x8
+// pixel block. The slab test data is kept as float SoA lanes so that one node
+// can be tested against every ray of the packet in a vectorizable loop.
+struct RayPacket {
+  static constexpr int max_size = 64;
+
+  int size = 0;
+  Ray rays[max_size];
+  Real t_min[max_size];
+  Real t_max[max_size];
+
+  alignas(32) float origin[3][max_size];
+  alignas(32) float inverse_direction[3][max_size];
+  alignas(32) float t_min_lane[max_size];
+  alignas(32) float t_max_lane[max_size];
+
+  void add(const Ray& ray, const Interval& ray_t) {
+    assert(this->size < max_size && "[ERROR] Ray packet is full");
+    const int i = this->size++;
+    this->rays[i] = ray;
+    this->t_min[i] = ray_t.min;
+    this->t_max[i] = ray_t.max;
+    this->t_min_lane[i] = (float)ray_t.min;
+    this->t_max_lane[i] = (float)ray_t.max;
+    for (int axis = 0; axis < 3; axis++) {
+      this->origin[axis][i] = (float)ray.origin()[axis];
+      this->inverse_direction[axis][i] = (float)(1 / ray.direction()[axis]);
+    }
+  }
+
+  Interval interval(int i) const { return {this->t_min[i], this->t_max[i]}; }
+
+  // Records a closer hit for ray i
+  void narrow(int i, Real t) {
+    this->t_max[i] = t;
+    this->t_max_lane[i] = (float)t;
+  }
+
+  std::uint64_t all() const {
+    return this->size == max_size ? ~0ULL : (1ULL << this->size) - 1;
+  }
+
+  static int lowest_ray(std::uint64_t mask) {
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward64(&index, mask);
+    return (int)index;
+#else
+    return __builtin_ctzll(mask);
+#endif
+  }
+
+  static int count(std::uint64_t mask) {
+#if defined(_MSC_VER)
+    return (int)__popcnt64(mask);
+#else
+    return __builtin_popcountll(mask);
+#endif
+  }
+};
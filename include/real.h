@@ -0,0 +1,43 @@
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <type_traits>
+
+// Scalar type of the math core (vectors, rays, intervals, boxes, primitive
+// storage), chosen for the whole renderer at build time. Float halves the
+// memory traffic and doubles the SIMD lanes; double is the default.
+#if defined(RAYTRACER_FLOAT) && RAYTRACER_FLOAT
+#define RAYTRACER_REAL_FLOAT 1
+using Real = float;
+#else
+#define RAYTRACER_REAL_FLOAT 0
+using Real = double;
+#endif
+
+namespace Utility {
+  // Bound on the relative rounding error of n chained operations in Real
+  // (Higham; pbrt's gamma_n)
+  constexpr inline Real gamma(int n) {
+    constexpr Real unit_roundoff = std::numeric_limits<Real>::epsilon() / 2;
+    return (n * unit_roundoff) / (1 - n * unit_roundoff);
+  }
+
+  // Adjacent representable values (pbrt's NextFloatUp/Down), without the
+  // library call of std::nextafter
+  inline Real next_real_up(Real value) {
+    if (std::isinf(value) && value > 0) return value;
+    if (value == 0) value = 0; // -0 becomes +0
+    std::conditional_t<sizeof(Real) == 4, std::uint32_t, std::uint64_t> bits;
+    std::memcpy(&bits, &value, sizeof(Real));
+    bits = value >= 0 ? bits + 1 : bits - 1;
+    std::memcpy(&value, &bits, sizeof(Real));
+    return value;
+  }
+
+  inline Real next_real_down(Real value) {
+    return -next_real_up(-value);
+  }
+}
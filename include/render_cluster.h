@@ -0,0 +1,501 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <csignal>
+#include <spawn.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#include "camera.h"
+#include "framebuffer.h"
+#include "hittable.h"
+#include "image_writer.h"
+#include "light.h"
+#include "material.h"
+#include "progress.h"
+#include "real.h"
+#include "socket.h"
+#include "thread_pool.h"
+#include "wavefront.h"
+
+#ifndef _WIN32
+extern char** environ;
+#endif
+
+// Renders one image across worker processes. The coordinator hands the
+// camera's tiles out over TCP, and every worker, which loaded the same scene
+// file, traces them and sends their pixels back as floats. Random numbers
+// are keyed by pixel, so the image is the same, bit for bit, as a render in
+// one process.
+//
+// Protocol, in the byte order of the host (coordinator and workers run on
+// machines of the same architecture):
+//   worker:      Hello once it has loaded the scene
+//   coordinator: u32 tile index to render, up to Hello::slots at a time,
+//                or all_done once the image is finished
+//   worker:      ResultHeader, then the tile's pixels, row by row, 3 floats
+//                each, for every tile; and while it has tiles, a
+//                ResultHeader for the heartbeat tile alone every
+//                heartbeat_interval seconds
+// Tiles of a worker that disconnects, or that has tiles but sends nothing
+// for Settings::worker_timeout seconds, go back to the queue. Heartbeats
+// keep a worker that is only slow from timing out however long one tile
+// takes; one whose tiles never finish is overtaken by the second copies
+// below. Once the
+// queue is empty, idle workers take a second copy of the tiles still in
+// flight, so a slow worker does not hold the image up; the first copy to
+// come back is kept.
+namespace RenderCluster {
+  constexpr std::uint32_t magic = 0x57445452; // "RTDW"
+  constexpr std::uint32_t version = 2;
+  constexpr std::uint32_t all_done = 0xFFFFFFFF;
+  constexpr std::uint32_t heartbeat = 0xFFFFFFFF;
+  // Seconds between heartbeats, well below any sensible worker_timeout
+  constexpr double heartbeat_interval = 1;
+
+  struct Hello {
+    std::uint32_t magic;
+    std::uint32_t version;
+    // SceneFile::content_hash of the scene file the worker loaded
+    std::uint64_t scene_hash;
+    std::uint32_t tile_count;
+    // Tiles the worker takes at once
+    std::uint32_t slots;
+    // Workers built with another Real trace another image
+    std::uint32_t real_size;
+    // Process id of the worker, so that the coordinator can stop the ones it
+    // started itself; 0 if unknown
+    std::uint32_t process;
+  };
+
+  static_assert(sizeof(Hello) == 32, "Hello should stay 32 bytes");
+
+  struct ResultHeader {
+    std::uint32_t tile;
+    std::uint32_t padding;
+    std::uint64_t paths;
+    std::uint64_t rays;
+    std::uint64_t samples;
+  };
+
+  static_assert(sizeof(ResultHeader) == 32, "ResultHeader should stay 32 bytes");
+
+  struct Settings {
+    double worker_timeout = 60;
+    // Called with the process id from the Hello of every worker dropped
+    // after sending one, see LocalWorkers::stop
+    std::function<void(std::uint32_t process)> dropped;
+  };
+
+  namespace detail {
+    struct Worker {
+      Socket socket;
+      std::vector<unsigned char> input;
+      bool ready = false;
+      std::uint32_t slots = 0;
+      std::uint32_t process = 0;
+      std::vector<int> tiles; // In flight
+      std::chrono::steady_clock::time_point last_heard;
+    };
+  }
+
+  // Renders camera's image on the workers that connect to listener and
+  // writes it to camera.output_path, like Camera::render. scene_hash is the
+  // content hash of the scene file, which workers have to match. Fails if no
+  // worker is connected for settings.worker_timeout seconds.
+  inline bool coordinate(Camera& camera, std::uint64_t scene_hash, const Socket& listener,
+                         const Settings& settings = Settings()) {
+    using Clock = std::chrono::steady_clock;
+    const auto seconds_since = [](Clock::time_point time) {
+      return std::chrono::duration<double>(Clock::now() - time).count();
+    };
+    const Clock::time_point start = Clock::now();
+
+    const int tile_count = camera.prepare_tiles();
+    Framebuffer image(camera.image_width, camera.height());
+    const ImageFormat format = ImageWriter::resolve_format(camera.output_path, camera.output_format);
+    std::unique_ptr<TileStreamWriter> stream;
+    if (camera.stream_tiles && !camera.output_path.empty() && ImageWriter::supports_streaming(format)) {
+      stream = std::make_unique<TileStreamWriter>(image, camera.output_path, format);
+    }
+
+    std::deque<int> pending;
+    for (int tile = 0; tile < tile_count; tile++) pending.push_back(tile);
+    std::vector<int> holders(tile_count, 0);
+    std::vector<bool> done(tile_count, false);
+    int remaining = tile_count;
+    std::uint64_t paths = 0, rays = 0, samples = 0;
+
+    std::vector<std::unique_ptr<detail::Worker>> workers;
+    Clock::time_point unattended_since = Clock::now();
+    std::clog << "[LOG] Coordinating " << tile_count << " tiles on port " << listener.port() << std::endl;
+    ProgressReporter progress("Rendering", (std::uint64_t)tile_count, "tiles");
+
+    // Back to the front of the queue go the tiles no one else has
+    const auto drop = [&](size_t index, const std::string& reason) {
+      detail::Worker& worker = *workers[index];
+      std::clog << "[LOG] Dropping a worker: " << reason << ", " << worker.tiles.size() << " tiles re-queued"
+                << std::endl;
+      for (const int tile : worker.tiles) {
+        if (--holders[tile] == 0 && !done[tile]) pending.push_front(tile);
+      }
+      const std::uint32_t process = worker.process;
+      workers.erase(workers.begin() + index);
+      if (process != 0 && settings.dropped) settings.dropped(process);
+    };
+
+    // Reads the messages that have fully arrived. False on a protocol error.
+    const auto read_messages = [&](detail::Worker& worker, std::string& error) {
+      size_t next = 0;
+      if (!worker.ready && worker.input.size() >= sizeof(Hello)) {
+        Hello hello;
+        std::memcpy(&hello, worker.input.data(), sizeof(hello));
+        next = sizeof(hello);
+        if (hello.magic != magic || hello.version != version) {
+          error = "not a worker of this version";
+        } else if (hello.scene_hash != scene_hash || hello.tile_count != (std::uint32_t)tile_count) {
+          error = "it loaded another scene";
+        } else if (hello.real_size != sizeof(Real)) {
+          error = "it was built with another Real";
+        } else if (hello.slots == 0) {
+          error = "it has no threads";
+        }
+        if (!error.empty()) return false;
+        worker.ready = true;
+        worker.slots = hello.slots;
+        worker.process = hello.process;
+      }
+      while (worker.ready && worker.input.size() - next >= sizeof(ResultHeader)) {
+        ResultHeader header;
+        std::memcpy(&header, worker.input.data() + next, sizeof(header));
+        if (header.tile == heartbeat) {
+          next += sizeof(header);
+          continue;
+        }
+        const std::vector<int>::iterator assigned =
+            std::find(worker.tiles.begin(), worker.tiles.end(), (int)header.tile);
+        if (assigned == worker.tiles.end()) {
+          error = "it sent a tile it was not given";
+          return false;
+        }
+        const Camera::Tile bounds = camera.tile((int)header.tile);
+        const size_t bytes = bounds.pixel_count() * 3 * sizeof(float);
+        if (worker.input.size() - next - sizeof(header) < bytes) break;
+        const unsigned char* pixels = worker.input.data() + next + sizeof(header);
+        next += sizeof(header) + bytes;
+
+        worker.tiles.erase(assigned);
+        holders[header.tile]--;
+        if (done[header.tile]) continue;
+        const size_t row_bytes = (size_t)(bounds.x1 - bounds.x0) * 3 * sizeof(float);
+        for (int y = bounds.y0; y < bounds.y1; y++) {
+          std::memcpy(image.pixel(bounds.x0, y), pixels + (y - bounds.y0) * row_bytes, row_bytes);
+        }
+        done[header.tile] = true;
+        remaining--;
+        paths += header.paths;
+        rays += header.rays;
+        samples += header.samples;
+        if (stream) stream->write_tile(bounds.x0, bounds.y0, bounds.x1, bounds.y1);
+        progress.advance();
+      }
+      worker.input.erase(worker.input.begin(), worker.input.begin() + next);
+      return true;
+    };
+
+    std::vector<const Socket*> sockets;
+    std::vector<bool> readable;
+    while (remaining > 0) {
+      // Fill every free slot: queued tiles first, then second copies of the
+      // tiles in flight on other workers
+      for (size_t index = 0; index < workers.size(); index++) {
+        detail::Worker& worker = *workers[index];
+        bool sent = true;
+        while (worker.ready && worker.tiles.size() < worker.slots && sent) {
+          int tile = -1;
+          while (!pending.empty() && tile < 0) {
+            if (!done[pending.front()]) tile = pending.front();
+            pending.pop_front();
+          }
+          for (int other = 0; other < tile_count && tile < 0; other++) {
+            if (!done[other] && holders[other] == 1 &&
+                std::find(worker.tiles.begin(), worker.tiles.end(), other) == worker.tiles.end()) {
+              tile = other;
+            }
+          }
+          if (tile < 0) break;
+          const std::uint32_t command = (std::uint32_t)tile;
+          sent = worker.socket.send_all(&command, sizeof(command));
+          if (worker.tiles.empty()) worker.last_heard = Clock::now();
+          worker.tiles.push_back(tile);
+          holders[tile]++;
+        }
+        if (!sent) drop(index--, "disconnected");
+      }
+
+      sockets.assign(1, &listener);
+      for (const std::unique_ptr<detail::Worker>& worker : workers) sockets.push_back(&worker->socket);
+      Socket::wait_readable(sockets, readable, 250);
+
+      for (size_t index = workers.size(); index-- > 0;) {
+        detail::Worker& worker = *workers[index];
+        if (!readable[index + 1]) continue;
+        std::string error;
+        if (!worker.socket.receive_available(worker.input)) {
+          // Results that made it before the connection closed still count
+          read_messages(worker, error);
+          drop(index, "disconnected");
+        } else if (!read_messages(worker, error)) {
+          drop(index, error);
+        } else {
+          worker.last_heard = Clock::now();
+        }
+      }
+      for (size_t index = workers.size(); index-- > 0;) {
+        const detail::Worker& worker = *workers[index];
+        if (!worker.tiles.empty() && seconds_since(worker.last_heard) > settings.worker_timeout) {
+          drop(index, "timed out");
+        }
+      }
+      if (readable[0]) {
+        std::optional<Socket> connection = listener.accept();
+        if (connection.has_value()) {
+          workers.push_back(std::make_unique<detail::Worker>());
+          workers.back()->socket = std::move(connection.value());
+        }
+      }
+
+      if (!workers.empty()) {
+        unattended_since = Clock::now();
+      } else if (seconds_since(unattended_since) > settings.worker_timeout) {
+        std::cerr << "[ERROR] No worker connected for " << settings.worker_timeout << " s, " << remaining
+                  << " tiles left" << std::endl;
+        return false;
+      }
+    }
+    progress.finish();
+
+    for (const std::unique_ptr<detail::Worker>& worker : workers) {
+      worker->socket.send_all(&all_done, sizeof(all_done));
+    }
+    if (camera.adaptive_sampling) {
+      std::clog << "[LOG] Adaptive sampling: " << (double)samples / ((double)image.width() * image.height())
+                << " samples per pixel on average" << std::endl;
+    }
+    std::clog << "[LOG] Average path length: " << (paths == 0 ? 0.0 : (double)rays / paths) << " rays, rendered in "
+              << seconds_since(start) << " s" << std::endl;
+    // Streamed tiles stop being written once the file fails
+    bool written = !stream || stream->good();
+    if (!stream && !camera.output_path.empty()) written = ImageWriter::write(image, camera.output_path, format);
+    if (!written) {
+      std::cerr << "[ERROR] Cannot write the image to " << camera.output_path << std::endl;
+      return false;
+    }
+    std::clog << "[LOG] Done" << std::endl;
+    return true;
+  }
+
+  // Renders the tiles the coordinator at the other end of connection asks
+  // for, threads at a time, until it says the image is done. scene_hash is
+  // the content hash of the scene file world was loaded from.
+  inline bool work(Camera& camera, const Hittable& world, const MaterialTable& materials, const LightList& lights,
+                   std::uint64_t scene_hash, const Socket& connection, unsigned threads = 0) {
+    const int tile_count = camera.prepare_tiles();
+    if (threads == 0) threads = ThreadPool::hardware_threads();
+    // Twice as many tiles as threads, so that none waits for the next
+#ifdef _WIN32
+    const std::uint32_t process = 0;
+#else
+    const std::uint32_t process = (std::uint32_t)getpid();
+#endif
+    const Hello hello{magic, version, scene_hash, (std::uint32_t)tile_count, 2 * threads, sizeof(Real), process};
+    if (!connection.send_all(&hello, sizeof(hello))) {
+      std::cerr << "[ERROR] Lost the coordinator" << std::endl;
+      return false;
+    }
+    std::clog << "[LOG] Working on " << threads << " threads" << std::endl;
+
+    // This thread only reads the coordinator's commands
+    ThreadPool pool(threads);
+    Framebuffer image(camera.image_width, camera.height());
+    WavefrontStatistics wavefront_stats;
+    std::mutex send_mutex;
+    std::atomic<bool> finished{false};
+    std::atomic<int> tiles_rendered{0};
+    bool lost = false;
+
+    // Heartbeats while tiles are in flight, from a thread of their own
+    std::atomic<int> in_flight{0};
+    std::mutex heartbeat_mutex;
+    std::condition_variable heartbeat_stop;
+    bool stopping = false;
+    std::thread heartbeats([&] {
+      const ResultHeader beat{heartbeat, 0, 0, 0, 0};
+      std::unique_lock<std::mutex> lock(heartbeat_mutex);
+      while (!heartbeat_stop.wait_for(lock, std::chrono::duration<double>(heartbeat_interval),
+                                      [&] { return stopping; })) {
+        if (in_flight.load() == 0) continue;
+        std::lock_guard<std::mutex> send_lock(send_mutex);
+        connection.send_all(&beat, sizeof(beat));
+      }
+    });
+    {
+      TaskGroup tiles(pool);
+      while (true) {
+        std::uint32_t command;
+        if (!connection.receive_all(&command, sizeof(command)) ||
+            (command != all_done && command >= (std::uint32_t)tile_count)) {
+          lost = true;
+          break;
+        }
+        if (command == all_done) break;
+        in_flight++;
+        tiles.run([&, command] {
+          // Second copies the coordinator no longer needs
+          if (finished.load(std::memory_order_relaxed)) {
+            in_flight--;
+            return;
+          }
+          const Camera::TileStatistics taken =
+              camera.trace_tile(world, materials, lights, (int)command, image, wavefront_stats);
+          const Camera::Tile bounds = camera.tile((int)command);
+          const ResultHeader header{command, 0, taken.paths, taken.rays, taken.samples};
+          std::vector<unsigned char> message(sizeof(header) + bounds.pixel_count() * 3 * sizeof(float));
+          std::memcpy(message.data(), &header, sizeof(header));
+          const size_t row_bytes = (size_t)(bounds.x1 - bounds.x0) * 3 * sizeof(float);
+          for (int y = bounds.y0; y < bounds.y1; y++) {
+            std::memcpy(message.data() + sizeof(header) + (y - bounds.y0) * row_bytes, image.pixel(bounds.x0, y),
+                        row_bytes);
+          }
+          std::lock_guard<std::mutex> lock(send_mutex);
+          // A coordinator that is gone shows in the next read
+          connection.send_all(message.data(), message.size());
+          tiles_rendered++;
+          in_flight--;
+        });
+      }
+      finished = true;
+    }
+    {
+      std::lock_guard<std::mutex> lock(heartbeat_mutex);
+      stopping = true;
+    }
+    heartbeat_stop.notify_one();
+    heartbeats.join();
+    if (lost) {
+      std::cerr << "[ERROR] Lost the coordinator" << std::endl;
+      return false;
+    }
+    std::clog << "[LOG] Rendered " << tiles_rendered.load() << " tiles" << std::endl;
+    return true;
+  }
+
+  // Copies of this program working for a coordinator on this host, started
+  // with arguments (arguments[0] being the program), and stopped when
+  // destroyed: a worker that is done exits by itself, but one that hangs or
+  // was stopped with SIGSTOP would otherwise hold the coordinator up
+  class LocalWorkers {
+  public:
+    // Seconds a worker has to exit after SIGTERM before it gets SIGKILL
+    static constexpr double grace_period = 2;
+
+    LocalWorkers(const std::vector<std::string>& arguments, int count) {
+#ifdef _WIN32
+      (void)arguments;
+      (void)count;
+      std::cerr << "[ERROR] Local workers are not supported on this platform" << std::endl;
+#else
+      std::vector<char*> argv;
+      for (const std::string& argument : arguments) argv.push_back(const_cast<char*>(argument.c_str()));
+      argv.push_back(nullptr);
+      for (int i = 0; i < count; i++) {
+        pid_t process;
+        const int error = posix_spawnp(&process, argv[0], nullptr, nullptr, argv.data(), environ);
+        if (error != 0) {
+          std::cerr << "[ERROR] Cannot start " << arguments[0] << ": " << std::strerror(error) << std::endl;
+          break;
+        }
+        this->processes.push_back(process);
+      }
+#endif
+    }
+
+    LocalWorkers(const LocalWorkers&) = delete;
+    LocalWorkers& operator=(const LocalWorkers&) = delete;
+
+    ~LocalWorkers() {
+#ifndef _WIN32
+      LocalWorkers::terminate(this->processes);
+#endif
+    }
+
+    // Stops the worker with this process id, if it is one of these, such as
+    // one the coordinator dropped
+    void stop(std::uint32_t process) {
+#ifdef _WIN32
+      (void)process;
+#else
+      const std::vector<pid_t>::iterator found =
+          std::find(this->processes.begin(), this->processes.end(), (pid_t)process);
+      if (found == this->processes.end()) return;
+      this->processes.erase(found);
+      LocalWorkers::terminate({(pid_t)process});
+#endif
+    }
+
+    size_t size() const {
+#ifdef _WIN32
+      return 0;
+#else
+      return this->processes.size();
+#endif
+    }
+
+  private:
+#ifndef _WIN32
+    std::vector<pid_t> processes;
+
+    // SIGTERM, with SIGCONT so that a stopped process gets it too, then
+    // SIGKILL for the processes still running after grace_period seconds
+    static void terminate(std::vector<pid_t> running) {
+      for (const pid_t process : running) {
+        kill(process, SIGTERM);
+        kill(process, SIGCONT);
+      }
+      const std::chrono::steady_clock::time_point deadline =
+          std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                                                 std::chrono::duration<double>(grace_period));
+      while (true) {
+        running.erase(std::remove_if(running.begin(), running.end(),
+                                     [](pid_t process) { return waitpid(process, nullptr, WNOHANG) != 0; }),
+                      running.end());
+        if (running.empty() || std::chrono::steady_clock::now() >= deadline) break;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      }
+      for (const pid_t process : running) {
+        std::cerr << "[ERROR] Worker " << process << " did not exit, killing it" << std::endl;
+        kill(process, SIGKILL);
+        waitpid(process, nullptr, 0);
+      }
+    }
+#endif
+  };
+}
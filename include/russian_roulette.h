@@ -0,0 +1,23 @@
+#pragma once
+
+#include <algorithm>
+
+#include "color.h"
+#include "real.h"
+#include "sampler.h"
+
+// Russian roulette (Arvo and Kirk 1990): once a path has taken min_bounces
+// bounces, it survives with probability equal to its largest throughput
+// component, capped at 95% so that even paths through clear glass end after
+// some 20 more bounces on average, and survivors are reweighted by the
+// inverse of that probability, which keeps the estimate unbiased.
+// Returns whether the path goes on. Draws one number from the sampler's
+// current dimension, and none before min_bounces.
+inline bool russian_roulette(Color &throughput, int bounces, int min_bounces, Sampler &sampler) {
+  if (bounces < min_bounces) return true;
+  const Real largest = std::max({throughput.x(), throughput.y(), throughput.z()});
+  const Real survival = std::min(largest, (Real)0.95);
+  if (survival <= 0 || sampler.next_double() >= survival) return false;
+  throughput /= survival;
+  return true;
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstdint>
+
+// Per-path random number source
+// A Sampler is a PCG32 generator (O'Neill, pcg-random.org) whose state is
+// derived by hashing (seed, pixel, sample, dimension). Nothing is shared between
+// paths, so any thread may render any pixel in any order and still draw exactly
+// the same numbers. It is small enough to live in registers: pass it down by
+// reference rather than storing it.
+class Sampler {
+public:
+  Sampler(std::uint64_t seed, std::uint64_t pixel, std::uint32_t sample)
+      : key(Sampler::mix(Sampler::mix(seed ^ Sampler::mix(pixel)) + sample)) {
+    this->start_dimension(0);
+  }
+
+  // Jumps to an independent sequence for a sampling dimension (camera sample,
+  // then one per bounce). Draws made in one dimension never shift the numbers
+  // seen by the next, whatever the rejection loops in between consumed.
+  void start_dimension(std::uint32_t dimension) {
+    const std::uint64_t sequence = Sampler::mix(this->key + dimension);
+    this->increment = (sequence << 1) | 1u;
+    this->state = 0;
+    this->next_uint32();
+    this->state += Sampler::mix(sequence ^ this->key);
+    this->next_uint32();
+  }
+
+  std::uint32_t next_uint32() {
+    const std::uint64_t old_state = this->state;
+    this->state = old_state * 6364136223846793005ULL + this->increment;
+    const std::uint32_t xor_shifted = (std::uint32_t)(((old_state >> 18u) ^ old_state) >> 27u);
+    const std::uint32_t rotation = (std::uint32_t)(old_state >> 59u);
+    return (xor_shifted >> rotation) | (xor_shifted << ((-rotation) & 31u));
+  }
+
+  // Uniform in [0, 1)
+  double next_double() {
+    return this->next_uint32() * 0x1p-32;
+  }
+
+  // Uniform in [min, max)
+  double next_double(double min, double max) {
+    return min + (max - min) * this->next_double();
+  }
+
+  // Uniform in [min, max]
+  int next_int(int min, int max) {
+    return (int)this->next_double(min, max + 1);
+  }
+
+private:
+  std::uint64_t key;
+  std::uint64_t state;
+  std::uint64_t increment;
+
+  // SplitMix64 finalizer
+  static constexpr std::uint64_t mix(std::uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+  }
+};
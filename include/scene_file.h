@@ -0,0 +1,782 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "bvh_cache.h"
+#include "camera.h"
+#include "light.h"
+#include "material.h"
+#include "obj_file.h"
+#include "sphere_set.h"
+#include "text_file.h"
+#include "thread_pool.h"
+#include "transform.h"
+#include "triangle_mesh.h"
+
+// A triangle mesh of a scene, all of whose triangles have one material
+struct SceneMesh {
+  TriangleSet triangles;
+  std::uint32_t material;
+};
+
+// One placement of a model, i.e. of a mesh shared by all its instances
+struct SceneInstance {
+  // Index in Scene::models
+  std::uint32_t model;
+  std::uint32_t material;
+  Transform transform;
+};
+
+// Everything a scene file describes. Emissive spheres are lights as well.
+struct Scene {
+  MaterialTable materials;
+  SphereSet spheres;
+  std::vector<SceneMesh> meshes;
+  std::vector<TriangleSet> models;
+  std::vector<SceneInstance> instances;
+  LightList lights;
+  Camera camera;
+  // Statements other than spheres in file order, which the binary format
+  // stores as its header
+  std::string header;
+};
+
+// Scene files
+//
+// Text, one statement per line, '#' starts a comment:
+//   raytracer_scene 1                        # first line: format version
+//   camera look_from 13 2 3                  # also look_at, v_up
+//   camera vertical_fov 20                   # also defocus_angle, focus_distance
+//   render image_width 800                   # also samples_per_pixel, max_ray_depth
+//   render aspect_ratio 1.7778
+//   render sky off                           # or on
+//   render background 0 0 0
+//   render output image.ppm
+//   render adaptive on                       # or off; see Camera::adaptive_sampling
+//   render adaptive_min_samples 16           # also adaptive_max_samples, adaptive_pass_samples
+//   render noise_threshold 0.01
+//   render sample_heatmap samples.pfm
+//   render packet_size 8                     # 4 or 8 for packets of camera rays, 0 for single rays
+//   render wavefront on                      # or off; see Camera::wavefront
+//   render wavefront_sort_rays on            # or off
+//   render wavefront_batch_size 65536
+//   material ground lambertian 0.5 0.5 0.5   # name type parameters
+//   material chrome metal 0.7 0.6 0.5 0.0    # albedo, fuzz
+//   material glass dielectric 1.5            # refraction index
+//   material lamp light 4 4 4                # emission
+//   sphere 0 -1000 0 1000 ground             # center, radius, material
+//   moving_sphere 0 1 0 0 1.5 0 0.2 glass    # center at time 0 and 1, radius, material
+//   mesh models/bunny.obj clay               # OBJ file, relative to this file; material
+//   model tree models/tree.obj               # name, OBJ file: a mesh for instances
+//   instance tree bark scale 2 rotate y 30 translate 4 0 1
+//                                            # model, material, transform
+// Materials may be defined anywhere in the file. A sphere with a light
+// material is also sampled as a light; it has to be stationary and the only
+// sphere with that material. Meshes with a light material glow, but are not
+// sampled as lights. Models are loaded once however many instances place
+// them. An instance's transform is applied to the model in the order
+// written: translate x y z, rotate x|y|z degrees, scale s or scale x y z.
+//
+// Binary, for large generated scenes, in host byte order:
+//   "RTSB", u32 version, u64 header size, header (text statements other
+//   than spheres, meshes included), u64 count, count stationary spheres of
+//   {f32 x, y, z, radius; u32 material}, u64 count, count moving spheres of
+//   {f32 x, y, z, x1, y1, z1, radius; u32 material}
+// where material is the index of the material among the header's
+// definitions.
+//
+// Text files are read in blocks whose lines are parsed on every thread,
+// straight into SphereSet arrays; only one block is held at a time.
+namespace SceneFile {
+  constexpr std::uint32_t text_version = 1;
+  constexpr std::uint32_t binary_version = 1;
+
+  // Adds a SphereLight for every sphere with a light material, which has to
+  // be stationary and the only sphere with that material. Returns the first
+  // material that is not, if any. Works on a SphereSet or SphereArrays, where
+  // the same sphere may appear more than once.
+  template <typename Spheres>
+  std::optional<std::uint32_t> add_lights(const Spheres& spheres, const MaterialTable& materials, LightList& lights) {
+    std::unordered_map<std::uint32_t, size_t> used;
+    for (size_t i = 0; i < spheres.size(); i++) {
+      const std::uint32_t material = spheres.material_id[i];
+      if (materials.type(material) != MaterialType::DiffuseLight) continue;
+      const bool moving = spheres.motion_x[i] != 0 || spheres.motion_y[i] != 0 || spheres.motion_z[i] != 0;
+      if (moving) return material;
+      const auto [first, inserted] = used.emplace(material, i);
+      if (!inserted) {
+        const size_t j = first->second;
+        const bool same = spheres.center_x[i] == spheres.center_x[j] && spheres.center_y[i] == spheres.center_y[j] &&
+                          spheres.center_z[i] == spheres.center_z[j] && spheres.radius[i] == spheres.radius[j];
+        if (same) continue;
+        return material;
+      }
+      lights.add(SphereLight(spheres.center(i, 0), spheres.radius[i], material));
+    }
+    return std::nullopt;
+  }
+
+  namespace detail {
+    using TextFile::Tokens;
+
+    // Spheres decoded from a binary file at a time
+    constexpr size_t binary_batch = 1 << 16;
+
+    struct Statement {
+      std::uint64_t line;
+      std::string text;
+    };
+
+    // Material referred to by the spheres of a chunk, by its local index
+    struct MaterialUse {
+      std::string name;
+      std::uint64_t line;
+    };
+
+    // What one thread parsed out of a run of whole lines. Spheres carry
+    // indices into materials until the file's materials are all known.
+    struct Chunk {
+      SphereSet spheres;
+      std::vector<MaterialUse> materials;
+      std::vector<Statement> statements;
+      // Lines are counted from the start of the chunk, starting at 1
+      std::uint64_t lines = 0;
+      std::uint64_t error_line = 0;
+      std::string error;
+    };
+
+    // Spheres are skipped unless spheres is set
+    inline void parse_chunk(const char* begin, const char* end, Chunk& chunk, bool spheres) {
+      std::unordered_map<std::string, std::uint32_t> material_index;
+      // Neighbouring spheres tend to share a material
+      std::string_view last_name;
+      std::uint32_t last_index = 0;
+
+      for (const char* line = begin; line < end;) {
+        const char* line_end = std::find(line, end, '\n');
+        chunk.lines++;
+        Tokens tokens(line, line_end);
+        const std::string_view keyword = tokens.next();
+
+        const bool sphere = keyword == "sphere" || keyword == "moving_sphere";
+        if (sphere && !spheres) {
+          // Taken from elsewhere, e.g. a BVH cache
+        } else if (sphere) {
+          const bool moving = keyword == "moving_sphere";
+          const int count = moving ? 7 : 4;
+          double values[7];
+          for (int i = 0; i < count; i++) {
+            if (!tokens.number(values[i])) {
+              chunk.error_line = chunk.lines;
+              chunk.error = std::string(keyword) + " needs " + std::to_string(count) + " numbers and a material";
+              return;
+            }
+          }
+          const std::string_view name = tokens.next();
+          if (name.empty() || !tokens.done()) {
+            chunk.error_line = chunk.lines;
+            chunk.error = std::string(keyword) + " needs " + std::to_string(count) + " numbers and a material";
+            return;
+          }
+          if (name != last_name) {
+            const std::string key(name);
+            const auto found = material_index.find(key);
+            if (found != material_index.end()) {
+              last_index = found->second;
+            } else {
+              last_index = (std::uint32_t)chunk.materials.size();
+              material_index.emplace(key, last_index);
+              chunk.materials.push_back(MaterialUse{key, chunk.lines});
+            }
+            last_name = name;
+          }
+          const Point3 center1((Real)values[0], (Real)values[1], (Real)values[2]);
+          const Point3 center2 = moving ? Point3((Real)values[3], (Real)values[4], (Real)values[5]) : center1;
+          chunk.spheres.add(center1, center2, (Real)values[count - 1], last_index);
+        } else if (!keyword.empty()) {
+          const char* text_end = line_end > line && line_end[-1] == '\r' ? line_end - 1 : line_end;
+          chunk.statements.push_back(Statement{chunk.lines, std::string(line, text_end)});
+        }
+
+        if (line_end == end) break;
+        line = line_end + 1;
+      }
+    }
+
+    // Applies statements, merges parsed chunks and resolves their materials
+    class Loader {
+    public:
+      // Meshes are loaded on threads threads
+      Loader(const std::string& path, Scene& scene, unsigned threads) : path(path), scene(scene), threads(threads) {}
+
+      bool fail(std::uint64_t line, const std::string& message) const {
+        std::cerr << "[ERROR] " << this->path;
+        if (line > 0) std::cerr << ":" << line;
+        std::cerr << ": " << message << std::endl;
+        return false;
+      }
+
+      // Takes the statements and spheres of a chunk that starts at line
+      // first_line of the file
+      bool merge(Chunk& chunk, std::uint64_t first_line) {
+        if (!chunk.error.empty()) return this->fail(first_line + chunk.error_line - 1, chunk.error);
+        for (Statement& statement : chunk.statements) {
+          statement.line += first_line - 1;
+          this->statements.push_back(std::move(statement));
+        }
+        if (chunk.spheres.size() == 0) return true;
+
+        for (MaterialUse& use : chunk.materials) use.line += first_line - 1;
+        this->pending.push_back(Pending{this->scene.spheres.size(), chunk.spheres.size(), std::move(chunk.materials)});
+        this->scene.spheres.append(chunk.spheres);
+        chunk.spheres = SphereSet();
+        return true;
+      }
+
+      size_t sphere_count() const { return this->scene.spheres.size(); }
+      void expect_spheres(size_t count) { this->scene.spheres.reserve(count); }
+
+      // Runs the statements in order, loads the meshes and points the spheres
+      // merged so far at the materials they name
+      bool finish_text() {
+        for (const Statement& statement : this->statements) {
+          if (!this->apply(statement)) return false;
+        }
+        std::unordered_map<std::string, std::uint32_t> model_ids;
+        for (const MeshUse& mesh : this->meshes) {
+          const auto found = this->material_ids.find(mesh.material);
+          if (mesh.model.empty() && found == this->material_ids.end()) {
+            return this->fail(mesh.line, "unknown material '" + mesh.material + "'");
+          }
+          if (!mesh.model.empty() && model_ids.count(mesh.model) != 0) {
+            return this->fail(mesh.line, "model is defined twice");
+          }
+          // Relative to the scene file
+          const std::string file = (std::filesystem::path(this->path).parent_path() / mesh.file).string();
+          std::optional<TriangleSet> triangles = ObjFile::load(file, this->threads);
+          if (!triangles.has_value()) return this->fail(mesh.line, "cannot load mesh " + file);
+          if (mesh.model.empty()) {
+            this->scene.meshes.push_back(SceneMesh{std::move(triangles.value()), found->second});
+          } else {
+            model_ids.emplace(mesh.model, (std::uint32_t)this->scene.models.size());
+            this->scene.models.push_back(std::move(triangles.value()));
+          }
+        }
+        this->meshes.clear();
+        for (const InstanceUse& instance : this->instances) {
+          const auto model = model_ids.find(instance.model);
+          if (model == model_ids.end()) return this->fail(instance.line, "unknown model '" + instance.model + "'");
+          const auto material = this->material_ids.find(instance.material);
+          if (material == this->material_ids.end()) {
+            return this->fail(instance.line, "unknown material '" + instance.material + "'");
+          }
+          this->scene.instances.push_back(SceneInstance{model->second, material->second, instance.transform});
+        }
+        this->instances.clear();
+        for (const Pending& range : this->pending) {
+          std::vector<std::uint32_t> ids(range.materials.size());
+          for (size_t i = 0; i < ids.size(); i++) {
+            const auto found = this->material_ids.find(range.materials[i].name);
+            if (found == this->material_ids.end()) {
+              return this->fail(range.materials[i].line, "unknown material '" + range.materials[i].name + "'");
+            }
+            ids[i] = found->second;
+          }
+          std::uint32_t* material_id = this->scene.spheres.material_id.data() + range.first;
+          for (size_t i = 0; i < range.count; i++) material_id[i] = ids[material_id[i]];
+        }
+        this->pending.clear();
+        return true;
+      }
+
+      // Emissive spheres become lights
+      bool add_lights() {
+        const std::optional<std::uint32_t> invalid = SceneFile::add_lights(this->scene.spheres, this->scene.materials,
+                                                                           this->scene.lights);
+        if (!invalid.has_value()) return true;
+        return this->fail(0, "light material '" + this->material_names[*invalid] +
+                             "' has to be on one stationary sphere");
+      }
+
+    private:
+      struct Pending {
+        size_t first;
+        size_t count;
+        std::vector<MaterialUse> materials;
+      };
+
+      // Loaded once every material is known. Models have a name instead
+      // of a material.
+      struct MeshUse {
+        std::string model;
+        std::string file;
+        std::string material;
+        std::uint64_t line;
+      };
+
+      struct InstanceUse {
+        std::string model;
+        std::string material;
+        Transform transform;
+        std::uint64_t line;
+      };
+
+      const std::string& path;
+      Scene& scene;
+      unsigned threads;
+      std::vector<Statement> statements;
+      std::vector<Pending> pending;
+      std::vector<MeshUse> meshes;
+      std::vector<InstanceUse> instances;
+      std::unordered_map<std::string, std::uint32_t> material_ids;
+      std::vector<std::string> material_names;
+
+      bool apply(const Statement& statement) {
+        Tokens tokens(statement.text.data(), statement.text.data() + statement.text.size());
+        const std::string_view keyword = tokens.next();
+        bool valid;
+        if (keyword == "raytracer_scene") {
+          // Checked before parsing
+          return true;
+        } else if (keyword == "material") {
+          Tokens name = tokens;
+          if (this->material_ids.count(std::string(name.next())) != 0) {
+            return this->fail(statement.line, "material is defined twice");
+          }
+          valid = this->apply_material(tokens);
+        } else if (keyword == "camera") {
+          valid = this->apply_camera(tokens);
+        } else if (keyword == "render") {
+          valid = this->apply_render(tokens);
+        } else if (keyword == "mesh") {
+          const std::string file(tokens.next());
+          const std::string material(tokens.next());
+          valid = !material.empty() && tokens.done();
+          if (valid) this->meshes.push_back(MeshUse{"", file, material, statement.line});
+        } else if (keyword == "model") {
+          const std::string name(tokens.next());
+          const std::string file(tokens.next());
+          valid = !file.empty() && tokens.done();
+          if (valid) this->meshes.push_back(MeshUse{name, file, "", statement.line});
+        } else if (keyword == "instance") {
+          InstanceUse instance{std::string(tokens.next()), std::string(tokens.next()), Transform(), statement.line};
+          valid = !instance.material.empty() && Loader::transform(tokens, instance.transform);
+          if (valid) this->instances.push_back(std::move(instance));
+        } else {
+          return this->fail(statement.line, "unknown statement '" + std::string(keyword) + "'");
+        }
+        if (!valid) return this->fail(statement.line, "cannot read '" + statement.text + "'");
+        this->scene.header += statement.text;
+        this->scene.header += '\n';
+        return true;
+      }
+
+      bool apply_material(Tokens& tokens) {
+        const std::string name(tokens.next());
+        const std::string_view type = tokens.next();
+        if (name.empty()) return false;
+
+        double values[4];
+        std::uint32_t id;
+        if (type == "lambertian" && Loader::numbers(tokens, values, 3)) {
+          id = this->scene.materials.add(Lambertian(Color(values[0], values[1], values[2])));
+        } else if (type == "metal" && Loader::numbers(tokens, values, 4)) {
+          id = this->scene.materials.add(Metal(Color(values[0], values[1], values[2]), (Real)values[3]));
+        } else if (type == "dielectric" && Loader::numbers(tokens, values, 1)) {
+          id = this->scene.materials.add(Dielectric((Real)values[0]));
+        } else if (type == "light" && Loader::numbers(tokens, values, 3)) {
+          id = this->scene.materials.add(DiffuseLight(Color(values[0], values[1], values[2])));
+        } else {
+          return false;
+        }
+        this->material_ids.emplace(name, id);
+        this->material_names.push_back(name);
+        return true;
+      }
+
+      bool apply_camera(Tokens& tokens) {
+        Camera& camera = this->scene.camera;
+        const std::string_view key = tokens.next();
+        double values[3];
+        if (key == "look_from" || key == "look_at" || key == "v_up") {
+          if (!Loader::numbers(tokens, values, 3)) return false;
+          const Vect3 vector((Real)values[0], (Real)values[1], (Real)values[2]);
+          (key == "look_from" ? camera.look_from : key == "look_at" ? camera.look_at : camera.v_up) = vector;
+          return true;
+        }
+        if (!Loader::numbers(tokens, values, 1)) return false;
+        if (key == "vertical_fov") {
+          camera.vertical_fov = values[0];
+        } else if (key == "defocus_angle") {
+          camera.defocus_angle = values[0];
+        } else if (key == "focus_distance") {
+          camera.focus_distance = values[0];
+        } else {
+          return false;
+        }
+        return true;
+      }
+
+      bool apply_render(Tokens& tokens) {
+        Camera& camera = this->scene.camera;
+        const std::string_view key = tokens.next();
+        double values[3];
+        if (key == "output") {
+          const std::string_view path = tokens.next();
+          if (path.empty() || !tokens.done()) return false;
+          camera.output_path = std::string(path);
+          return true;
+        }
+        if (key == "sample_heatmap") {
+          const std::string_view path = tokens.next();
+          if (path.empty() || !tokens.done()) return false;
+          camera.sample_heatmap_path = std::string(path);
+          return true;
+        }
+        if (key == "sky") return Loader::on_off(tokens, camera.sky);
+        if (key == "adaptive") return Loader::on_off(tokens, camera.adaptive_sampling);
+        if (key == "wavefront") return Loader::on_off(tokens, camera.wavefront);
+        if (key == "wavefront_sort_rays") return Loader::on_off(tokens, camera.wavefront_sort_rays);
+        if (key == "background") {
+          if (!Loader::numbers(tokens, values, 3)) return false;
+          camera.background_color = Color(values[0], values[1], values[2]);
+          return true;
+        }
+        if (!Loader::numbers(tokens, values, 1)) return false;
+        if (key == "aspect_ratio") {
+          camera.aspect_ratio = values[0];
+          return values[0] > 0;
+        }
+        if (key == "packet_size") {
+          camera.packet_size = (int)values[0];
+          return values[0] == 0 || values[0] == 4 || values[0] == 8;
+        }
+        if (key == "noise_threshold") {
+          camera.noise_threshold = values[0];
+          return values[0] > 0;
+        }
+        const int value = (int)values[0];
+        if (value != values[0] || value < 1) return false;
+        if (key == "image_width") {
+          camera.image_width = value;
+        } else if (key == "samples_per_pixel") {
+          camera.samples_per_pixel = value;
+        } else if (key == "max_ray_depth") {
+          camera.max_ray_depth = value;
+        } else if (key == "adaptive_min_samples") {
+          camera.adaptive_min_samples = value;
+        } else if (key == "adaptive_max_samples") {
+          camera.adaptive_max_samples = value;
+        } else if (key == "adaptive_pass_samples") {
+          camera.adaptive_pass_samples = value;
+        } else if (key == "wavefront_batch_size") {
+          camera.wavefront_batch_size = value;
+        } else {
+          return false;
+        }
+        return true;
+      }
+
+      // Translations, rotations and scalings to the end of the line, each
+      // applied after the ones before it
+      static bool transform(Tokens& tokens, Transform& transform) {
+        double values[3];
+        for (std::string_view operation = tokens.next(); !operation.empty(); operation = tokens.next()) {
+          if (operation == "translate") {
+            if (!tokens.number(values[0]) || !tokens.number(values[1]) || !tokens.number(values[2])) return false;
+            transform = transform.then(Transform::translate(Vect3((Real)values[0], (Real)values[1], (Real)values[2])));
+          } else if (operation == "rotate") {
+            const std::string_view axis = tokens.next();
+            if (axis.size() != 1 || axis[0] < 'x' || axis[0] > 'z' || !tokens.number(values[0])) return false;
+            transform = transform.then(Transform::rotate(axis[0] - 'x', values[0]));
+          } else if (operation == "scale") {
+            if (!tokens.number(values[0])) return false;
+            // One factor for all axes, or three
+            Tokens rest = tokens;
+            if (rest.number(values[1])) {
+              if (!rest.number(values[2])) return false;
+              tokens = rest;
+            } else {
+              values[1] = values[2] = values[0];
+            }
+            if (values[0] == 0 || values[1] == 0 || values[2] == 0) return false;
+            transform = transform.then(Transform::scale(Vect3((Real)values[0], (Real)values[1], (Real)values[2])));
+          } else {
+            return false;
+          }
+        }
+        return true;
+      }
+
+      // Exactly count numbers
+      // "on" or "off", alone on the rest of the line
+      static bool on_off(Tokens& tokens, bool& value) {
+        const std::string_view word = tokens.next();
+        if ((word != "on" && word != "off") || !tokens.done()) return false;
+        value = word == "on";
+        return true;
+      }
+
+      static bool numbers(Tokens& tokens, double* values, int count) {
+        for (int i = 0; i < count; i++) {
+          if (!tokens.number(values[i])) return false;
+        }
+        return tokens.done();
+      }
+    };
+
+    inline bool load_text(std::ifstream& in, const std::string& path, Loader& loader, ThreadPool& pool,
+                          bool spheres) {
+      // 64 KiB of text at least per task
+      const size_t chunks_per_block = std::min<size_t>((pool.size() + 1) * 4, TextFile::block_size >> 16);
+      std::uint64_t next_line = 1;
+      bool first_block = true;
+
+      const bool read = TextFile::read_blocks(in, path, [&](const char* begin, const char* end, std::uint64_t remaining) {
+        if (first_block) {
+          Tokens tokens(begin, std::find(begin, end, '\n'));
+          const std::string_view keyword = tokens.next();
+          const std::string version(tokens.next());
+          if (keyword != "raytracer_scene" || version.empty()) {
+            return loader.fail(0, "not a scene file: the first line must be 'raytracer_scene " +
+                                  std::to_string(text_version) + "'");
+          }
+          if (version != std::to_string(text_version)) return loader.fail(1, "unsupported version " + version);
+        }
+
+        const std::vector<const char*> bounds = TextFile::split_lines(begin, end, chunks_per_block);
+        std::vector<Chunk> chunks(bounds.size() - 1);
+        {
+          TaskGroup tasks(pool);
+          for (size_t i = 0; i < chunks.size(); i++) {
+            tasks.run([&, i] { parse_chunk(bounds[i], bounds[i + 1], chunks[i], spheres); });
+          }
+        }
+        for (Chunk& chunk : chunks) {
+          if (!loader.merge(chunk, next_line)) return false;
+          next_line += chunk.lines;
+        }
+        // Sizes the sphere arrays for the whole file from the first block,
+        // rather than letting them double (and briefly triple) as they grow
+        if (first_block && remaining > 0) {
+          loader.expect_spheres((size_t)(loader.sphere_count() * (1.0 + (double)remaining / (end - begin)) * 1.02));
+        }
+        first_block = false;
+        return true;
+      });
+      return read && loader.finish_text();
+    }
+
+    template <typename T>
+    bool read_value(std::ifstream& in, T& value) {
+      return (bool)in.read(reinterpret_cast<char*>(&value), sizeof(T));
+    }
+
+    inline bool load_binary(std::ifstream& in, Loader& loader, Scene& scene, bool spheres) {
+      static_assert(sizeof(float) == 4, "Binary scenes need 32-bit floats");
+      std::uint32_t version;
+      std::uint64_t header_size;
+      if (!read_value(in, version) || !read_value(in, header_size)) return loader.fail(0, "truncated file");
+      if (version != binary_version) return loader.fail(0, "unsupported binary version " + std::to_string(version));
+
+      std::string header(header_size, '\0');
+      if (!in.read(header.data(), (std::streamsize)header_size)) return loader.fail(0, "truncated header");
+      Chunk chunk;
+      parse_chunk(header.data(), header.data() + header.size(), chunk, true);
+      if (!loader.merge(chunk, 1) || !loader.finish_text()) return false;
+
+      std::vector<char> records;
+      for (const bool moving : {false, true}) {
+        const size_t floats = moving ? 7 : 4;
+        const size_t record_size = floats * sizeof(float) + sizeof(std::uint32_t);
+        std::uint64_t count;
+        if (!read_value(in, count)) return loader.fail(0, "truncated file");
+        if (!spheres) {
+          in.seekg((std::streamoff)(count * record_size), std::ios::cur);
+          continue;
+        }
+        scene.spheres.reserve(scene.spheres.size() + count);
+
+        for (std::uint64_t done = 0; done < count;) {
+          const size_t batch = (size_t)std::min<std::uint64_t>(count - done, binary_batch);
+          records.resize(batch * record_size);
+          if (!in.read(records.data(), (std::streamsize)records.size())) return loader.fail(0, "truncated spheres");
+          for (size_t i = 0; i < batch; i++) {
+            const char* record = records.data() + i * record_size;
+            float values[7];
+            std::uint32_t material;
+            std::memcpy(values, record, floats * sizeof(float));
+            std::memcpy(&material, record + floats * sizeof(float), sizeof(material));
+            if (material >= scene.materials.size()) {
+              return loader.fail(0, "sphere " + std::to_string(done + i) + " has no material " + std::to_string(material));
+            }
+            const Point3 center1(values[0], values[1], values[2]);
+            const Point3 center2 = moving ? Point3(values[3], values[4], values[5]) : center1;
+            scene.spheres.add(center1, center2, values[floats - 1], material);
+          }
+          done += batch;
+        }
+      }
+      return true;
+    }
+  }
+
+  // Loads a text or binary scene file, told apart by their first bytes,
+  // parsing on the threads of pool plus the calling one. Without spheres,
+  // everything but the spheres is read, for scenes whose spheres come from a
+  // BVH cache; their lights are then left to the caller. Problems are
+  // reported to cerr, with line numbers for text files.
+  inline std::optional<Scene> load(const std::string& path, ThreadPool& pool, bool spheres = true) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+      std::cerr << "[ERROR] Cannot open " << path << std::endl;
+      return std::nullopt;
+    }
+
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::optional<Scene> scene(std::in_place);
+    detail::Loader loader(path, *scene, pool.size() + 1);
+    char magic[4] = {};
+    in.read(magic, 4);
+    bool loaded;
+    if (in && std::memcmp(magic, "RTSB", 4) == 0) {
+      loaded = detail::load_binary(in, loader, *scene, spheres);
+    } else {
+      in.clear();
+      in.seekg(0);
+      loaded = detail::load_text(in, path, loader, pool, spheres);
+    }
+    if (!loaded) return std::nullopt;
+    if (spheres) {
+      if (!loader.add_lights()) return std::nullopt;
+      if (scene->spheres.size() == 0 && scene->meshes.empty() && scene->instances.empty()) {
+        loader.fail(0, "no spheres, meshes or instances");
+        return std::nullopt;
+      }
+    }
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (spheres) {
+      std::clog << "[LOG] Loaded " << scene->spheres.size() << " spheres, " << scene->meshes.size() << " meshes, "
+                << scene->instances.size() << " instances of " << scene->models.size() << " models, "
+                << scene->materials.size() << " materials and " << scene->lights.size() << " lights from " << path
+                << " in " << seconds << " s" << std::endl;
+    } else {
+      std::clog << "[LOG] Loaded the settings, " << scene->meshes.size() << " meshes, " << scene->instances.size()
+                << " instances of " << scene->models.size() << " models and " << scene->materials.size()
+                << " materials from " << path << " in " << seconds << " s" << std::endl;
+    }
+    return scene;
+  }
+
+  // Same, on threads threads of its own (0 for every hardware thread)
+  inline std::optional<Scene> load(const std::string& path, unsigned threads = 0, bool spheres = true) {
+    ThreadPool pool((threads > 0 ? threads : ThreadPool::hardware_threads()) - 1);
+    return SceneFile::load(path, pool, spheres);
+  }
+
+  // Hash of the bytes of a file, as the key of caches built from it
+  inline std::optional<std::uint64_t> content_hash(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+      std::cerr << "[ERROR] Cannot open " << path << std::endl;
+      return std::nullopt;
+    }
+    // Blocks are a multiple of eight bytes, so they hash as one
+    std::vector<char> block(TextFile::block_size);
+    std::uint64_t hash = BVHCache::hash(nullptr, 0);
+    while (in) {
+      in.read(block.data(), (std::streamsize)block.size());
+      hash = BVHCache::hash(block.data(), (size_t)in.gcount(), hash);
+    }
+    if (in.bad()) {
+      std::cerr << "[ERROR] Cannot read " << path << std::endl;
+      return std::nullopt;
+    }
+    return hash;
+  }
+
+  // Hash of what scene was built from: file_hash, the content_hash of its
+  // scene file (0 for a scene built in code), combined with the geometry
+  // that the file does not hold itself, i.e. the triangles read from OBJ
+  // files, and with the spheres, which a scene built in code holds alone
+  inline std::uint64_t geometry_hash(const Scene& scene, std::uint64_t file_hash) {
+    std::uint64_t hash = file_hash;
+    const auto mix = [&hash](const auto& values) {
+      hash = BVHCache::hash(values.data(), values.size() * sizeof(values[0]), hash);
+    };
+    const SphereSet& spheres = scene.spheres;
+    for (const auto* values : {&spheres.center_x, &spheres.center_y, &spheres.center_z, &spheres.motion_x,
+                               &spheres.motion_y, &spheres.motion_z, &spheres.radius}) {
+      mix(*values);
+    }
+    mix(spheres.material_id);
+    for (const SceneMesh& mesh : scene.meshes) {
+      mix(mesh.triangles.vertices);
+      mix(mesh.triangles.indices);
+    }
+    for (const TriangleSet& model : scene.models) {
+      mix(model.vertices);
+      mix(model.indices);
+    }
+    return hash;
+  }
+
+  // Writes scene in the binary format. Sphere data is stored as 32-bit
+  // floats whatever Real is.
+  inline bool write_binary(const std::string& path, const Scene& scene) {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out) {
+      std::cerr << "[ERROR] Cannot open " << path << " for writing" << std::endl;
+      return false;
+    }
+    const SphereSet& spheres = scene.spheres;
+    const auto moving = [&](size_t i) {
+      return spheres.motion_x[i] != 0 || spheres.motion_y[i] != 0 || spheres.motion_z[i] != 0;
+    };
+    const auto write = [&](const auto& value) { out.write(reinterpret_cast<const char*>(&value), sizeof(value)); };
+
+    out.write("RTSB", 4);
+    write(binary_version);
+    write((std::uint64_t)scene.header.size());
+    out.write(scene.header.data(), (std::streamsize)scene.header.size());
+
+    for (const bool pass_moving : {false, true}) {
+      std::uint64_t count = 0;
+      for (size_t i = 0; i < spheres.size(); i++) count += moving(i) == pass_moving;
+      write(count);
+      for (size_t i = 0; i < spheres.size(); i++) {
+        if (moving(i) != pass_moving) continue;
+        const Point3 center1 = spheres.center(i, 0);
+        write((float)center1.x());
+        write((float)center1.y());
+        write((float)center1.z());
+        if (pass_moving) {
+          const Point3 center2 = spheres.center(i, 1);
+          write((float)center2.x());
+          write((float)center2.y());
+          write((float)center2.z());
+        }
+        write((float)spheres.radius[i]);
+        write(spheres.material_id[i]);
+      }
+    }
+    if (!out) {
+      std::cerr << "[ERROR] Cannot write " << path << std::endl;
+      return false;
+    }
+    return true;
+  }
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+
+#include "material.h"
+#include "sphere_set.h"
+#include "util.h"
+
+// Scenes shared by the renderer and the benchmarks
+namespace Scenes {
+  // The cover of Ray Tracing in One Weekend: three large spheres among a
+  // grid of small random ones, (2 * extent)^2 cells, on a huge ground sphere.
+  // Restarts Utility's scene sequence, so the scene only depends on extent.
+  inline void random_spheres(MaterialTable& materials, SphereSet& spheres, int extent = 11) {
+    Utility::scene_sampler() = Sampler(0, 0, 0);
+
+    const std::uint32_t material_ground = materials.add(Lambertian(Color(0.5, 0.5, 0.5)));
+    spheres.add(Point3(0.0, -1000.0, -0.0), 1000.0, material_ground);
+
+    for (int a = -extent; a < extent; a++) {
+      for (int b = -extent; b < extent; b++) {
+        const double choose_material = Utility::random_double();
+        const Point3 center {
+            (Real)(a + 0.9 * Utility::random_double()),
+            0.2,
+            (Real)(b + 0.9 * Utility::random_double())
+        };
+
+        if ((center - Point3 {4, 0.2, 0}).length() > 0.9) {
+          std::uint32_t sphere_material;
+
+          if (choose_material < 0.8) {
+            // Lambertian
+            const Color albedo = Color::random() * Color::random();
+            sphere_material = materials.add(Lambertian(albedo));
+            const Point3 center2 = center + Vect3{ 0, (Real)Utility::random_double(0, 0.5), 0 };
+            spheres.add(center, center2, 0.2, sphere_material);
+          } else if (choose_material < 0.95) {
+            // Metal
+            const Color albedo = Color::random(0.5, 1);
+            const double fuzz = Utility::random_double(0, 0.5);
+            sphere_material = materials.add(Metal(albedo, fuzz));
+            spheres.add(center, 0.2, sphere_material);
+          } else {
+            sphere_material = materials.add(Dielectric(1.5));
+            spheres.add(center, 0.2, sphere_material);
+          }
+        }
+      }
+    }
+
+    const std::uint32_t material1 = materials.add(Dielectric(1.5));
+    spheres.add(Point3(0, 1, 0), 1.0, material1);
+
+    const std::uint32_t material2 = materials.add(Lambertian(Color{0.4, 0.2, 0.1}));
+    spheres.add(Point3(-4, 1, 0), 1.0, material2);
+
+    const std::uint32_t material3 = materials.add(Metal(Color{0.7, 0.6, 0.5}, 0.0));
+    spheres.add(Point3(4, 1, 0), 1.0, material3);
+  }
+}
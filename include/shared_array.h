@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+// Read-only array whose elements live either in a vector it owns or in
+// memory kept alive by another owner, such as a mapped cache file (see
+// bvh_cache.h). Copies share the elements.
+//
+// The owner of an array built from a vector may still update it in place
+// through writable_data(), e.g. to refit a BVH between the frames of an
+// animation, while nothing reads it.
+template <typename T>
+class SharedArray {
+public:
+  SharedArray() {}
+
+  explicit SharedArray(std::vector<T> values) {
+    std::shared_ptr<std::vector<T>> owned = std::make_shared<std::vector<T>>(std::move(values));
+    this->writable = owned->data();
+    this->pointer = owned->data();
+    this->count = owned->size();
+    this->owner = std::move(owned);
+  }
+
+  SharedArray(const T* pointer, size_t count, std::shared_ptr<const void> owner)
+      : pointer(pointer), count(count), owner(std::move(owner)) {}
+
+  const T* data() const { return this->pointer; }
+  // nullptr unless the elements live in a vector the array owns
+  T* writable_data() const { return this->writable; }
+  size_t size() const { return this->count; }
+  bool empty() const { return this->count == 0; }
+
+  const T& operator[](size_t i) const { return this->pointer[i]; }
+
+  const T* begin() const { return this->pointer; }
+  const T* end() const { return this->pointer + this->count; }
+
+private:
+  const T* pointer = nullptr;
+  T* writable = nullptr;
+  size_t count = 0;
+  std::shared_ptr<const void> owner;
+};
@@ -0,0 +1,245 @@
+#pragma once
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+// TCP connection or listening socket, closed with its owner. Calls block
+// unless noted. POSIX only for now: on Windows nothing listens or connects.
+class Socket {
+public:
+  Socket() {}
+
+  Socket(const Socket&) = delete;
+  Socket& operator=(const Socket&) = delete;
+
+  Socket(Socket&& other) : descriptor(std::exchange(other.descriptor, -1)) {}
+
+  Socket& operator=(Socket&& other) {
+    if (this != &other) {
+      this->close();
+      this->descriptor = std::exchange(other.descriptor, -1);
+    }
+    return *this;
+  }
+
+  ~Socket() { this->close(); }
+
+  bool is_open() const { return this->descriptor >= 0; }
+
+  // "host:port", or a port alone for this host
+  static bool parse_address(const std::string& address, std::string& host, std::uint16_t& port) {
+    const size_t colon = address.rfind(':');
+    host = colon == std::string::npos ? "127.0.0.1" : address.substr(0, colon);
+    const std::string digits = colon == std::string::npos ? address : address.substr(colon + 1);
+    if (host.empty() || digits.empty() || digits.size() > 5 ||
+        digits.find_first_not_of("0123456789") != std::string::npos || std::stoul(digits) > 65535) {
+      return false;
+    }
+    port = (std::uint16_t)std::stoul(digits);
+    return true;
+  }
+
+  // Port 0 picks a free one, which port() then tells
+  static std::optional<Socket> listen(const std::string& host, std::uint16_t port) {
+#ifdef _WIN32
+    (void)host;
+    (void)port;
+    std::cerr << "[ERROR] Sockets are not supported on this platform" << std::endl;
+    return std::nullopt;
+#else
+    return Socket::open(host, port, true);
+#endif
+  }
+
+  static std::optional<Socket> connect(const std::string& host, std::uint16_t port) {
+#ifdef _WIN32
+    (void)host;
+    (void)port;
+    std::cerr << "[ERROR] Sockets are not supported on this platform" << std::endl;
+    return std::nullopt;
+#else
+    return Socket::open(host, port, false);
+#endif
+  }
+
+  // Next connection to a listening socket; nothing if accepting it failed
+  std::optional<Socket> accept() const {
+#ifndef _WIN32
+    Socket connection;
+    connection.descriptor = ::accept(this->descriptor, nullptr, nullptr);
+    if (connection.is_open()) {
+      connection.configure();
+      return connection;
+    }
+#endif
+    return std::nullopt;
+  }
+
+  // Local port
+  std::uint16_t port() const {
+#ifndef _WIN32
+    sockaddr_storage address;
+    socklen_t length = sizeof(address);
+    if (getsockname(this->descriptor, (sockaddr*)&address, &length) == 0) {
+      if (address.ss_family == AF_INET) return ntohs(((sockaddr_in*)&address)->sin_port);
+      if (address.ss_family == AF_INET6) return ntohs(((sockaddr_in6*)&address)->sin6_port);
+    }
+#endif
+    return 0;
+  }
+
+  // False once the peer is gone
+  bool send_all(const void* data, size_t bytes) const {
+#ifndef _WIN32
+    const char* next = static_cast<const char*>(data);
+    while (bytes > 0) {
+      // A peer that went away fails the call instead of raising SIGPIPE
+      const ssize_t sent = ::send(this->descriptor, next, bytes, MSG_NOSIGNAL);
+      if (sent < 0 && errno == EINTR) continue;
+      if (sent <= 0) return false;
+      next += sent;
+      bytes -= (size_t)sent;
+    }
+    return true;
+#else
+    (void)data;
+    return bytes == 0;
+#endif
+  }
+
+  // False on an error, or if the peer closed the connection first
+  bool receive_all(void* data, size_t bytes) const {
+#ifndef _WIN32
+    char* next = static_cast<char*>(data);
+    while (bytes > 0) {
+      const ssize_t received = ::recv(this->descriptor, next, bytes, 0);
+      if (received < 0 && errno == EINTR) continue;
+      if (received <= 0) return false;
+      next += received;
+      bytes -= (size_t)received;
+    }
+    return true;
+#else
+    (void)data;
+    return bytes == 0;
+#endif
+  }
+
+  // Appends whatever has arrived to buffer, without waiting for more. False
+  // once the peer is gone.
+  bool receive_available(std::vector<unsigned char>& buffer) const {
+#ifndef _WIN32
+    unsigned char block[1 << 16];
+    while (true) {
+      const ssize_t received = ::recv(this->descriptor, block, sizeof(block), MSG_DONTWAIT);
+      if (received > 0) {
+        buffer.insert(buffer.end(), block, block + received);
+        continue;
+      }
+      if (received < 0 && errno == EINTR) continue;
+      return received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+    }
+#else
+    (void)buffer;
+    return false;
+#endif
+  }
+
+  // Waits up to timeout_ms for any of sockets to have something to read (or
+  // to accept), and marks which in readable
+  static void wait_readable(const std::vector<const Socket*>& sockets, std::vector<bool>& readable, int timeout_ms) {
+    readable.assign(sockets.size(), false);
+#ifndef _WIN32
+    std::vector<pollfd> polled(sockets.size());
+    for (size_t i = 0; i < sockets.size(); i++) {
+      polled[i] = {sockets[i]->descriptor, POLLIN, 0};
+    }
+    if (::poll(polled.data(), (nfds_t)polled.size(), timeout_ms) <= 0) return;
+    for (size_t i = 0; i < sockets.size(); i++) {
+      // Errors and hang-ups are read as such by the next receive
+      readable[i] = polled[i].revents != 0;
+    }
+#else
+    (void)timeout_ms;
+#endif
+  }
+
+private:
+  int descriptor = -1;
+
+  void close() {
+#ifndef _WIN32
+    if (this->is_open()) ::close(this->descriptor);
+#endif
+    this->descriptor = -1;
+  }
+
+#ifndef _WIN32
+  static std::optional<Socket> open(const std::string& host, std::uint16_t port, bool listening) {
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = listening ? AI_PASSIVE : 0;
+    addrinfo* addresses = nullptr;
+    const int error = getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &addresses);
+    if (error != 0) {
+      std::cerr << "[ERROR] Cannot resolve " << host << ": " << gai_strerror(error) << std::endl;
+      return std::nullopt;
+    }
+
+    Socket socket;
+    int last_error = 0;
+    for (addrinfo* address = addresses; address != nullptr && !socket.is_open(); address = address->ai_next) {
+      socket.descriptor = ::socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+      if (!socket.is_open()) continue;
+      fcntl(socket.descriptor, F_SETFD, FD_CLOEXEC);
+      bool opened;
+      if (listening) {
+        const int reuse = 1;
+        setsockopt(socket.descriptor, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        opened = ::bind(socket.descriptor, address->ai_addr, address->ai_addrlen) == 0 &&
+                 ::listen(socket.descriptor, SOMAXCONN) == 0;
+      } else {
+        opened = ::connect(socket.descriptor, address->ai_addr, address->ai_addrlen) == 0;
+      }
+      if (!opened) {
+        last_error = errno;
+        socket.close();
+      }
+    }
+    freeaddrinfo(addresses);
+
+    if (!socket.is_open()) {
+      std::cerr << "[ERROR] Cannot " << (listening ? "listen on " : "connect to ") << host << ":" << port << ": "
+                << std::strerror(last_error) << std::endl;
+      return std::nullopt;
+    }
+    if (!listening) socket.configure();
+    return socket;
+  }
+
+  // Small messages go out at once, and child processes do not inherit it
+  void configure() {
+    const int no_delay = 1;
+    setsockopt(this->descriptor, IPPROTO_TCP, TCP_NODELAY, &no_delay, sizeof(no_delay));
+    fcntl(this->descriptor, F_SETFD, FD_CLOEXEC);
+  }
+#endif
+};
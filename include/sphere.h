@@ -1,29 +1,42 @@
 #pragma once
 
 #include "hittable.h"
+#include "real.h"
+#include "statistics.h"
 #include <cmath>
-#include <memory>
-#include <optional>
+#include <cstdint>
+
+// Hit record on a sphere. The hit point is reprojected onto the surface, which
+// leaves it with an error of a few ulps of its offset from the center, plus
+// the rounding of adding the center back (pbrt 6.8.5).
+inline HitRecord sphere_hit_record(const Ray& ray, Real t, const Point3& center, Real radius,
+                                   std::uint32_t material) {
+  Vect3 local = ray.at(t) - center;
+  local *= radius / local.length();
+  const Point3 p = center + local;
+  const Vect3 p_error = Utility::gamma(5) * abs(local) + Utility::gamma(1) * abs(p);
+  return HitRecord(t, p, p_error, ray, local / radius, material);
+}
 
 class Sphere: public Hittable {
 private:
   Ray center;
-  double radius;
-  std::shared_ptr<Material> material;
+  Real radius;
+  std::uint32_t material;
   BoundingBox bbox;
 
 public:
   // Stationary
-  Sphere(const Point3& center, double radius, std::shared_ptr<Material> material) : 
-    center(center, { 0, 0, 0 }), radius(std::fmax(0, radius)), material(material) {
+  Sphere(const Point3& center, Real radius, std::uint32_t material) : 
+    center(center, { 0, 0, 0 }), radius(std::fmax((Real)0, radius)), material(material) {
     const Vect3 radius_vector { radius, radius, radius };
     this->bbox = BoundingBox(center - radius_vector, center + radius_vector);
 
   };
 
   // Moving
-  Sphere(const Point3& center1, const Point3& center2, double radius, std::shared_ptr<Material> material) : 
-    center(center1, center2 - center1), radius(std::fmax(0, radius)), material(material) {
+  Sphere(const Point3& center1, const Point3& center2, Real radius, std::uint32_t material) : 
+    center(center1, center2 - center1), radius(std::fmax((Real)0, radius)), material(material) {
     const Vect3 radius_vector { radius, radius, radius };
     BoundingBox box1(center.at(0) - radius_vector, center.at(0) + radius_vector);
     BoundingBox box2(center.at(1) - radius_vector, center.at(1) + radius_vector);
@@ -31,33 +44,44 @@ public:
 
   };
 
-  std::optional<HitRecord> hit(const Ray& ray, const Interval ray_t) const override {
+  bool intersect(const Ray& ray, Interval& ray_t, Intersection& intersection) const override {
+    Statistics::count(Statistics::Counter::PrimitiveTests);
     const Point3 current_center = center.at(ray.time());
     const Vect3 oc = current_center - ray.origin();
-    const double a = ray.direction().length_squared();
+    const Vect3& d = ray.direction();
+    const Real a = d.length_squared();
     // double b = -2 * dot(ray.direction(), oc);
-    const double h = dot(ray.direction(), oc); // h = -2b
-    const double c = oc.length_squared() - radius * radius;
-    const double discriminant = h * h - a * c;
+    const Real h = dot(d, oc); // h = -2b
+    const Real c = oc.length_squared() - radius * radius;
+    // h * h - a * c, computed from the distance between the center and the
+    // ray's closest approach so that it does not cancel (Ray Tracing Gems 7)
+    const Vect3 l = oc - (h / a) * d;
+    const Real discriminant = a * (radius * radius - l.length_squared());
     
     if (discriminant < 0) {
-      return std::nullopt;
+      return false;
     }
-    const double discriminant_sqrt = std::sqrt(discriminant);
+    // Both roots without subtracting nearly equal terms: q / a and c / q
+    const Real q = h + std::copysign(std::sqrt(discriminant), h);
+    const Real near = std::fmin(c / q, q / a);
+    const Real far = std::fmax(c / q, q / a);
 
     // Find the nearest root that lies in acceptable range
-    double root = (h - discriminant_sqrt) / a;
+    Real root = near;
     if (root <= ray_t.min || ray_t.max <= root) {
-      root = (h + discriminant_sqrt) / a;
+      root = far;
       if (root <= ray_t.min || ray_t.max <= root) {
-        return std::nullopt;
+        return false;
       }
     }
 
-    const double t = root;
-    const Point3 p = ray.at(t);
-    const Vect3 outward_normal = (p - current_center) / this->radius;
-    return std::make_optional<HitRecord>(t, p, ray, outward_normal, this->material);
+    ray_t.max = root;
+    intersection = Intersection{root, 0, this};
+    return true;
+  }
+
+  HitRecord finalize(const Ray& ray, const Intersection& intersection) const override {
+    return sphere_hit_record(ray, intersection.t, center.at(ray.time()), this->radius, this->material);
   }
 
   BoundingBox bounding_box() const override {
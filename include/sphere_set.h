@@ -0,0 +1,570 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+#if defined(__AVX__) || defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#endif
+
+#include "bvh.h"
+#include "bvh_cache.h"
+#include "hittable.h"
+#include "real.h"
+#include "shared_array.h"
+#include "sphere.h"
+#include "statistics.h"
+#include "thread_pool.h"
+
+// Structure-of-arrays sphere storage: centers at time 0, motion over the
+// shutter interval, radii and MaterialTable ids in parallel arrays.
+class SphereSet {
+public:
+  std::vector<Real> center_x, center_y, center_z;
+  std::vector<Real> motion_x, motion_y, motion_z;
+  std::vector<Real> radius;
+  std::vector<std::uint32_t> material_id;
+
+  size_t size() const { return this->radius.size(); }
+
+  // Stationary
+  void add(const Point3& center, Real radius, std::uint32_t material) {
+    this->add(center, center, radius, material);
+  }
+
+  // Moving from center1 at time 0 to center2 at time 1
+  void add(const Point3& center1, const Point3& center2, Real radius, std::uint32_t material) {
+    const Vect3 motion = center2 - center1;
+    this->center_x.push_back(center1.x());
+    this->center_y.push_back(center1.y());
+    this->center_z.push_back(center1.z());
+    this->motion_x.push_back(motion.x());
+    this->motion_y.push_back(motion.y());
+    this->motion_z.push_back(motion.z());
+    this->radius.push_back(std::fmax((Real)0, radius));
+    this->material_id.push_back(material);
+  }
+
+  void reserve(size_t count) {
+    this->center_x.reserve(count);
+    this->center_y.reserve(count);
+    this->center_z.reserve(count);
+    this->motion_x.reserve(count);
+    this->motion_y.reserve(count);
+    this->motion_z.reserve(count);
+    this->radius.reserve(count);
+    this->material_id.reserve(count);
+  }
+
+  // Appends every sphere of other, e.g. a batch parsed on another thread
+  void append(const SphereSet& other) {
+    SphereSet::extend(this->center_x, other.center_x);
+    SphereSet::extend(this->center_y, other.center_y);
+    SphereSet::extend(this->center_z, other.center_z);
+    SphereSet::extend(this->motion_x, other.motion_x);
+    SphereSet::extend(this->motion_y, other.motion_y);
+    SphereSet::extend(this->motion_z, other.motion_z);
+    SphereSet::extend(this->radius, other.radius);
+    SphereSet::extend(this->material_id, other.material_id);
+  }
+
+  Point3 center(size_t i, Real time) const {
+    return {
+      this->center_x[i] + time * this->motion_x[i],
+      this->center_y[i] + time * this->motion_y[i],
+      this->center_z[i] + time * this->motion_z[i]
+    };
+  }
+
+  // Whether any sphere moves
+  bool moving() const {
+    for (size_t i = 0; i < this->size(); i++) {
+      if (this->motion_x[i] != 0 || this->motion_y[i] != 0 || this->motion_z[i] != 0) return true;
+    }
+    return false;
+  }
+
+  // The boxes at both ends of the motion
+  LinearBounds motion_bounds(size_t i) const {
+    const Vect3 radius_vector { this->radius[i], this->radius[i], this->radius[i] };
+    const Point3 center1 = this->center(i, 0);
+    const Point3 center2 = this->center(i, 1);
+    return LinearBounds(
+      BoundingBox(center1 - radius_vector, center1 + radius_vector),
+      BoundingBox(center2 - radius_vector, center2 + radius_vector)
+    );
+  }
+
+  // Union of the boxes at both ends of the motion
+  BoundingBox bounding_box(size_t i) const { return this->motion_bounds(i).swept(); }
+
+  // Replaces the spheres by spheres[order[0]], spheres[order[1]], ...
+  void reorder(const std::vector<std::uint32_t>& order) {
+    SphereSet::permute(this->center_x, order);
+    SphereSet::permute(this->center_y, order);
+    SphereSet::permute(this->center_z, order);
+    SphereSet::permute(this->motion_x, order);
+    SphereSet::permute(this->motion_y, order);
+    SphereSet::permute(this->motion_z, order);
+    SphereSet::permute(this->radius, order);
+    SphereSet::permute(this->material_id, order);
+  }
+
+private:
+  template <typename T>
+  static void extend(std::vector<T>& values, const std::vector<T>& more) {
+    values.insert(values.end(), more.begin(), more.end());
+  }
+
+  template <typename T>
+  static void permute(std::vector<T>& values, const std::vector<std::uint32_t>& order) {
+    std::vector<T> result(order.size());
+    for (size_t i = 0; i < order.size(); i++) result[i] = values[order[i]];
+    values = std::move(result);
+  }
+};
+
+// A SphereSet's arrays as SphereBVH traverses them, in leaf order: built in
+// memory, or mapped from a cache file. Spheres in time splits of a motion
+// tree appear more than once.
+struct SphereArrays {
+  SharedArray<Real> center_x, center_y, center_z;
+  SharedArray<Real> motion_x, motion_y, motion_z;
+  SharedArray<Real> radius;
+  SharedArray<std::uint32_t> material_id;
+  // Entries, leaving out any padding at the end of the arrays
+  size_t count = 0;
+
+  SphereArrays() {}
+
+  SphereArrays(SphereSet&& spheres, size_t count)
+      : center_x(std::move(spheres.center_x)), center_y(std::move(spheres.center_y)),
+        center_z(std::move(spheres.center_z)), motion_x(std::move(spheres.motion_x)),
+        motion_y(std::move(spheres.motion_y)), motion_z(std::move(spheres.motion_z)),
+        radius(std::move(spheres.radius)), material_id(std::move(spheres.material_id)), count(count) {}
+
+  size_t size() const { return this->count; }
+
+  Point3 center(size_t i, Real time) const {
+    return {
+      this->center_x[i] + time * this->motion_x[i],
+      this->center_y[i] + time * this->motion_y[i],
+      this->center_z[i] + time * this->motion_z[i]
+    };
+  }
+};
+
+// BVH over a SphereSet whose leaves index straight into the SoA arrays.
+// Leaves hold a few spheres that are intersected four at a time. Moving
+// spheres get a motion tree, so that rays only visit the nodes around the
+// spheres' positions at their own time.
+class SphereBVH final : public Hittable {
+public:
+  static constexpr int batch_size = 4;
+
+  // Spheres are cheap to test in batches, so leaves may be larger
+  static BVHBuildSettings default_settings() {
+    BVHBuildSettings settings;
+    settings.max_leaf_size = 8;
+    settings.intersection_cost = 0.5;
+    return settings;
+  }
+
+  SphereBVH(SphereSet spheres, const BVHBuildSettings& settings = SphereBVH::default_settings())
+      : settings(settings) {
+    this->build(std::move(spheres));
+  }
+
+  // Moves the spheres to their place in the next frame of an animation,
+  // given in the same order as those the tree was built over. The tree is
+  // refitted on pool rather than built again, unless that leaves its SAH
+  // cost above rebuild_threshold times the cost it was built with, as the
+  // spheres drift away from where they were, or the spheres no longer fit
+  // it: a different count, motion blur turned on or off, or a tree mapped
+  // from a cache. Returns whether the tree was rebuilt.
+  bool update(SphereSet spheres, ThreadPool& pool, double rebuild_threshold = 1.5) {
+    const std::vector<std::uint32_t>& order = this->tree.primitive_order();
+    if (order.empty() || spheres.size() != this->sphere_count || spheres.moving() != this->tree.is_motion()) {
+      this->build(std::move(spheres));
+      return true;
+    }
+
+    // Into leaf order, in place; the padding repeats the last entry. Static
+    // trees only ever hold static spheres, whose motion stays 0.
+    const bool motion = this->tree.is_motion();
+    Real* reals[] = {
+      this->spheres.center_x.writable_data(), this->spheres.center_y.writable_data(),
+      this->spheres.center_z.writable_data(), this->spheres.motion_x.writable_data(),
+      this->spheres.motion_y.writable_data(), this->spheres.motion_z.writable_data(),
+      this->spheres.radius.writable_data()
+    };
+    const std::vector<Real>* sources[] = {
+      &spheres.center_x, &spheres.center_y, &spheres.center_z,
+      &spheres.motion_x, &spheres.motion_y, &spheres.motion_z, &spheres.radius
+    };
+    std::uint32_t* material_id = this->spheres.material_id.writable_data();
+    const size_t entries = this->spheres.count + batch_size - 1;
+    const size_t block = std::max<size_t>(this->settings.parallel_threshold, 1);
+    {
+      // One array at a time, which keeps the gathers within cache
+      TaskGroup group(pool);
+      for (size_t first = 0; first < entries; first += block) {
+        group.run([&, first] {
+          const size_t last = std::min(first + block, entries);
+          for (int array = 0; array < 7; array++) {
+            if (!motion && 3 <= array && array < 6) continue;
+            const std::vector<Real>& source = *sources[array];
+            for (size_t i = first; i < last; i++) reals[array][i] = source[order[std::min(i, order.size() - 1)]];
+          }
+          for (size_t i = first; i < last; i++) material_id[i] = spheres.material_id[order[std::min(i, order.size() - 1)]];
+        });
+      }
+    }
+
+    const double cost = this->tree.refit([&](std::uint32_t first, std::uint32_t count, float time_begin,
+                                             float time_end) {
+      // Per axis, and only once for static spheres, which stay where they
+      // are at time 0: this runs over every sphere every frame
+      const SharedArray<Real>* centers[3] = { &this->spheres.center_x, &this->spheres.center_y, &this->spheres.center_z };
+      const SharedArray<Real>* motions[3] = { &this->spheres.motion_x, &this->spheres.motion_y, &this->spheres.motion_z };
+      Interval axes[2][3];
+      for (int axis = 0; axis < 3; axis++) {
+        const Real* center = centers[axis]->data();
+        const Real* movement = motions[axis]->data();
+        const Real* radius = this->spheres.radius.data();
+        Real low = std::numeric_limits<Real>::infinity(), high = -low;
+        Real end_low = low, end_high = high;
+        if (!motion) {
+          for (std::uint32_t i = first; i < first + count; i++) {
+            low = std::min(low, center[i] - radius[i]);
+            high = std::max(high, center[i] + radius[i]);
+          }
+        }
+        for (std::uint32_t i = first; motion && i < first + count; i++) {
+          const Real begin = center[i] + time_begin * movement[i];
+          const Real end = center[i] + time_end * movement[i];
+          low = std::min(low, begin - radius[i]);
+          high = std::max(high, begin + radius[i]);
+          end_low = std::min(end_low, end - radius[i]);
+          end_high = std::max(end_high, end + radius[i]);
+        }
+        axes[0][axis] = Interval(low, high);
+        axes[1][axis] = motion ? Interval(end_low, end_high) : axes[0][axis];
+      }
+      return LinearBounds(BoundingBox(axes[0][0], axes[0][1], axes[0][2]),
+                          BoundingBox(axes[1][0], axes[1][1], axes[1][2]));
+    }, this->settings, pool);
+    this->bbox = this->tree.bounding_box();
+
+    const double built_cost = this->tree.statistics().sah_cost;
+    if (cost > rebuild_threshold * built_cost) {
+      std::clog << "[LOG] Refitted BVH SAH cost " << cost << " exceeds " << rebuild_threshold << " times "
+                << built_cost << ", rebuilding" << std::endl;
+      this->build(std::move(spheres));
+      return true;
+    }
+    return false;
+  }
+
+  // Cache key of the BVH that settings build over a scene whose content
+  // hashes to scene_hash
+  static std::uint64_t cache_key(std::uint64_t scene_hash,
+                                 const BVHBuildSettings& settings = SphereBVH::default_settings()) {
+    const double values[] = {
+      (double)settings.max_leaf_size, (double)settings.bin_count, settings.traversal_cost,
+      settings.intersection_cost, (double)settings.width, (double)settings.max_time_splits, (double)batch_size
+    };
+    return BVHCache::hash(values, sizeof(values), scene_hash);
+  }
+
+  // Saves the tree and the sphere arrays in leaf order for load_cache
+  bool save_cache(const std::string& path, std::uint64_t key) const {
+    const std::uint64_t count = this->spheres.count;
+    const std::uint32_t base = BVHTree::cache_sections;
+    BVHCache::Writer writer;
+    this->tree.add_to_cache(writer, 0);
+    writer.add(base, &count, 1);
+    writer.add(base + 1, this->spheres.center_x);
+    writer.add(base + 2, this->spheres.center_y);
+    writer.add(base + 3, this->spheres.center_z);
+    writer.add(base + 4, this->spheres.motion_x);
+    writer.add(base + 5, this->spheres.motion_y);
+    writer.add(base + 6, this->spheres.motion_z);
+    writer.add(base + 7, this->spheres.radius);
+    writer.add(base + 8, this->spheres.material_id);
+    if (!writer.write(path, key)) return false;
+    std::clog << "[LOG] Saved BVH cache " << path << std::endl;
+    return true;
+  }
+
+  // The BVH save_cache stored under key, traced straight from the mapped
+  // file; nothing if path is missing or stale
+  static std::shared_ptr<SphereBVH> load_cache(const std::string& path, std::uint64_t key) {
+    const std::optional<BVHCache::File> file = BVHCache::File::open(path, key);
+    if (!file.has_value()) return nullptr;
+    std::optional<BVHTree> tree = BVHTree::from_cache(*file, 0);
+    const std::uint32_t base = BVHTree::cache_sections;
+    const std::optional<SharedArray<std::uint64_t>> count = file->section<std::uint64_t>(base);
+    if (!tree.has_value() || !count.has_value() || count->size() != 1) return nullptr;
+
+    SphereArrays spheres;
+    spheres.count = (size_t)(*count)[0];
+    SharedArray<Real>* reals[] = {
+      &spheres.center_x, &spheres.center_y, &spheres.center_z,
+      &spheres.motion_x, &spheres.motion_y, &spheres.motion_z, &spheres.radius
+    };
+    for (std::uint32_t i = 0; i < 7; i++) {
+      std::optional<SharedArray<Real>> array = file->section<Real>(base + 1 + i);
+      if (!array.has_value() || array->size() != spheres.count + batch_size - 1) return nullptr;
+      *reals[i] = std::move(*array);
+    }
+    std::optional<SharedArray<std::uint32_t>> material_id = file->section<std::uint32_t>(base + 8);
+    if (!material_id.has_value() || material_id->size() != spheres.count + batch_size - 1) return nullptr;
+    spheres.material_id = std::move(*material_id);
+
+    std::clog << "[LOG] Mapped BVH of " << spheres.count << " spheres from " << path << std::endl;
+    return std::shared_ptr<SphereBVH>(new SphereBVH(std::move(*tree), std::move(spheres)));
+  }
+
+  bool intersect(const Ray& ray, Interval& ray_t, Intersection& intersection) const override {
+    std::uint32_t closest = 0;
+    Real closest_t = ray_t.max;
+    const bool hit_anything = this->tree.traverse_leaves(ray, ray_t,
+      [&](std::uint32_t first, std::uint32_t count, Interval& t) {
+        bool hit_leaf = false;
+        for (std::uint32_t i = first; i < first + count; i += batch_size) {
+          const int lanes = (int)std::min<std::uint32_t>(batch_size, first + count - i);
+          const int lane = this->intersect_batch(ray, i, lanes, t);
+          if (lane >= 0) {
+            closest = i + lane;
+            closest_t = t.max;
+            hit_leaf = true;
+          }
+        }
+        return hit_leaf;
+      });
+    if (!hit_anything) return false;
+    ray_t.max = closest_t;
+    intersection = Intersection{closest_t, closest, this};
+    return true;
+  }
+
+  // Surface attributes for the winning sphere only
+  HitRecord finalize(const Ray& ray, const Intersection& intersection) const override {
+    const std::uint32_t sphere = intersection.primitive;
+    return sphere_hit_record(ray, intersection.t, this->spheres.center(sphere, ray.time()),
+                             this->spheres.radius[sphere], this->spheres.material_id[sphere]);
+  }
+
+  bool occluded(const Ray& ray, const Interval ray_t) const override {
+    return this->tree.occluded(ray, ray_t, [&](std::uint32_t first, std::uint32_t count, Interval& t) {
+      for (std::uint32_t i = first; i < first + count; i += batch_size) {
+        const int lanes = (int)std::min<std::uint32_t>(batch_size, first + count - i);
+        if (this->intersect_batch(ray, i, lanes, t) >= 0) return true;
+      }
+      return false;
+    });
+  }
+
+  // Camera packets: the rays share one traversal, each leaf is then tested
+  // against every ray still active in it
+  void intersect_packet(RayPacket& packet, Intersection* intersections) const override {
+    this->tree.traverse_packet(packet, [&](std::uint32_t first, std::uint32_t count, std::uint64_t mask) {
+      for (; mask != 0; mask &= mask - 1) {
+        const int ray = RayPacket::lowest_ray(mask);
+        Interval t = packet.interval(ray);
+        for (std::uint32_t i = first; i < first + count; i += batch_size) {
+          const int lanes = (int)std::min<std::uint32_t>(batch_size, first + count - i);
+          const int lane = this->intersect_batch(packet.rays[ray], i, lanes, t);
+          if (lane >= 0) {
+            intersections[ray] = Intersection{t.max, i + lane, this};
+          }
+        }
+        packet.narrow(ray, t.max);
+      }
+    });
+  }
+
+  BoundingBox bounding_box() const override {
+    return this->bbox;
+  };
+
+  const SphereArrays& sphere_arrays() const { return this->spheres; }
+
+private:
+  SphereArrays spheres;
+  BVHTree tree;
+  BoundingBox bbox;
+  BVHBuildSettings settings = SphereBVH::default_settings();
+  // Spheres the tree was built over, before time splits copied any
+  size_t sphere_count = 0;
+
+  SphereBVH(BVHTree tree, SphereArrays spheres) : spheres(std::move(spheres)), tree(std::move(tree)) {
+    this->bbox = this->tree.bounding_box();
+  }
+
+  // Builds the tree over spheres, whatever was there before
+  void build(SphereSet spheres) {
+    assert(spheres.size() > 0 && "[ERROR] SphereBVH needs at least one sphere");
+    this->sphere_count = spheres.size();
+
+    if (spheres.moving()) {
+      std::vector<LinearBounds> bounds(spheres.size());
+      for (size_t i = 0; i < bounds.size(); i++) {
+        bounds[i] = spheres.motion_bounds(i);
+      }
+      this->tree = BVHTree(bounds, this->settings);
+    } else {
+      std::vector<BoundingBox> bounds(spheres.size());
+      for (size_t i = 0; i < bounds.size(); i++) {
+        bounds[i] = spheres.bounding_box(i);
+      }
+      this->tree = BVHTree(bounds, this->settings);
+    }
+    std::clog << "[LOG] " << this->tree.statistics() << std::endl;
+
+    // Leaf order, plus batch_size - 1 copies of the last sphere so that a
+    // batch starting at the last leaf still reads valid memory
+    std::vector<std::uint32_t> order = this->tree.primitive_order();
+    const size_t count = order.size();
+    for (int i = 1; i < batch_size; i++) order.push_back(order.back());
+    spheres.reorder(order);
+    this->spheres = SphereArrays(std::move(spheres), count);
+    this->bbox = this->tree.bounding_box();
+  }
+
+  // Tests spheres [first, first + lanes) with the same quadratic as
+  // Sphere::intersect, all lanes at once. Narrows ray_t.max and returns the
+  // lane of the closest hit, or -1.
+  int intersect_batch(const Ray& ray, std::uint32_t first, int lanes, Interval& ray_t) const {
+    Statistics::count(Statistics::Counter::PrimitiveTests, (std::uint64_t)lanes);
+    const Point3& o = ray.origin();
+    const Vect3& d = ray.direction();
+    const Real time = ray.time();
+    const Real a = d.length_squared();
+    const Real inverse_a = 1 / a;
+    Real roots[batch_size];
+
+#if defined(__AVX__) && !RAYTRACER_REAL_FLOAT
+    const __m256d t_min = _mm256_set1_pd(ray_t.min);
+    const __m256d t_max = _mm256_set1_pd(ray_t.max);
+    const __m256d tm = _mm256_set1_pd(time);
+    const __m256d d_x = _mm256_set1_pd(d.x()), d_y = _mm256_set1_pd(d.y()), d_z = _mm256_set1_pd(d.z());
+    const __m256d inv_a = _mm256_set1_pd(inverse_a);
+    // center(time) - origin, per axis
+    const __m256d oc_x = _mm256_sub_pd(_mm256_add_pd(_mm256_loadu_pd(&this->spheres.center_x[first]),
+      _mm256_mul_pd(tm, _mm256_loadu_pd(&this->spheres.motion_x[first]))), _mm256_set1_pd(o.x()));
+    const __m256d oc_y = _mm256_sub_pd(_mm256_add_pd(_mm256_loadu_pd(&this->spheres.center_y[first]),
+      _mm256_mul_pd(tm, _mm256_loadu_pd(&this->spheres.motion_y[first]))), _mm256_set1_pd(o.y()));
+    const __m256d oc_z = _mm256_sub_pd(_mm256_add_pd(_mm256_loadu_pd(&this->spheres.center_z[first]),
+      _mm256_mul_pd(tm, _mm256_loadu_pd(&this->spheres.motion_z[first]))), _mm256_set1_pd(o.z()));
+    const __m256d r = _mm256_loadu_pd(&this->spheres.radius[first]);
+    const __m256d r2 = _mm256_mul_pd(r, r);
+
+    const __m256d h = _mm256_add_pd(_mm256_add_pd(
+      _mm256_mul_pd(d_x, oc_x), _mm256_mul_pd(d_y, oc_y)), _mm256_mul_pd(d_z, oc_z));
+    const __m256d c = _mm256_sub_pd(_mm256_add_pd(_mm256_add_pd(
+      _mm256_mul_pd(oc_x, oc_x), _mm256_mul_pd(oc_y, oc_y)), _mm256_mul_pd(oc_z, oc_z)), r2);
+    const __m256d h_a = _mm256_mul_pd(h, inv_a);
+    const __m256d l_x = _mm256_sub_pd(oc_x, _mm256_mul_pd(h_a, d_x));
+    const __m256d l_y = _mm256_sub_pd(oc_y, _mm256_mul_pd(h_a, d_y));
+    const __m256d l_z = _mm256_sub_pd(oc_z, _mm256_mul_pd(h_a, d_z));
+    const __m256d l2 = _mm256_add_pd(_mm256_add_pd(
+      _mm256_mul_pd(l_x, l_x), _mm256_mul_pd(l_y, l_y)), _mm256_mul_pd(l_z, l_z));
+    const __m256d discriminant = _mm256_mul_pd(_mm256_set1_pd(a), _mm256_sub_pd(r2, l2));
+    const __m256d has_roots = _mm256_cmp_pd(discriminant, _mm256_setzero_pd(), _CMP_GE_OQ);
+    const __m256d sq = _mm256_sqrt_pd(_mm256_max_pd(discriminant, _mm256_setzero_pd()));
+    const __m256d sign = _mm256_and_pd(h, _mm256_set1_pd(-0.0));
+    const __m256d q = _mm256_add_pd(h, _mm256_or_pd(sq, sign));
+    const __m256d t0 = _mm256_div_pd(c, q);
+    const __m256d t1 = _mm256_mul_pd(q, inv_a);
+    const __m256d near = _mm256_min_pd(t0, t1);
+    const __m256d far = _mm256_max_pd(t0, t1);
+    const __m256d near_ok = _mm256_and_pd(_mm256_cmp_pd(near, t_min, _CMP_GT_OQ), _mm256_cmp_pd(near, t_max, _CMP_LT_OQ));
+    const __m256d far_ok = _mm256_and_pd(_mm256_cmp_pd(far, t_min, _CMP_GT_OQ), _mm256_cmp_pd(far, t_max, _CMP_LT_OQ));
+    const __m256d miss = _mm256_set1_pd(std::numeric_limits<double>::infinity());
+    const __m256d root = _mm256_blendv_pd(_mm256_blendv_pd(miss, far, far_ok), near, near_ok);
+    _mm256_storeu_pd(roots, _mm256_blendv_pd(miss, root, has_roots));
+#elif (defined(__SSE2__) || defined(_M_X64)) && RAYTRACER_REAL_FLOAT
+    // The same kernel on four float lanes
+    const __m128 t_min = _mm_set1_ps(ray_t.min);
+    const __m128 t_max = _mm_set1_ps(ray_t.max);
+    const __m128 tm = _mm_set1_ps(time);
+    const __m128 d_x = _mm_set1_ps(d.x()), d_y = _mm_set1_ps(d.y()), d_z = _mm_set1_ps(d.z());
+    const __m128 inv_a = _mm_set1_ps(inverse_a);
+    const __m128 oc_x = _mm_sub_ps(_mm_add_ps(_mm_loadu_ps(&this->spheres.center_x[first]),
+      _mm_mul_ps(tm, _mm_loadu_ps(&this->spheres.motion_x[first]))), _mm_set1_ps(o.x()));
+    const __m128 oc_y = _mm_sub_ps(_mm_add_ps(_mm_loadu_ps(&this->spheres.center_y[first]),
+      _mm_mul_ps(tm, _mm_loadu_ps(&this->spheres.motion_y[first]))), _mm_set1_ps(o.y()));
+    const __m128 oc_z = _mm_sub_ps(_mm_add_ps(_mm_loadu_ps(&this->spheres.center_z[first]),
+      _mm_mul_ps(tm, _mm_loadu_ps(&this->spheres.motion_z[first]))), _mm_set1_ps(o.z()));
+    const __m128 r = _mm_loadu_ps(&this->spheres.radius[first]);
+    const __m128 r2 = _mm_mul_ps(r, r);
+
+    const __m128 h = _mm_add_ps(_mm_add_ps(_mm_mul_ps(d_x, oc_x), _mm_mul_ps(d_y, oc_y)), _mm_mul_ps(d_z, oc_z));
+    const __m128 c = _mm_sub_ps(_mm_add_ps(_mm_add_ps(
+      _mm_mul_ps(oc_x, oc_x), _mm_mul_ps(oc_y, oc_y)), _mm_mul_ps(oc_z, oc_z)), r2);
+    const __m128 h_a = _mm_mul_ps(h, inv_a);
+    const __m128 l_x = _mm_sub_ps(oc_x, _mm_mul_ps(h_a, d_x));
+    const __m128 l_y = _mm_sub_ps(oc_y, _mm_mul_ps(h_a, d_y));
+    const __m128 l_z = _mm_sub_ps(oc_z, _mm_mul_ps(h_a, d_z));
+    const __m128 l2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(l_x, l_x), _mm_mul_ps(l_y, l_y)), _mm_mul_ps(l_z, l_z));
+    const __m128 discriminant = _mm_mul_ps(_mm_set1_ps(a), _mm_sub_ps(r2, l2));
+    const __m128 has_roots = _mm_cmpge_ps(discriminant, _mm_setzero_ps());
+    const __m128 sq = _mm_sqrt_ps(_mm_max_ps(discriminant, _mm_setzero_ps()));
+    const __m128 q = _mm_add_ps(h, _mm_or_ps(sq, _mm_and_ps(h, _mm_set1_ps(-0.0f))));
+    const __m128 t0 = _mm_div_ps(c, q);
+    const __m128 t1 = _mm_mul_ps(q, inv_a);
+    const __m128 near = _mm_min_ps(t0, t1);
+    const __m128 far = _mm_max_ps(t0, t1);
+    const __m128 near_ok = _mm_and_ps(_mm_cmpgt_ps(near, t_min), _mm_cmplt_ps(near, t_max));
+    const __m128 far_ok = _mm_and_ps(_mm_cmpgt_ps(far, t_min), _mm_cmplt_ps(far, t_max));
+    const __m128 miss = _mm_set1_ps(std::numeric_limits<float>::infinity());
+    // SSE2 has no blend: select with and/andnot/or
+    const __m128 far_root = _mm_or_ps(_mm_and_ps(far_ok, far), _mm_andnot_ps(far_ok, miss));
+    const __m128 root = _mm_or_ps(_mm_and_ps(near_ok, near), _mm_andnot_ps(near_ok, far_root));
+    _mm_storeu_ps(roots, _mm_or_ps(_mm_and_ps(has_roots, root), _mm_andnot_ps(has_roots, miss)));
+#else
+    // Branch-free lane loop; compilers turn it into packed SSE2/AVX code
+    for (int lane = 0; lane < batch_size; lane++) {
+      const std::uint32_t i = first + lane;
+      const Vect3 oc {
+        this->spheres.center_x[i] + time * this->spheres.motion_x[i] - o.x(),
+        this->spheres.center_y[i] + time * this->spheres.motion_y[i] - o.y(),
+        this->spheres.center_z[i] + time * this->spheres.motion_z[i] - o.z()
+      };
+      const Real r = this->spheres.radius[i];
+      const Real h = dot(d, oc);
+      const Real c = oc.length_squared() - r * r;
+      const Vect3 l = oc - (h * inverse_a) * d;
+      const Real discriminant = a * (r * r - l.length_squared());
+      const Real sq = std::sqrt(discriminant > 0 ? discriminant : 0);
+      const Real q = h + (h < 0 ? -sq : sq);
+      const Real t0 = c / q, t1 = q * inverse_a;
+      const Real near = t0 < t1 ? t0 : t1;
+      const Real far = t0 < t1 ? t1 : t0;
+      const Real root = (ray_t.min < near && near < ray_t.max) ? near
+                      : (ray_t.min < far && far < ray_t.max) ? far
+                      : std::numeric_limits<Real>::infinity();
+      roots[lane] = discriminant >= 0 ? root : std::numeric_limits<Real>::infinity();
+    }
+#endif
+
+    int closest = -1;
+    for (int lane = 0; lane < lanes; lane++) {
+      if (roots[lane] < ray_t.max) {
+        ray_t.max = roots[lane];
+        closest = lane;
+      }
+    }
+    return closest;
+  }
+};
@@ -0,0 +1,282 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Render statistics for finding out why a scene is slow: ray counts, BVH
+// work per ray, hits per material type, path lengths and phase times.
+// Hot paths bump per-thread counters, merged only when a report is
+// collected. Configure with RAYTRACER_STATISTICS to enable; otherwise every
+// function here is an empty inline and the instrumentation compiles out.
+#if defined(RAYTRACER_STATISTICS) && RAYTRACER_STATISTICS
+#define RAYTRACER_STATISTICS_ENABLED 1
+#else
+#define RAYTRACER_STATISTICS_ENABLED 0
+#endif
+
+namespace Statistics {
+  constexpr bool enabled = RAYTRACER_STATISTICS_ENABLED;
+
+  enum class Counter {
+    PrimaryRays, SecondaryRays, ShadowRays, NodesVisited, BoxTests, PrimitiveTests, Count
+  };
+
+  enum class Phase { Build, Trace, Output, Count };
+
+  // Slots for MaterialType values
+  constexpr int material_type_slots = 8;
+  // Path lengths (rays per path) from 0 up; the last bin also holds longer ones
+  constexpr int path_length_bins = 65;
+
+  struct Counters {
+    std::uint64_t counters[(int)Counter::Count] = {};
+    std::uint64_t material_hits[material_type_slots] = {};
+    std::uint64_t path_lengths[path_length_bins] = {};
+
+    void merge(const Counters& other) {
+      for (int i = 0; i < (int)Counter::Count; i++) this->counters[i] += other.counters[i];
+      for (int i = 0; i < material_type_slots; i++) this->material_hits[i] += other.material_hits[i];
+      for (int i = 0; i < path_length_bins; i++) this->path_lengths[i] += other.path_lengths[i];
+    }
+
+    std::uint64_t operator[](Counter counter) const { return this->counters[(int)counter]; }
+  };
+
+  inline const char* counter_name(Counter counter) {
+    switch (counter) {
+      case Counter::PrimaryRays: return "primary_rays";
+      case Counter::SecondaryRays: return "secondary_rays";
+      case Counter::ShadowRays: return "shadow_rays";
+      case Counter::NodesVisited: return "nodes_visited";
+      case Counter::BoxTests: return "box_tests";
+      case Counter::PrimitiveTests: return "primitive_tests";
+      default: return "unknown";
+    }
+  }
+
+  inline const char* phase_name(Phase phase) {
+    switch (phase) {
+      case Phase::Build: return "build";
+      case Phase::Trace: return "trace";
+      case Phase::Output: return "output";
+      default: return "unknown";
+    }
+  }
+
+  // Merged counters and phase times, as collect() returns them
+  struct Report {
+    Counters counters;
+    double seconds[(int)Phase::Count] = {};
+    // Names of the MaterialType slots, for printing
+    std::vector<std::string> material_names;
+
+    std::uint64_t rays() const {
+      return this->counters[Counter::PrimaryRays] + this->counters[Counter::SecondaryRays] +
+             this->counters[Counter::ShadowRays];
+    }
+
+    double per_ray(Counter counter) const {
+      const std::uint64_t rays = this->rays();
+      return rays == 0 ? 0.0 : (double)this->counters[counter] / rays;
+    }
+
+    std::string material_name(int slot) const {
+      return slot < (int)this->material_names.size() ? this->material_names[slot] : std::to_string(slot);
+    }
+
+    std::string json() const {
+      std::ostringstream out;
+      out << "{\n  \"counters\": {";
+      for (int i = 0; i < (int)Counter::Count; i++) {
+        out << (i ? ", " : "") << "\"" << counter_name((Counter)i) << "\": " << this->counters.counters[i];
+      }
+      out << "},\n  \"per_ray\": {";
+      for (const Counter counter : {Counter::NodesVisited, Counter::BoxTests, Counter::PrimitiveTests}) {
+        out << (counter != Counter::NodesVisited ? ", " : "") << "\"" << counter_name(counter) << "\": "
+            << this->per_ray(counter);
+      }
+      out << "},\n  \"material_hits\": {";
+      bool first = true;
+      for (int i = 0; i < material_type_slots; i++) {
+        if (this->counters.material_hits[i] == 0) continue;
+        out << (first ? "" : ", ") << "\"" << this->material_name(i) << "\": " << this->counters.material_hits[i];
+        first = false;
+      }
+      // Trailing empty bins are left out
+      int bins = path_length_bins;
+      while (bins > 0 && this->counters.path_lengths[bins - 1] == 0) bins--;
+      out << "},\n  \"path_lengths\": [";
+      for (int i = 0; i < bins; i++) out << (i ? ", " : "") << this->counters.path_lengths[i];
+      out << "],\n  \"seconds\": {";
+      for (int i = 0; i < (int)Phase::Count; i++) {
+        out << (i ? ", " : "") << "\"" << phase_name((Phase)i) << "\": " << this->seconds[i];
+      }
+      out << "}\n}\n";
+      return out.str();
+    }
+  };
+
+  inline std::ostream& operator<<(std::ostream& out, const Report& report) {
+    out << "Statistics: " << report.counters[Counter::PrimaryRays] << " primary, "
+        << report.counters[Counter::SecondaryRays] << " secondary, "
+        << report.counters[Counter::ShadowRays] << " shadow rays; per ray "
+        << report.per_ray(Counter::NodesVisited) << " nodes, "
+        << report.per_ray(Counter::BoxTests) << " box tests, "
+        << report.per_ray(Counter::PrimitiveTests) << " primitive tests; hits";
+    for (int i = 0; i < material_type_slots; i++) {
+      if (report.counters.material_hits[i] == 0) continue;
+      out << " " << report.material_name(i) << " " << report.counters.material_hits[i];
+    }
+    std::uint64_t paths = 0, rays = 0;
+    for (int i = 0; i < path_length_bins; i++) {
+      paths += report.counters.path_lengths[i];
+      rays += i * report.counters.path_lengths[i];
+    }
+    out << "; " << paths << " paths of " << (paths == 0 ? 0.0 : (double)rays / paths) << " rays on average";
+    for (int i = 0; i < (int)Phase::Count; i++) {
+      out << (i ? ", " : "; ") << phase_name((Phase)i) << " " << report.seconds[i] * 1000 << " ms";
+    }
+    return out;
+  }
+
+#if RAYTRACER_STATISTICS_ENABLED
+  namespace detail {
+    struct Registry {
+      std::mutex mutex;
+      std::vector<Counters*> live;
+      // Totals of the threads that have exited
+      Counters retired;
+      std::atomic<std::uint64_t> nanoseconds[(int)Phase::Count] = {};
+    };
+
+    inline Registry& registry() {
+      static Registry instance;
+      return instance;
+    }
+
+    // A thread's counters, registered on its first count and folded into the
+    // retired totals when it exits
+    struct LocalCounters {
+      Counters counters;
+
+      LocalCounters() {
+        std::lock_guard<std::mutex> lock(registry().mutex);
+        registry().live.push_back(&this->counters);
+      }
+
+      ~LocalCounters() {
+        Registry& shared = registry();
+        std::lock_guard<std::mutex> lock(shared.mutex);
+        shared.retired.merge(this->counters);
+        for (size_t i = 0; i < shared.live.size(); i++) {
+          if (shared.live[i] != &this->counters) continue;
+          shared.live[i] = shared.live.back();
+          shared.live.pop_back();
+          break;
+        }
+      }
+    };
+
+    inline Counters& local() {
+      thread_local LocalCounters counters;
+      return counters.counters;
+    }
+  }
+
+  inline void count(Counter counter, std::uint64_t amount = 1) {
+    detail::local().counters[(int)counter] += amount;
+  }
+
+  inline void count_material_hit(int type, std::uint64_t hits = 1) {
+    detail::local().material_hits[type < material_type_slots ? type : material_type_slots - 1] += hits;
+  }
+
+  inline void count_path_length(int rays, std::uint64_t paths = 1) {
+    detail::local().path_lengths[rays < path_length_bins ? rays : path_length_bins - 1] += paths;
+  }
+
+  inline void add_time(Phase phase, std::chrono::steady_clock::duration elapsed) {
+    const std::uint64_t ns = (std::uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+    detail::registry().nanoseconds[(int)phase].fetch_add(ns, std::memory_order_relaxed);
+  }
+
+  // Everything counted since the program started, or since reset(). The
+  // counting threads must be idle, e.g. between renders.
+  inline Report collect() {
+    detail::Registry& shared = detail::registry();
+    std::lock_guard<std::mutex> lock(shared.mutex);
+    Report report;
+    report.counters = shared.retired;
+    for (const Counters* counters : shared.live) report.counters.merge(*counters);
+    for (int i = 0; i < (int)Phase::Count; i++) report.seconds[i] = shared.nanoseconds[i].load() * 1e-9;
+    return report;
+  }
+
+  inline void reset() {
+    detail::Registry& shared = detail::registry();
+    std::lock_guard<std::mutex> lock(shared.mutex);
+    shared.retired = Counters();
+    for (Counters* counters : shared.live) *counters = Counters();
+    for (std::atomic<std::uint64_t>& ns : shared.nanoseconds) ns.store(0);
+  }
+#else
+  inline void count(Counter, std::uint64_t = 1) {}
+  inline void count_material_hit(int, std::uint64_t = 1) {}
+  inline void count_path_length(int, std::uint64_t = 1) {}
+  inline void add_time(Phase, std::chrono::steady_clock::duration) {}
+  inline Report collect() { return Report(); }
+  inline void reset() {}
+#endif
+
+  // Adds the lifetime of a scope to a phase
+  class PhaseTimer {
+  public:
+    PhaseTimer(const PhaseTimer&) = delete;
+    PhaseTimer& operator=(const PhaseTimer&) = delete;
+
+#if RAYTRACER_STATISTICS_ENABLED
+    explicit PhaseTimer(Phase phase) : phase(phase), start(std::chrono::steady_clock::now()) {}
+    ~PhaseTimer() { add_time(this->phase, std::chrono::steady_clock::now() - this->start); }
+
+  private:
+    Phase phase;
+    std::chrono::steady_clock::time_point start;
+#else
+    explicit PhaseTimer(Phase) {}
+#endif
+  };
+
+  // BVH work of one traversal, tallied in registers and counted once when it
+  // goes out of scope rather than per node
+  class TraversalTally {
+  public:
+    TraversalTally() = default;
+    TraversalTally(const TraversalTally&) = delete;
+    TraversalTally& operator=(const TraversalTally&) = delete;
+
+#if RAYTRACER_STATISTICS_ENABLED
+    ~TraversalTally() {
+      Counters& counters = detail::local();
+      counters.counters[(int)Counter::NodesVisited] += this->nodes;
+      counters.counters[(int)Counter::BoxTests] += this->boxes;
+    }
+
+    void visit(std::uint32_t box_tests) {
+      this->nodes++;
+      this->boxes += box_tests;
+    }
+
+  private:
+    std::uint32_t nodes = 0;
+    std::uint32_t boxes = 0;
+#else
+    void visit(std::uint32_t) {}
+#endif
+  };
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <atomic>
+#include <csignal>
+
+// Turns SIGTERM and SIGINT into a flag that long-running loops poll, so a
+// preempted render can stop at a safe point and save its work instead of
+// dying mid-pass.
+namespace StopSignal {
+  // Lock-free atomics are the one shared state a signal handler may touch
+  inline std::atomic<bool> flag{false};
+
+  inline bool requested() { return flag.load(std::memory_order_relaxed); }
+
+  inline void handle(int) { flag.store(true, std::memory_order_relaxed); }
+
+  // Installs the handler for its lifetime and restores the previous ones
+  class Scope {
+  public:
+    Scope() {
+      flag.store(false);
+      this->previous_term = std::signal(SIGTERM, handle);
+      this->previous_interrupt = std::signal(SIGINT, handle);
+    }
+
+    Scope(const Scope &) = delete;
+    Scope &operator=(const Scope &) = delete;
+
+    ~Scope() {
+      std::signal(SIGTERM, this->previous_term);
+      std::signal(SIGINT, this->previous_interrupt);
+    }
+
+  private:
+    void (*previous_term)(int);
+    void (*previous_interrupt)(int);
+  };
+}
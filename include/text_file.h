@@ -0,0 +1,115 @@
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <vector>
+
+// Line-oriented text files read in large blocks of whole lines, which
+// callers split with split_lines and parse on several threads. Shared by
+// the scene and OBJ loaders.
+namespace TextFile {
+  // Bytes of text read and parsed at a time
+  constexpr size_t block_size = 16 << 20;
+
+  // Whitespace-separated words of one line, up to a comment
+  class Tokens {
+  public:
+    Tokens(const char* begin, const char* end) : position(begin), end(end) {}
+
+    // Empty at the end of the line
+    std::string_view next() {
+      while (this->position < this->end && Tokens::is_space(*this->position)) this->position++;
+      if (this->position == this->end || *this->position == '#') {
+        this->position = this->end;
+        return {};
+      }
+      const char* start = this->position;
+      while (this->position < this->end && !Tokens::is_space(*this->position) && *this->position != '#') {
+        this->position++;
+      }
+      return std::string_view(start, (size_t)(this->position - start));
+    }
+
+    bool number(double& value) {
+      return Tokens::parse(this->next(), value);
+    }
+
+    bool done() { return this->next().empty(); }
+
+    // Whether all of token is a number, e.g. "-1.5e3" or "+2"
+    template <typename T>
+    static bool parse(std::string_view token, T& value) {
+      if (token.empty()) return false;
+      // from_chars takes no leading '+'
+      const size_t skip = token[0] == '+' ? 1 : 0;
+      const std::from_chars_result result = std::from_chars(token.data() + skip, token.data() + token.size(), value);
+      return result.ec == std::errc() && result.ptr == token.data() + token.size();
+    }
+
+  private:
+    const char* position;
+    const char* end;
+
+    static bool is_space(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+  };
+
+  // Splits [begin, end) into about parts runs of whole lines
+  inline std::vector<const char*> split_lines(const char* begin, const char* end, size_t parts) {
+    std::vector<const char*> bounds{begin};
+    const size_t step = std::max<size_t>((size_t)(end - begin) / std::max<size_t>(parts, 1), 1);
+    while (bounds.back() < end) {
+      const char* cut = bounds.back() + std::min(step, (size_t)(end - bounds.back()));
+      cut = std::find(cut, end, '\n');
+      bounds.push_back(cut == end ? end : cut + 1);
+    }
+    return bounds;
+  }
+
+  // Reads in from its start in blocks of whole lines of about block_size
+  // bytes, calling on_block(begin, end, remaining) for each, where remaining
+  // is the number of bytes not read yet; only one block is held at a time.
+  // Stops with false when on_block does, or after reporting a read error of
+  // path to cerr.
+  template <typename OnBlock>
+  bool read_blocks(std::ifstream& in, const std::string& path, OnBlock&& on_block) {
+    std::vector<char> block;
+    in.seekg(0, std::ios::end);
+    std::uint64_t remaining = (std::uint64_t)in.tellg();
+    in.seekg(0);
+
+    while (true) {
+      // Tops up the partial line carried over from the last block
+      const size_t carried = block.size();
+      const size_t size = (size_t)std::min<std::uint64_t>(remaining, block_size);
+      block.resize(carried + size);
+      in.read(block.data() + carried, (std::streamsize)size);
+      if (!in) {
+        std::cerr << "[ERROR] " << path << ": read error" << std::endl;
+        return false;
+      }
+      remaining -= size;
+      const bool at_end = remaining == 0;
+
+      // Whole lines only, unless this is the end of the file
+      const char* begin = block.data();
+      const char* end = begin + block.size();
+      if (!at_end) {
+        const char* last_newline = end;
+        while (last_newline > begin && last_newline[-1] != '\n') last_newline--;
+        // A line longer than a block grows the next one
+        if (last_newline == begin) continue;
+        end = last_newline;
+      }
+
+      if (!on_block(begin, end, remaining)) return false;
+      if (at_end) return true;
+      block.erase(block.begin(), block.begin() + (end - begin));
+    }
+  }
+}
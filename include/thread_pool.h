@@ -0,0 +1,184 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Work-stealing thread pool
+// Every worker owns a deque: it pushes and pops its own tasks at the back (LIFO,
+// cache friendly) and, once empty, steals from the front of the other deques.
+// Tasks submitted from outside the pool go to a shared injection queue.
+class ThreadPool {
+public:
+  using Task = std::function<void()>;
+
+  // A pool of 0 workers is valid: tasks then run on whichever thread waits on them
+  explicit ThreadPool(unsigned worker_count) : queues(worker_count + 1) {
+    for (std::unique_ptr<WorkerQueue>& queue : this->queues) {
+      queue = std::make_unique<WorkerQueue>();
+    }
+    this->workers.reserve(worker_count);
+    for (unsigned i = 0; i < worker_count; i++) {
+      this->workers.emplace_back([this, i] { this->worker_loop(i); });
+    }
+  }
+
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+
+  ~ThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(this->sleep_mutex);
+      this->stopping = true;
+    }
+    this->wake_up.notify_all();
+    for (std::thread& worker : this->workers) {
+      worker.join();
+    }
+  }
+
+  unsigned size() const { return (unsigned)this->workers.size(); }
+
+  static unsigned hardware_threads() {
+    const unsigned count = std::thread::hardware_concurrency();
+    return count == 0 ? 1 : count;
+  }
+
+  void submit(Task task) {
+    WorkerQueue& queue = *this->queues[this->local_queue_index()];
+    this->pending.fetch_add(1, std::memory_order_release);
+    {
+      std::lock_guard<std::mutex> lock(queue.mutex);
+      queue.tasks.push_back(std::move(task));
+    }
+    {
+      // Taking the lock orders this notify after a worker's emptiness check
+      std::lock_guard<std::mutex> lock(this->sleep_mutex);
+    }
+    this->wake_up.notify_one();
+  }
+
+  // Runs one queued task on the calling thread, if any. Used by waiters to help
+  // out instead of blocking, which also makes nested fork/join deadlock free.
+  bool run_pending_task() {
+    Task task;
+    if (!this->take_task(this->local_queue_index(), task)) return false;
+    task();
+    return true;
+  }
+
+private:
+  struct WorkerQueue {
+    std::mutex mutex;
+    std::deque<Task> tasks;
+  };
+
+  std::vector<std::unique_ptr<WorkerQueue>> queues; // Last one is the injection queue
+  std::vector<std::thread> workers;
+  std::atomic<size_t> pending{0};
+  std::mutex sleep_mutex;
+  std::condition_variable wake_up;
+  bool stopping = false;
+
+  struct WorkerIdentity {
+    const ThreadPool* pool = nullptr;
+    size_t index = 0;
+  };
+
+  static WorkerIdentity& identity() {
+    thread_local WorkerIdentity current;
+    return current;
+  }
+
+  size_t local_queue_index() const {
+    const WorkerIdentity& current = ThreadPool::identity();
+    return current.pool == this ? current.index : this->queues.size() - 1;
+  }
+
+  bool take_task(size_t own_index, Task& task) {
+    if (this->pending.load(std::memory_order_acquire) == 0) return false;
+
+    // Own queue first, newest task
+    {
+      WorkerQueue& own = *this->queues[own_index];
+      std::lock_guard<std::mutex> lock(own.mutex);
+      if (!own.tasks.empty()) {
+        task = std::move(own.tasks.back());
+        own.tasks.pop_back();
+        this->pending.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+      }
+    }
+
+    // Steal the oldest task of another queue, starting after our own
+    const size_t queue_count = this->queues.size();
+    for (size_t offset = 1; offset < queue_count; offset++) {
+      WorkerQueue& victim = *this->queues[(own_index + offset) % queue_count];
+      std::lock_guard<std::mutex> lock(victim.mutex);
+      if (!victim.tasks.empty()) {
+        task = std::move(victim.tasks.front());
+        victim.tasks.pop_front();
+        this->pending.fetch_sub(1, std::memory_order_relaxed);
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void worker_loop(size_t index) {
+    ThreadPool::identity() = WorkerIdentity{this, index};
+
+    while (true) {
+      Task task;
+      if (this->take_task(index, task)) {
+        task();
+        continue;
+      }
+
+      std::unique_lock<std::mutex> lock(this->sleep_mutex);
+      this->wake_up.wait(lock, [this] {
+        return this->stopping || this->pending.load(std::memory_order_acquire) > 0;
+      });
+      if (this->stopping && this->pending.load(std::memory_order_acquire) == 0) return;
+    }
+  }
+};
+
+// Fork/join handle over a ThreadPool: run() any number of tasks, then wait()
+// for all of them. The waiting thread executes queued tasks while it waits.
+class TaskGroup {
+public:
+  explicit TaskGroup(ThreadPool& pool) : pool(pool) {}
+
+  TaskGroup(const TaskGroup&) = delete;
+  TaskGroup& operator=(const TaskGroup&) = delete;
+
+  ~TaskGroup() { this->wait(); }
+
+  template <typename Function>
+  void run(Function&& function) {
+    this->outstanding.fetch_add(1, std::memory_order_relaxed);
+    this->pool.submit([this, function = std::forward<Function>(function)]() mutable {
+      function();
+      this->outstanding.fetch_sub(1, std::memory_order_acq_rel);
+    });
+  }
+
+  void wait() {
+    while (this->outstanding.load(std::memory_order_acquire) > 0) {
+      if (!this->pool.run_pending_task()) {
+        std::this_thread::yield();
+      }
+    }
+  }
+
+private:
+  ThreadPool& pool;
+  std::atomic<size_t> outstanding{0};
+};
@@ -0,0 +1,181 @@
+#pragma once
+
+#include <cassert>
+#include <cmath>
+
+#include "bounding_box.h"
+#include "point3.h"
+#include "ray.h"
+#include "real.h"
+#include "util.h"
+#include "vect3.h"
+
+// Affine transform p -> M p + t, kept together with its inverse so that both
+// directions cost one matrix product. Rows hold M with t as the last column.
+class Transform {
+public:
+  // Identity
+  Transform() {
+    for (int row = 0; row < 3; row++) {
+      for (int column = 0; column < 4; column++) {
+        this->forward[row][column] = this->backward[row][column] = row == column ? 1 : 0;
+      }
+    }
+  }
+
+  static Transform translate(const Vect3& offset) {
+    Transform transform;
+    for (int row = 0; row < 3; row++) {
+      transform.forward[row][3] = offset[row];
+      transform.backward[row][3] = -offset[row];
+    }
+    return transform;
+  }
+
+  // Factors must not be 0
+  static Transform scale(const Vect3& factors) {
+    assert(factors[0] != 0 && factors[1] != 0 && factors[2] != 0 && "[ERROR] Scale factors cannot be 0");
+    Transform transform;
+    for (int row = 0; row < 3; row++) {
+      transform.forward[row][row] = factors[row];
+      transform.backward[row][row] = 1 / factors[row];
+    }
+    return transform;
+  }
+
+  // Counterclockwise about axis (0, 1 or 2) when looking down on it
+  static Transform rotate(int axis, double degrees) {
+    assert(0 <= axis && axis <= 2 && "[ERROR] Rotation axis out of range");
+    const double radians = Utility::degrees_to_radians(degrees);
+    const Real cosine = (Real)std::cos(radians);
+    const Real sine = (Real)std::sin(radians);
+    const int a = (axis + 1) % 3, b = (axis + 2) % 3;
+    Transform transform;
+    transform.forward[a][a] = transform.forward[b][b] = cosine;
+    transform.forward[a][b] = -sine;
+    transform.forward[b][a] = sine;
+    // The inverse of a rotation is its transpose
+    transform.backward[a][a] = transform.backward[b][b] = cosine;
+    transform.backward[a][b] = sine;
+    transform.backward[b][a] = -sine;
+    return transform;
+  }
+
+  // This transform followed by next
+  Transform then(const Transform& next) const {
+    Transform result;
+    Transform::multiply(next.forward, this->forward, result.forward);
+    Transform::multiply(this->backward, next.backward, result.backward);
+    return result;
+  }
+
+  Transform inverse() const {
+    Transform result;
+    for (int row = 0; row < 3; row++) {
+      for (int column = 0; column < 4; column++) {
+        result.forward[row][column] = this->backward[row][column];
+        result.backward[row][column] = this->forward[row][column];
+      }
+    }
+    return result;
+  }
+
+  Point3 point(const Point3& p) const { return Transform::apply_point(this->forward, p); }
+  Vect3 vector(const Vect3& v) const { return Transform::apply_vector(this->forward, v); }
+
+  // Transformed p, and in error a bound on the error of its coordinates
+  // given the bound p_error on those of p (pbrt 6.8.6)
+  Point3 point(const Point3& p, const Vect3& p_error, Vect3& error) const {
+    error = Transform::point_error(this->forward, p, p_error);
+    return this->point(p);
+  }
+
+  // Normals take the inverse transpose, so they stay perpendicular to the
+  // transformed surface; the result is not normalized
+  Vect3 normal(const Vect3& n) const {
+    Vect3 result;
+    for (int row = 0; row < 3; row++) {
+      result[row] = this->backward[0][row] * n[0] + this->backward[1][row] * n[1] + this->backward[2][row] * n[2];
+    }
+    return result;
+  }
+
+  // ray mapped by the inverse, with the direction mapped but not normalized.
+  // Its origin is then moved forward past its rounding error, by shift in t:
+  // the point at t along the result maps to the point at t + shift along ray
+  // (pbrt 6.8.6).
+  Ray inverse_ray(const Ray& ray, Real& shift) const {
+    const Point3 origin = Transform::apply_point(this->backward, ray.origin());
+    const Vect3 error = Transform::point_error(this->backward, ray.origin(), Vect3(0, 0, 0));
+    const Vect3 direction = Transform::apply_vector(this->backward, ray.direction());
+    const Real length_squared = direction.length_squared();
+    shift = length_squared > 0 ? dot(abs(direction), error) / length_squared : 0;
+    return Ray(origin + shift * direction, direction, ray.time());
+  }
+
+  // Box around the transformed box (Arvo 1990), grown by the rounding error
+  // of the transform so that it never cuts off the transformed geometry
+  BoundingBox bounding_box(const BoundingBox& box) const {
+    Interval axes[3];
+    for (int row = 0; row < 3; row++) {
+      Real low = this->forward[row][3], high = low;
+      Real magnitude = std::fabs(low);
+      for (int column = 0; column < 3; column++) {
+        const Interval& interval = box.axis_interval(column);
+        const Real a = this->forward[row][column] * interval.min;
+        const Real b = this->forward[row][column] * interval.max;
+        low += std::fmin(a, b);
+        high += std::fmax(a, b);
+        magnitude += std::fmax(std::fabs(a), std::fabs(b));
+      }
+      const Real padding = Utility::gamma(3) * magnitude;
+      axes[row] = Interval(low - padding, high + padding);
+    }
+    return BoundingBox(axes[0], axes[1], axes[2]);
+  }
+
+private:
+  Real forward[3][4];
+  Real backward[3][4];
+
+  static Point3 apply_point(const Real (&m)[3][4], const Point3& p) {
+    return {
+      m[0][0] * p[0] + m[0][1] * p[1] + m[0][2] * p[2] + m[0][3],
+      m[1][0] * p[0] + m[1][1] * p[1] + m[1][2] * p[2] + m[1][3],
+      m[2][0] * p[0] + m[2][1] * p[1] + m[2][2] * p[2] + m[2][3]
+    };
+  }
+
+  static Vect3 apply_vector(const Real (&m)[3][4], const Vect3& v) {
+    return {
+      m[0][0] * v[0] + m[0][1] * v[1] + m[0][2] * v[2],
+      m[1][0] * v[0] + m[1][1] * v[1] + m[1][2] * v[2],
+      m[2][0] * v[0] + m[2][1] * v[1] + m[2][2] * v[2]
+    };
+  }
+
+  static Vect3 point_error(const Real (&m)[3][4], const Point3& p, const Vect3& p_error) {
+    Vect3 error;
+    for (int row = 0; row < 3; row++) {
+      Real magnitude = std::fabs(m[row][3]);
+      Real carried = 0;
+      for (int column = 0; column < 3; column++) {
+        magnitude += std::fabs(m[row][column] * p[column]);
+        carried += std::fabs(m[row][column]) * p_error[column];
+      }
+      error[row] = Utility::gamma(3) * magnitude + (1 + Utility::gamma(3)) * carried;
+    }
+    return error;
+  }
+
+  // result = a b, as affine maps: b first, then a
+  static void multiply(const Real (&a)[3][4], const Real (&b)[3][4], Real (&result)[3][4]) {
+    for (int row = 0; row < 3; row++) {
+      for (int column = 0; column < 4; column++) {
+        Real sum = column == 3 ? a[row][3] : 0;
+        for (int k = 0; k < 3; k++) sum += a[row][k] * b[k][column];
+        result[row][column] = sum;
+      }
+    }
+  }
+};
@@ -0,0 +1,291 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <iostream>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#include "bvh.h"
+#include "hittable.h"
+#include "real.h"
+#include "statistics.h"
+
+// Indexed triangles: vertices are stored once and shared by the triangles
+// around them, each triangle being three indices into vertices
+class TriangleSet {
+public:
+  std::vector<Point3> vertices;
+  std::vector<std::uint32_t> indices;
+
+  size_t size() const { return this->indices.size() / 3; }
+
+  std::uint32_t add_vertex(const Point3& position) {
+    this->vertices.push_back(position);
+    return (std::uint32_t)(this->vertices.size() - 1);
+  }
+
+  void add(std::uint32_t a, std::uint32_t b, std::uint32_t c) {
+    this->indices.push_back(a);
+    this->indices.push_back(b);
+    this->indices.push_back(c);
+  }
+
+  const Point3& vertex(size_t triangle, int corner) const {
+    return this->vertices[this->indices[3 * triangle + corner]];
+  }
+
+  BoundingBox bounding_box(size_t triangle) const {
+    return BoundingBox(BoundingBox(this->vertex(triangle, 0), this->vertex(triangle, 1)),
+                       BoundingBox(this->vertex(triangle, 2), this->vertex(triangle, 2)));
+  }
+
+  // Replaces the triangles by triangles[order[0]], triangles[order[1]], ...
+  void reorder(const std::vector<std::uint32_t>& order) {
+    std::vector<std::uint32_t> result(3 * order.size());
+    for (size_t i = 0; i < order.size(); i++) {
+      std::copy_n(&this->indices[3 * order[i]], 3, &result[3 * i]);
+    }
+    this->indices = std::move(result);
+  }
+};
+
+// Ray set up for the watertight ray-triangle test (Woop, Benthin and Wald
+// 2013): axes are permuted so that the largest component of the direction
+// is z, and triangles are sheared so that the ray runs along +z from the
+// origin. Edges shared by two triangles are then computed identically for
+// both, so rays cannot slip through between them.
+struct TriangleRay {
+  Point3 origin;
+  int kx, ky, kz;
+  Real sx, sy, sz;
+
+  explicit TriangleRay(const Ray& ray) : origin(ray.origin()) {
+    const Vect3& d = ray.direction();
+    const Vect3 size = abs(d);
+    this->kz = size.x() > size.y() ? (size.x() > size.z() ? 0 : 2) : (size.y() > size.z() ? 1 : 2);
+    this->kx = (this->kz + 1) % 3;
+    this->ky = (this->kx + 1) % 3;
+    // Keeps the winding of triangles
+    if (d[this->kz] < 0) std::swap(this->kx, this->ky);
+    this->sx = d[this->kx] / d[this->kz];
+    this->sy = d[this->ky] / d[this->kz];
+    this->sz = 1 / d[this->kz];
+  }
+};
+
+// Triangle mesh with its own BVH over its triangles, so that a scene-level
+// tree holds the mesh as a single box. Leaves are tested a few triangles at
+// a time with the watertight test. One material for the whole mesh.
+class TriangleMesh final : public Hittable {
+public:
+  static constexpr int batch_size = 4;
+
+  // Leaves of up to two batches: fewer nodes, at about the same speed
+  static BVHBuildSettings default_settings() {
+    BVHBuildSettings settings;
+    settings.max_leaf_size = 8;
+    settings.intersection_cost = 0.5;
+    return settings;
+  }
+
+  TriangleMesh(TriangleSet triangles, std::uint32_t material,
+               const BVHBuildSettings& settings = TriangleMesh::default_settings())
+      : material(material) {
+    assert(triangles.size() > 0 && "[ERROR] TriangleMesh needs at least one triangle");
+
+    std::vector<BoundingBox> bounds(triangles.size());
+    for (size_t i = 0; i < bounds.size(); i++) {
+      bounds[i] = triangles.bounding_box(i);
+    }
+    this->tree = BVHTree(bounds, settings);
+    std::clog << "[LOG] " << this->tree.statistics() << std::endl;
+
+    // Leaf order, plus batch_size - 1 copies of the last triangle so that a
+    // batch starting at the last leaf still reads valid indices
+    this->count = triangles.size();
+    std::vector<std::uint32_t> order = this->tree.primitive_order();
+    for (int i = 1; i < batch_size; i++) order.push_back(order.back());
+    triangles.reorder(order);
+    this->triangles = std::move(triangles);
+    this->bbox = this->tree.bounding_box();
+  }
+
+  bool intersect(const Ray& ray, Interval& ray_t, Intersection& intersection) const override {
+    const TriangleRay sheared(ray);
+    std::uint32_t closest = 0;
+    Real closest_t = ray_t.max;
+    const bool hit_anything = this->tree.traverse_leaves(ray, ray_t,
+      [&](std::uint32_t first, std::uint32_t count, Interval& t) {
+        bool hit_leaf = false;
+        for (std::uint32_t i = first; i < first + count; i += batch_size) {
+          const int lanes = (int)std::min<std::uint32_t>(batch_size, first + count - i);
+          const int lane = this->intersect_batch(sheared, i, lanes, t);
+          if (lane >= 0) {
+            closest = i + lane;
+            closest_t = t.max;
+            hit_leaf = true;
+          }
+        }
+        return hit_leaf;
+      });
+    if (!hit_anything) return false;
+    ray_t.max = closest_t;
+    intersection = Intersection{closest_t, closest, this};
+    return true;
+  }
+
+  // Surface attributes for the winning triangle only. The hit point is
+  // interpolated from the vertices, which bounds its error (pbrt 6.8.4).
+  HitRecord finalize(const Ray& ray, const Intersection& intersection) const override {
+    const std::uint32_t triangle = intersection.primitive;
+    Real edges[3], z[3];
+    this->edge_functions(TriangleRay(ray), triangle, edges, z);
+    const Real det = edges[0] + edges[1] + edges[2];
+
+    Point3 p(0, 0, 0);
+    Vect3 p_error(0, 0, 0);
+    for (int corner = 0; corner < 3; corner++) {
+      const Vect3 weighted = (det != 0 ? edges[corner] / det : (Real)1 / 3) * this->triangles.vertex(triangle, corner);
+      p += weighted;
+      p_error += abs(weighted);
+    }
+    p_error *= Utility::gamma(7);
+
+    const Point3& p0 = this->triangles.vertex(triangle, 0);
+    const Vect3 normal = unit_vector(cross(this->triangles.vertex(triangle, 1) - p0,
+                                           this->triangles.vertex(triangle, 2) - p0));
+    return HitRecord(intersection.t, p, p_error, ray, normal, this->material);
+  }
+
+  bool occluded(const Ray& ray, const Interval ray_t) const override {
+    const TriangleRay sheared(ray);
+    return this->tree.occluded(ray, ray_t, [&](std::uint32_t first, std::uint32_t count, Interval& t) {
+      for (std::uint32_t i = first; i < first + count; i += batch_size) {
+        const int lanes = (int)std::min<std::uint32_t>(batch_size, first + count - i);
+        if (this->intersect_batch(sheared, i, lanes, t) >= 0) return true;
+      }
+      return false;
+    });
+  }
+
+  // Camera packets: the rays share one traversal, each leaf is then tested
+  // against every ray still active in it
+  void intersect_packet(RayPacket& packet, Intersection* intersections) const override {
+    this->tree.traverse_packet(packet, [&](std::uint32_t first, std::uint32_t count, std::uint64_t mask) {
+      for (; mask != 0; mask &= mask - 1) {
+        const int ray = RayPacket::lowest_ray(mask);
+        const TriangleRay sheared(packet.rays[ray]);
+        Interval t = packet.interval(ray);
+        for (std::uint32_t i = first; i < first + count; i += batch_size) {
+          const int lanes = (int)std::min<std::uint32_t>(batch_size, first + count - i);
+          const int lane = this->intersect_batch(sheared, i, lanes, t);
+          if (lane >= 0) {
+            intersections[ray] = Intersection{t.max, i + lane, this};
+          }
+        }
+        packet.narrow(ray, t.max);
+      }
+    });
+  }
+
+  BoundingBox bounding_box() const override {
+    return this->bbox;
+  };
+
+  // Triangles, leaving out the padding
+  size_t size() const { return this->count; }
+
+  // Bytes held by the vertices, indices and BVH
+  size_t memory_bytes() const {
+    return this->triangles.vertices.size() * sizeof(Point3) + this->triangles.indices.size() * sizeof(std::uint32_t) +
+           this->tree.memory_bytes();
+  }
+
+private:
+  TriangleSet triangles;
+  size_t count = 0;
+  std::uint32_t material;
+  BVHTree tree;
+  BoundingBox bbox;
+
+  // Edge functions of one triangle, which are its barycentric coordinates
+  // scaled by their sum, and its vertices' sheared z
+  void edge_functions(const TriangleRay& ray, std::uint32_t triangle, Real edges[3], Real z[3]) const {
+    Real x[3], y[3];
+    for (int corner = 0; corner < 3; corner++) {
+      const Vect3 p = this->triangles.vertex(triangle, corner) - ray.origin;
+      z[corner] = p[ray.kz];
+      x[corner] = p[ray.kx] - ray.sx * z[corner];
+      y[corner] = p[ray.ky] - ray.sy * z[corner];
+    }
+    edges[0] = x[1] * y[2] - y[1] * x[2];
+    edges[1] = x[2] * y[0] - y[2] * x[0];
+    edges[2] = x[0] * y[1] - y[0] * x[1];
+#if RAYTRACER_REAL_FLOAT
+    // An edge that rounds to exactly 0 in float is decided in double
+    if (edges[0] == 0 || edges[1] == 0 || edges[2] == 0) {
+      edges[0] = (Real)((double)x[1] * y[2] - (double)y[1] * x[2]);
+      edges[1] = (Real)((double)x[2] * y[0] - (double)y[2] * x[0]);
+      edges[2] = (Real)((double)x[0] * y[1] - (double)y[0] * x[1]);
+    }
+#endif
+  }
+
+  // Distance at which the ray hits a triangle with these edge functions and
+  // sheared z, or infinity if it misses it or the hit is outside ray_t
+  static Real root(Real e0, Real e1, Real e2, Real z0, Real z1, Real z2, Real sz, const Interval& ray_t) {
+    const bool inside = (e0 >= 0 && e1 >= 0 && e2 >= 0) || (e0 <= 0 && e1 <= 0 && e2 <= 0);
+    const Real det = e0 + e1 + e2;
+    const Real t = sz * (e0 * z0 + e1 * z1 + e2 * z2) / det;
+    return inside && det != 0 && ray_t.min < t && t < ray_t.max ? t : std::numeric_limits<Real>::infinity();
+  }
+
+  // Tests triangles [first, first + lanes): the vertices of all lanes are
+  // gathered and sheared first, then the edge functions run as a
+  // branch-free lane loop that compilers vectorize. Narrows ray_t.max and
+  // returns the lane of the closest hit, or -1.
+  int intersect_batch(const TriangleRay& ray, std::uint32_t first, int lanes, Interval& ray_t) const {
+    Statistics::count(Statistics::Counter::PrimitiveTests, (std::uint64_t)lanes);
+    Real x[3][batch_size], y[3][batch_size], z[3][batch_size];
+    for (int lane = 0; lane < batch_size; lane++) {
+      for (int corner = 0; corner < 3; corner++) {
+        const Vect3 p = this->triangles.vertex(first + lane, corner) - ray.origin;
+        z[corner][lane] = p[ray.kz];
+        x[corner][lane] = p[ray.kx] - ray.sx * z[corner][lane];
+        y[corner][lane] = p[ray.ky] - ray.sy * z[corner][lane];
+      }
+    }
+
+    Real roots[batch_size];
+    bool exact_zero[batch_size];
+    for (int lane = 0; lane < batch_size; lane++) {
+      const Real e0 = x[1][lane] * y[2][lane] - y[1][lane] * x[2][lane];
+      const Real e1 = x[2][lane] * y[0][lane] - y[2][lane] * x[0][lane];
+      const Real e2 = x[0][lane] * y[1][lane] - y[0][lane] * x[1][lane];
+      roots[lane] = TriangleMesh::root(e0, e1, e2, z[0][lane], z[1][lane], z[2][lane], ray.sz, ray_t);
+      exact_zero[lane] = e0 == 0 || e1 == 0 || e2 == 0;
+    }
+    // Float edges that round to exactly 0 are decided in double
+    if (RAYTRACER_REAL_FLOAT) {
+      for (int lane = 0; lane < lanes; lane++) {
+        if (!exact_zero[lane]) continue;
+        Real edges[3], corner_z[3];
+        this->edge_functions(ray, first + lane, edges, corner_z);
+        roots[lane] = TriangleMesh::root(edges[0], edges[1], edges[2], corner_z[0], corner_z[1], corner_z[2], ray.sz, ray_t);
+      }
+    }
+
+    int closest = -1;
+    for (int lane = 0; lane < lanes; lane++) {
+      if (roots[lane] < ray_t.max) {
+        ray_t.max = roots[lane];
+        closest = lane;
+      }
+    }
+    return closest;
+  }
+};
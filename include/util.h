@@ -1,17 +1,22 @@
 #pragma once
 
 #include "constant.h"
-#include <random>
+#include "sampler.h"
 
 namespace Utility{
   constexpr inline double degrees_to_radians(double degrees) {
     return degrees * Constant::pi / 180.0;
   }
 
+  // Sequence for scene setup code only. Rendering draws from the Sampler of
+  // the path being traced instead.
+  inline Sampler& scene_sampler() {
+    thread_local Sampler sampler(0, 0, 0);
+    return sampler;
+  }
+
   inline double random_double() {
-    static std::uniform_real_distribution<double> distribution(0.0, 1.0);
-    static std::mt19937 generator;
-    return distribution(generator);
+    return scene_sampler().next_double();
   }
 
   inline double random_double(double min, double max) {
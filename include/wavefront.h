@@ -0,0 +1,326 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <optional>
+#include <ostream>
+#include <vector>
+
+#include "color.h"
+#include "constant.h"
+#include "hittable.h"
+#include "interval.h"
+#include "light.h"
+#include "material.h"
+#include "ray.h"
+#include "real.h"
+#include "russian_roulette.h"
+#include "sampler.h"
+#include "statistics.h"
+
+enum class WavefrontStage { Generate, Sort, Extend, Shade, Accumulate, Count };
+
+// Time spent in, and items processed by, each stage, summed over all threads
+struct WavefrontStatistics {
+  static constexpr int stage_count = (int)WavefrontStage::Count;
+
+  std::atomic<std::uint64_t> nanoseconds[stage_count] = {};
+  std::atomic<std::uint64_t> items[stage_count] = {};
+
+  void record(WavefrontStage stage, std::chrono::steady_clock::duration elapsed, std::uint64_t item_count) {
+    const std::uint64_t ns = (std::uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count();
+    this->nanoseconds[(int)stage].fetch_add(ns, std::memory_order_relaxed);
+    this->items[(int)stage].fetch_add(item_count, std::memory_order_relaxed);
+  }
+
+  static const char* stage_name(WavefrontStage stage) {
+    switch (stage) {
+      case WavefrontStage::Generate: return "generate";
+      case WavefrontStage::Sort: return "sort";
+      case WavefrontStage::Extend: return "extend";
+      case WavefrontStage::Shade: return "shade";
+      case WavefrontStage::Accumulate: return "accumulate";
+      default: return "unknown";
+    }
+  }
+};
+
+inline std::ostream &operator<<(std::ostream &out, const WavefrontStatistics& stats) {
+  out << "Wavefront stages (thread time):";
+  for (int stage = 0; stage < WavefrontStatistics::stage_count; stage++) {
+    const double ms = stats.nanoseconds[stage].load() * 1e-6;
+    const std::uint64_t items = stats.items[stage].load();
+    out << " " << WavefrontStatistics::stage_name((WavefrontStage)stage)
+        << " " << ms << " ms / " << items;
+    if (stage != WavefrontStatistics::stage_count - 1) out << ",";
+  }
+  return out;
+}
+
+// Adds the lifetime of a scope to one stage of the statistics
+class StageTimer {
+public:
+  StageTimer(WavefrontStatistics& stats, WavefrontStage stage, std::uint64_t item_count) :
+    stats(stats), stage(stage), item_count(item_count), start(std::chrono::steady_clock::now()) {}
+
+  ~StageTimer() {
+    this->stats.record(this->stage, std::chrono::steady_clock::now() - this->start, this->item_count);
+  }
+
+  StageTimer(const StageTimer&) = delete;
+  StageTimer& operator=(const StageTimer&) = delete;
+
+private:
+  WavefrontStatistics& stats;
+  WavefrontStage stage;
+  std::uint64_t item_count;
+  std::chrono::steady_clock::time_point start;
+};
+
+// First ray and random number source of a path
+struct PathStart {
+  Ray ray;
+  Sampler sampler;
+};
+
+// State of every path in a batch, as SoA buffers indexed by path
+struct PathStates {
+  std::vector<Real> origin_x, origin_y, origin_z;
+  std::vector<Real> direction_x, direction_y, direction_z;
+  std::vector<Real> time;
+  std::vector<Real> throughput_r, throughput_g, throughput_b;
+  std::vector<Real> radiance_r, radiance_g, radiance_b;
+  // Density the last bounce picked the ray with; 0 for camera rays
+  std::vector<Real> bsdf_pdf;
+  std::vector<Sampler> samplers;
+  std::vector<std::optional<HitRecord>> hits;
+
+  size_t size() const { return this->time.size(); }
+
+  void clear() {
+    for (std::vector<Real>* buffer : this->buffers()) buffer->clear();
+    this->samplers.clear();
+    this->hits.clear();
+  }
+
+  void add(const PathStart& start) {
+    this->origin_x.push_back(0);
+    this->origin_y.push_back(0);
+    this->origin_z.push_back(0);
+    this->direction_x.push_back(0);
+    this->direction_y.push_back(0);
+    this->direction_z.push_back(0);
+    this->time.push_back(0);
+    this->throughput_r.push_back(1);
+    this->throughput_g.push_back(1);
+    this->throughput_b.push_back(1);
+    this->radiance_r.push_back(0);
+    this->radiance_g.push_back(0);
+    this->radiance_b.push_back(0);
+    this->bsdf_pdf.push_back(0);
+    this->samplers.push_back(start.sampler);
+    this->hits.emplace_back();
+    this->set_ray(this->size() - 1, start.ray);
+  }
+
+  Ray ray(size_t i) const {
+    return Ray(Point3(this->origin_x[i], this->origin_y[i], this->origin_z[i]),
+               Vect3(this->direction_x[i], this->direction_y[i], this->direction_z[i]),
+               this->time[i]);
+  }
+
+  void set_ray(size_t i, const Ray& ray) {
+    this->origin_x[i] = ray.origin()[0];
+    this->origin_y[i] = ray.origin()[1];
+    this->origin_z[i] = ray.origin()[2];
+    this->direction_x[i] = ray.direction()[0];
+    this->direction_y[i] = ray.direction()[1];
+    this->direction_z[i] = ray.direction()[2];
+    this->time[i] = ray.time();
+  }
+
+  Color throughput(size_t i) const {
+    return {this->throughput_r[i], this->throughput_g[i], this->throughput_b[i]};
+  }
+
+  Color radiance(size_t i) const {
+    return {this->radiance_r[i], this->radiance_g[i], this->radiance_b[i]};
+  }
+
+  void add_radiance(size_t i, const Color& radiance) {
+    this->radiance_r[i] += radiance[0];
+    this->radiance_g[i] += radiance[1];
+    this->radiance_b[i] += radiance[2];
+  }
+
+private:
+  std::vector<std::vector<Real>*> buffers() {
+    return {
+      &this->origin_x, &this->origin_y, &this->origin_z,
+      &this->direction_x, &this->direction_y, &this->direction_z, &this->time,
+      &this->throughput_r, &this->throughput_g, &this->throughput_b,
+      &this->radiance_r, &this->radiance_g, &this->radiance_b, &this->bsdf_pdf,
+    };
+  }
+};
+
+// Wavefront path tracer (Laine et al. 2013): rather than following one path
+// to the end, a whole batch advances one bounce at a time through separate
+// stages, each a loop over a compacted queue of live paths:
+//   generate  camera rays from the caller
+//   sort      live rays by direction, so that consecutive rays traverse alike
+//   extend    closest hits, binning paths by the material they hit
+//   shade     misses, then one material type at a time, with the shadow
+//             rays of light sampling
+// Accumulating the radiance into pixels is left to the caller.
+// Random numbers are drawn per (path, bounce) exactly as in the camera's
+// path loop, including light sampling and Russian roulette after
+// roulette_depth bounces (max_depth or more turns it off).
+class WavefrontIntegrator {
+public:
+  WavefrontIntegrator(const Hittable& world, const MaterialTable& materials, const LightList& lights,
+                      int max_depth, int roulette_depth, bool sort_rays, WavefrontStatistics& stats) :
+    world(world), materials(materials), lights(lights), max_depth(max_depth),
+    roulette_depth(roulette_depth), sort_rays(sort_rays), stats(stats) {}
+
+  const PathStates& paths() const { return this->states; }
+
+  // Rays traced (path segments) over every trace call
+  std::uint64_t segments_traced() const { return this->segment_count; }
+
+  // Traces path_count paths. generate(path) returns a PathStart;
+  // background(ray) is the radiance of rays leaving the scene.
+  template <typename Generate, typename Background>
+  void trace(size_t path_count, Generate&& generate, Background&& background) {
+    {
+      StageTimer timer(this->stats, WavefrontStage::Generate, path_count);
+      this->states.clear();
+      this->active.clear();
+      for (size_t path = 0; path < path_count; path++) {
+        this->states.add(generate(path));
+        this->active.push_back((std::uint32_t)path);
+      }
+    }
+
+    for (int bounce = 0; bounce < this->max_depth && !this->active.empty(); bounce++) {
+      // Camera rays are coherent in generation order already
+      if (this->sort_rays && bounce > 0) this->sort_active();
+      this->extend(bounce);
+      this->shade(background, bounce);
+      std::swap(this->active, this->next);
+    }
+  }
+
+private:
+  static constexpr int material_type_count = (int)MaterialType::Count;
+
+  const Hittable& world;
+  const MaterialTable& materials;
+  const LightList& lights;
+  const int max_depth;
+  const int roulette_depth;
+  const bool sort_rays;
+  WavefrontStatistics& stats;
+
+  PathStates states;
+  std::vector<std::uint32_t> active;
+  std::vector<std::uint32_t> next;
+  std::vector<std::uint32_t> missed;
+  std::vector<std::uint32_t> shade_queues[material_type_count];
+  std::vector<std::uint64_t> sort_keys;
+  std::uint64_t segment_count = 0;
+
+  // Orders live paths by direction octant, then by a Morton code of the
+  // quantized direction. Ties keep their path order, so the result is
+  // deterministic.
+  void sort_active() {
+    StageTimer timer(this->stats, WavefrontStage::Sort, this->active.size());
+    this->sort_keys.clear();
+    for (const std::uint32_t path : this->active) {
+      const Real d[3] = { this->states.direction_x[path], this->states.direction_y[path], this->states.direction_z[path] };
+      const Real length = std::sqrt(d[0] * d[0] + d[1] * d[1] + d[2] * d[2]);
+      std::uint32_t key = 0;
+      for (int axis = 0; axis < 3; axis++) {
+        key |= (d[axis] < 0 ? 1u : 0u) << (24 + axis);
+        const std::uint32_t cell = (std::uint32_t)std::clamp((d[axis] / length + 1) * 128, (Real)0, (Real)255);
+        for (int bit = 0; bit < 8; bit++) {
+          key |= ((cell >> bit) & 1u) << (3 * bit + axis);
+        }
+      }
+      this->sort_keys.push_back(((std::uint64_t)key << 32) | path);
+    }
+    std::sort(this->sort_keys.begin(), this->sort_keys.end());
+    for (size_t i = 0; i < this->sort_keys.size(); i++) {
+      this->active[i] = (std::uint32_t)this->sort_keys[i];
+    }
+  }
+
+  void extend(int bounce) {
+    StageTimer timer(this->stats, WavefrontStage::Extend, this->active.size());
+    this->segment_count += this->active.size();
+    Statistics::count(bounce == 0 ? Statistics::Counter::PrimaryRays : Statistics::Counter::SecondaryRays,
+                      this->active.size());
+    this->missed.clear();
+    for (std::vector<std::uint32_t>& queue : this->shade_queues) queue.clear();
+
+    for (const std::uint32_t path : this->active) {
+      // Dimension 0 is the camera sample, bounce n draws from dimension n + 1
+      this->states.samplers[path].start_dimension((std::uint32_t)(bounce + 1));
+      std::optional<HitRecord>& hit = this->states.hits[path];
+      hit = this->world.hit(this->states.ray(path), Interval(0, Constant::infinity));
+      if (hit.has_value()) {
+        this->shade_queues[(int)this->materials.type(hit->material)].push_back(path);
+      } else {
+        this->missed.push_back(path);
+      }
+    }
+    for (int type = 0; type < material_type_count; type++) {
+      Statistics::count_material_hit(type, this->shade_queues[type].size());
+    }
+  }
+
+  template <typename Background>
+  void shade(Background&& background, int bounce) {
+    StageTimer timer(this->stats, WavefrontStage::Shade, this->active.size());
+    this->next.clear();
+
+    for (const std::uint32_t path : this->missed) {
+      this->states.add_radiance(path, this->states.throughput(path) * background(this->states.ray(path)));
+    }
+
+    for (const std::vector<std::uint32_t>& queue : this->shade_queues) {
+      for (const std::uint32_t path : queue) {
+        const Ray ray = this->states.ray(path);
+        const HitRecord hit = this->states.hits[path].value();
+        this->states.hits[path].reset();
+        Sampler& sampler = this->states.samplers[path];
+        Color throughput = this->states.throughput(path);
+        this->states.add_radiance(path, throughput * emitted_radiance(this->materials, this->lights, ray, hit,
+                                                                      this->states.bsdf_pdf[path]));
+
+        const std::optional<ScatterRecord> scattered = this->materials.scatter(ray, hit, sampler);
+        // Absorbed, or out of bounces
+        if (!scattered.has_value() || bounce + 1 >= this->max_depth) continue;
+        const bool diffuse = this->materials.is_diffuse(hit.material);
+        if (diffuse && !this->lights.empty()) {
+          this->states.add_radiance(path, throughput * sample_direct_light(this->world, this->materials,
+                                                                           this->lights, ray, hit, sampler));
+        }
+        this->states.bsdf_pdf[path] = diffuse ? this->materials.pdf(hit, scattered->scattered.direction()) : 0;
+
+        throughput = throughput * scattered->attenuation;
+        if (!russian_roulette(throughput, bounce + 1, this->roulette_depth, sampler)) continue;
+        this->states.throughput_r[path] = throughput[0];
+        this->states.throughput_g[path] = throughput[1];
+        this->states.throughput_b[path] = throughput[2];
+        this->states.set_ray(path, scattered->scattered);
+        this->next.push_back(path);
+      }
+    }
+    // Paths that did not make it to the next bounce end with this ray
+    Statistics::count_path_length(bounce + 1, this->active.size() - this->next.size());
+  }
+};
@@ -0,0 +1,482 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#if defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#define RAYTRACER_SSE 1
+#endif
+#if defined(__AVX__)
+#define RAYTRACER_AVX 1
+#endif
+
+#include "bvh_node.h"
+#include "interval.h"
+#include "ray.h"
+#include "shared_array.h"
+#include "statistics.h"
+
+// Wide BVH node: Width children whose bounds are stored as SoA float lanes,
+// so one SIMD slab test checks all of them. A child slot is either an
+// interior node (count == 0, child = node index) or a leaf inlined into its
+// parent (count > 0, child = first primitive). Unused slots hold an empty box.
+template <int Width>
+struct alignas(32) WideBVHNode {
+  static_assert(Width == 4 || Width == 8, "Wide BVH nodes are 4 or 8 wide");
+  static constexpr int width = Width;
+
+  float min_x[Width], min_y[Width], min_z[Width];
+  float max_x[Width], max_y[Width], max_z[Width];
+  std::uint32_t child[Width];
+  std::uint16_t count[Width];
+
+  void clear() {
+    for (int i = 0; i < Width; i++) {
+      this->min_x[i] = this->min_y[i] = this->min_z[i] = std::numeric_limits<float>::infinity();
+      this->max_x[i] = this->max_y[i] = this->max_z[i] = -std::numeric_limits<float>::infinity();
+      this->child[i] = 0;
+      this->count[i] = 0;
+    }
+  }
+
+  void set_child_bounds(int i, const BVHNode& node) {
+    this->min_x[i] = node.bounds_min[0];
+    this->min_y[i] = node.bounds_min[1];
+    this->min_z[i] = node.bounds_min[2];
+    this->max_x[i] = node.bounds_max[0];
+    this->max_y[i] = node.bounds_max[1];
+    this->max_z[i] = node.bounds_max[2];
+  }
+};
+
+// Wide node of a motion BVH: every child's bounds at the start of its time
+// range and their change until its end, interpolated to the ray's time
+// before the same SIMD slab test. Children of a time split sit side by side
+// with their halves of the time range; a ray only enters those covering its
+// time. Unused slots cover no time at all.
+template <int Width>
+struct alignas(32) WideMotionBVHNode {
+  static_assert(Width == 4 || Width == 8, "Wide BVH nodes are 4 or 8 wide");
+  static constexpr int width = Width;
+
+  float min_x[Width], min_y[Width], min_z[Width];
+  float max_x[Width], max_y[Width], max_z[Width];
+  float delta_min_x[Width], delta_min_y[Width], delta_min_z[Width];
+  float delta_max_x[Width], delta_max_y[Width], delta_max_z[Width];
+  float time_begin[Width], time_end[Width], time_scale[Width];
+  std::uint32_t child[Width];
+  std::uint16_t count[Width];
+
+  void clear() {
+    for (int i = 0; i < Width; i++) {
+      this->min_x[i] = this->min_y[i] = this->min_z[i] = std::numeric_limits<float>::infinity();
+      this->max_x[i] = this->max_y[i] = this->max_z[i] = -std::numeric_limits<float>::infinity();
+      this->delta_min_x[i] = this->delta_min_y[i] = this->delta_min_z[i] = 0;
+      this->delta_max_x[i] = this->delta_max_y[i] = this->delta_max_z[i] = 0;
+      this->time_begin[i] = 1;
+      this->time_end[i] = 0;
+      this->time_scale[i] = 0;
+      this->child[i] = 0;
+      this->count[i] = 0;
+    }
+  }
+
+  void set_child_bounds(int i, const MotionBVHNode& node) {
+    float* mins[3] = { this->min_x, this->min_y, this->min_z };
+    float* maxs[3] = { this->max_x, this->max_y, this->max_z };
+    float* delta_mins[3] = { this->delta_min_x, this->delta_min_y, this->delta_min_z };
+    float* delta_maxs[3] = { this->delta_max_x, this->delta_max_y, this->delta_max_z };
+    for (int axis = 0; axis < 3; axis++) {
+      mins[axis][i] = node.bounds_min[0][axis];
+      maxs[axis][i] = node.bounds_max[0][axis];
+      delta_mins[axis][i] = node.bounds_min[1][axis] - node.bounds_min[0][axis];
+      delta_maxs[axis][i] = node.bounds_max[1][axis] - node.bounds_max[0][axis];
+    }
+    this->time_begin[i] = node.time_begin;
+    this->time_end[i] = node.time_end;
+    this->time_scale[i] = node.time_end > node.time_begin ? 1 / (node.time_end - node.time_begin) : 0;
+  }
+
+  // Writes the child boxes at time into boxes and returns the mask of the
+  // children whose time range covers it
+  unsigned at(float time, WideBVHNode<Width>& boxes) const {
+    unsigned mask = 0;
+    float u[Width];
+    for (int i = 0; i < Width; i++) {
+      const float fraction = (time - this->time_begin[i]) * this->time_scale[i];
+      u[i] = fraction < 0 ? 0 : fraction > 1 ? 1 : fraction;
+      if (this->time_begin[i] <= time && time <= this->time_end[i]) mask |= 1u << i;
+    }
+    for (int i = 0; i < Width; i++) {
+      boxes.min_x[i] = this->min_x[i] + u[i] * this->delta_min_x[i];
+      boxes.min_y[i] = this->min_y[i] + u[i] * this->delta_min_y[i];
+      boxes.min_z[i] = this->min_z[i] + u[i] * this->delta_min_z[i];
+      boxes.max_x[i] = this->max_x[i] + u[i] * this->delta_max_x[i];
+      boxes.max_y[i] = this->max_y[i] + u[i] * this->delta_max_y[i];
+      boxes.max_z[i] = this->max_z[i] + u[i] * this->delta_max_z[i];
+    }
+    return mask;
+  }
+};
+
+// A ray in the form the SIMD slab test wants: float origin and inverse
+// direction, plus the sign of each direction component
+struct WideRay {
+  float origin[3];
+  float inverse_direction[3];
+  bool negative[3];
+  float time;
+
+  explicit WideRay(const Ray& ray) : time((float)ray.time()) {
+    for (int axis = 0; axis < 3; axis++) {
+      this->origin[axis] = (float)ray.origin()[axis];
+      this->inverse_direction[axis] = (float)(1.0 / ray.direction()[axis]);
+      this->negative[axis] = this->inverse_direction[axis] < 0;
+    }
+  }
+};
+
+namespace WideBVH {
+  inline int lowest_bit(unsigned mask) {
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return (int)index;
+#else
+    return __builtin_ctz(mask);
+#endif
+  }
+
+  // Float rounding in the slab test could otherwise miss grazing hits on the
+  // conservative bounds; 1 + 2 * gamma(3) as in pbrt
+  constexpr float exit_scale = 1.0f + 2.0f * (3 * 0.5f * std::numeric_limits<float>::epsilon())
+                                          / (1 - 3 * 0.5f * std::numeric_limits<float>::epsilon());
+
+  // Portable slab test of all children. Returns a bit mask of hit children and
+  // writes their entry distances.
+  template <int Width>
+  inline unsigned intersect_scalar(const WideBVHNode<Width>& node, const WideRay& ray,
+                                   float t_min, float t_max, float* entry) {
+    const float* near[3] = {
+      ray.negative[0] ? node.max_x : node.min_x,
+      ray.negative[1] ? node.max_y : node.min_y,
+      ray.negative[2] ? node.max_z : node.min_z,
+    };
+    const float* far[3] = {
+      ray.negative[0] ? node.min_x : node.max_x,
+      ray.negative[1] ? node.min_y : node.max_y,
+      ray.negative[2] ? node.min_z : node.max_z,
+    };
+    unsigned mask = 0;
+    for (int i = 0; i < Width; i++) {
+      float t_enter = t_min, t_exit = t_max;
+      for (int axis = 0; axis < 3; axis++) {
+        // Written so that a NaN (0 * inf) leaves the running interval alone
+        const float t0 = (near[axis][i] - ray.origin[axis]) * ray.inverse_direction[axis];
+        const float t1 = (far[axis][i] - ray.origin[axis]) * ray.inverse_direction[axis];
+        t_enter = t0 > t_enter ? t0 : t_enter;
+        t_exit = t1 < t_exit ? t1 : t_exit;
+      }
+      entry[i] = t_enter;
+      if (t_enter <= t_exit * exit_scale) mask |= 1u << i;
+    }
+    return mask;
+  }
+
+  template <int Width>
+  inline unsigned intersect(const WideBVHNode<Width>& node, const WideRay& ray,
+                            float t_min, float t_max, float* entry) {
+    return intersect_scalar(node, ray, t_min, t_max, entry);
+  }
+
+#if RAYTRACER_SSE
+  template <>
+  inline unsigned intersect<4>(const WideBVHNode<4>& node, const WideRay& ray,
+                               float t_min, float t_max, float* entry) {
+    const __m128 t_enter_init = _mm_set1_ps(t_min);
+    const __m128 t_exit_init = _mm_set1_ps(t_max);
+    const float* bounds_min[3] = { node.min_x, node.min_y, node.min_z };
+    const float* bounds_max[3] = { node.max_x, node.max_y, node.max_z };
+
+    __m128 t_enter = t_enter_init, t_exit = t_exit_init;
+    for (int axis = 0; axis < 3; axis++) {
+      const __m128 origin = _mm_set1_ps(ray.origin[axis]);
+      const __m128 inverse = _mm_set1_ps(ray.inverse_direction[axis]);
+      const float* near = ray.negative[axis] ? bounds_max[axis] : bounds_min[axis];
+      const float* far = ray.negative[axis] ? bounds_min[axis] : bounds_max[axis];
+      const __m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(near), origin), inverse);
+      const __m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(far), origin), inverse);
+      // maxps/minps return the second operand when either is NaN
+      t_enter = _mm_max_ps(t0, t_enter);
+      t_exit = _mm_min_ps(t1, t_exit);
+    }
+    _mm_storeu_ps(entry, t_enter);
+    const __m128 hit = _mm_cmple_ps(t_enter, _mm_mul_ps(t_exit, _mm_set1_ps(exit_scale)));
+    return (unsigned)_mm_movemask_ps(hit);
+  }
+#endif
+
+#if RAYTRACER_AVX
+  template <>
+  inline unsigned intersect<8>(const WideBVHNode<8>& node, const WideRay& ray,
+                               float t_min, float t_max, float* entry) {
+    const float* bounds_min[3] = { node.min_x, node.min_y, node.min_z };
+    const float* bounds_max[3] = { node.max_x, node.max_y, node.max_z };
+
+    __m256 t_enter = _mm256_set1_ps(t_min), t_exit = _mm256_set1_ps(t_max);
+    for (int axis = 0; axis < 3; axis++) {
+      const __m256 origin = _mm256_set1_ps(ray.origin[axis]);
+      const __m256 inverse = _mm256_set1_ps(ray.inverse_direction[axis]);
+      const float* near = ray.negative[axis] ? bounds_max[axis] : bounds_min[axis];
+      const float* far = ray.negative[axis] ? bounds_min[axis] : bounds_max[axis];
+      const __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(near), origin), inverse);
+      const __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(far), origin), inverse);
+      t_enter = _mm256_max_ps(t0, t_enter);
+      t_exit = _mm256_min_ps(t1, t_exit);
+    }
+    _mm256_storeu_ps(entry, t_enter);
+    const __m256 hit = _mm256_cmp_ps(t_enter, _mm256_mul_ps(t_exit, _mm256_set1_ps(exit_scale)), _CMP_LE_OQ);
+    return (unsigned)_mm256_movemask_ps(hit);
+  }
+#endif
+
+  // Motion nodes: the same test on the child boxes at the ray's time, for
+  // the children whose time range covers it
+  template <int Width>
+  inline unsigned intersect_scalar(const WideMotionBVHNode<Width>& node, const WideRay& ray,
+                                   float t_min, float t_max, float* entry) {
+    alignas(32) WideBVHNode<Width> boxes;
+    const unsigned covered = node.at(ray.time, boxes);
+    return WideBVH::intersect_scalar(boxes, ray, t_min, t_max, entry) & covered;
+  }
+
+  template <int Width>
+  inline unsigned intersect(const WideMotionBVHNode<Width>& node, const WideRay& ray,
+                            float t_min, float t_max, float* entry) {
+    return intersect_scalar(node, ray, t_min, t_max, entry);
+  }
+
+#if RAYTRACER_SSE
+  // Interpolates in registers, straight into the slab test
+  template <>
+  inline unsigned intersect<4>(const WideMotionBVHNode<4>& node, const WideRay& ray,
+                               float t_min, float t_max, float* entry) {
+    const __m128 time = _mm_set1_ps(ray.time);
+    const __m128 time_begin = _mm_load_ps(node.time_begin);
+    const __m128 covered = _mm_and_ps(_mm_cmple_ps(time_begin, time), _mm_cmple_ps(time, _mm_load_ps(node.time_end)));
+    const __m128 u = _mm_min_ps(_mm_max_ps(
+      _mm_mul_ps(_mm_sub_ps(time, time_begin), _mm_load_ps(node.time_scale)), _mm_setzero_ps()), _mm_set1_ps(1));
+    const float* bounds_min[3] = { node.min_x, node.min_y, node.min_z };
+    const float* bounds_max[3] = { node.max_x, node.max_y, node.max_z };
+    const float* delta_min[3] = { node.delta_min_x, node.delta_min_y, node.delta_min_z };
+    const float* delta_max[3] = { node.delta_max_x, node.delta_max_y, node.delta_max_z };
+
+    __m128 t_enter = _mm_set1_ps(t_min), t_exit = _mm_set1_ps(t_max);
+    for (int axis = 0; axis < 3; axis++) {
+      const __m128 origin = _mm_set1_ps(ray.origin[axis]);
+      const __m128 inverse = _mm_set1_ps(ray.inverse_direction[axis]);
+      const __m128 low = _mm_add_ps(_mm_load_ps(bounds_min[axis]), _mm_mul_ps(u, _mm_load_ps(delta_min[axis])));
+      const __m128 high = _mm_add_ps(_mm_load_ps(bounds_max[axis]), _mm_mul_ps(u, _mm_load_ps(delta_max[axis])));
+      const __m128 near = ray.negative[axis] ? high : low;
+      const __m128 far = ray.negative[axis] ? low : high;
+      const __m128 t0 = _mm_mul_ps(_mm_sub_ps(near, origin), inverse);
+      const __m128 t1 = _mm_mul_ps(_mm_sub_ps(far, origin), inverse);
+      t_enter = _mm_max_ps(t0, t_enter);
+      t_exit = _mm_min_ps(t1, t_exit);
+    }
+    _mm_storeu_ps(entry, t_enter);
+    const __m128 hit = _mm_cmple_ps(t_enter, _mm_mul_ps(t_exit, _mm_set1_ps(exit_scale)));
+    return (unsigned)_mm_movemask_ps(_mm_and_ps(hit, covered));
+  }
+#endif
+
+#if RAYTRACER_AVX
+  template <>
+  inline unsigned intersect<8>(const WideMotionBVHNode<8>& node, const WideRay& ray,
+                               float t_min, float t_max, float* entry) {
+    const __m256 time = _mm256_set1_ps(ray.time);
+    const __m256 time_begin = _mm256_load_ps(node.time_begin);
+    const __m256 covered = _mm256_and_ps(_mm256_cmp_ps(time_begin, time, _CMP_LE_OQ),
+                                         _mm256_cmp_ps(time, _mm256_load_ps(node.time_end), _CMP_LE_OQ));
+    const __m256 u = _mm256_min_ps(_mm256_max_ps(
+      _mm256_mul_ps(_mm256_sub_ps(time, time_begin), _mm256_load_ps(node.time_scale)), _mm256_setzero_ps()),
+      _mm256_set1_ps(1));
+    const float* bounds_min[3] = { node.min_x, node.min_y, node.min_z };
+    const float* bounds_max[3] = { node.max_x, node.max_y, node.max_z };
+    const float* delta_min[3] = { node.delta_min_x, node.delta_min_y, node.delta_min_z };
+    const float* delta_max[3] = { node.delta_max_x, node.delta_max_y, node.delta_max_z };
+
+    __m256 t_enter = _mm256_set1_ps(t_min), t_exit = _mm256_set1_ps(t_max);
+    for (int axis = 0; axis < 3; axis++) {
+      const __m256 origin = _mm256_set1_ps(ray.origin[axis]);
+      const __m256 inverse = _mm256_set1_ps(ray.inverse_direction[axis]);
+      const __m256 low = _mm256_add_ps(_mm256_load_ps(bounds_min[axis]),
+                                       _mm256_mul_ps(u, _mm256_load_ps(delta_min[axis])));
+      const __m256 high = _mm256_add_ps(_mm256_load_ps(bounds_max[axis]),
+                                        _mm256_mul_ps(u, _mm256_load_ps(delta_max[axis])));
+      const __m256 near = ray.negative[axis] ? high : low;
+      const __m256 far = ray.negative[axis] ? low : high;
+      const __m256 t0 = _mm256_mul_ps(_mm256_sub_ps(near, origin), inverse);
+      const __m256 t1 = _mm256_mul_ps(_mm256_sub_ps(far, origin), inverse);
+      t_enter = _mm256_max_ps(t0, t_enter);
+      t_exit = _mm256_min_ps(t1, t_exit);
+    }
+    _mm256_storeu_ps(entry, t_enter);
+    const __m256 hit = _mm256_cmp_ps(t_enter, _mm256_mul_ps(t_exit, _mm256_set1_ps(exit_scale)), _CMP_LE_OQ);
+    return (unsigned)_mm256_movemask_ps(_mm256_and_ps(hit, covered));
+  }
+#endif
+
+  // Entry of collapse's sources for an unused slot
+  constexpr std::uint32_t no_source = std::numeric_limits<std::uint32_t>::max();
+
+  // Collapses a binary BVH (of BVHNode or MotionBVHNode) into WideNodes:
+  // every wide node adopts the grandchildren of its largest interior children
+  // until all slots are used. Time splits are opened like any other node.
+  // sources, if given, receives for every slot (wide index * Width + slot)
+  // the binary node whose bounds it copied, or no_source, so that a refit
+  // can copy them again.
+  template <typename WideNode, typename BinaryNode>
+  inline std::vector<WideNode> collapse(const std::vector<BinaryNode>& binary,
+                                        std::vector<std::uint32_t>* sources = nullptr) {
+    constexpr int Width = WideNode::width;
+    std::vector<WideNode> wide;
+    if (sources) sources->clear();
+    if (binary.empty()) return wide;
+    wide.reserve(binary.size() / (Width - 1) + 1);
+
+    struct Pending {
+      std::uint32_t binary_index;
+      std::uint32_t wide_index;
+    };
+    std::vector<Pending> pending;
+
+    const auto add_node = [&](std::uint32_t binary_index) {
+      const std::uint32_t wide_index = (std::uint32_t)wide.size();
+      wide.emplace_back();
+      wide.back().clear();
+      if (sources) sources->insert(sources->end(), Width, no_source);
+      pending.push_back({binary_index, wide_index});
+      return wide_index;
+    };
+
+    // A binary leaf at the root still needs a wide node holding it
+    const std::uint32_t root = add_node(0);
+    if (binary[0].is_leaf()) {
+      pending.clear();
+      wide[root].set_child_bounds(0, binary[0]);
+      if (sources) (*sources)[0] = 0;
+      wide[root].child[0] = binary[0].offset;
+      wide[root].count[0] = binary[0].count;
+      return wide;
+    }
+
+    while (!pending.empty()) {
+      const Pending current = pending.back();
+      pending.pop_back();
+
+      const BinaryNode& parent = binary[current.binary_index];
+      std::uint32_t slots[Width] = { current.binary_index + 1, parent.offset };
+      int used = 2;
+      while (used < Width) {
+        int largest = -1;
+        double largest_area = -1;
+        for (int i = 0; i < used; i++) {
+          const BinaryNode& node = binary[slots[i]];
+          const double area = node.bounding_box().surface_area();
+          if (!node.is_leaf() && area > largest_area) {
+            largest = i;
+            largest_area = area;
+          }
+        }
+        if (largest < 0) break;
+        const BinaryNode& opened = binary[slots[largest]];
+        slots[used++] = opened.offset;
+        slots[largest] = slots[largest] + 1;
+      }
+
+      for (int i = 0; i < used; i++) {
+        const BinaryNode& node = binary[slots[i]];
+        std::uint32_t child;
+        std::uint16_t count;
+        if (node.is_leaf()) {
+          child = node.offset;
+          count = node.count;
+        } else {
+          child = add_node(slots[i]);
+          count = 0;
+        }
+        // Reference taken after add_node, which may reallocate
+        WideNode& target = wide[current.wide_index];
+        target.set_child_bounds(i, node);
+        target.child[i] = child;
+        target.count[i] = count;
+        if (sources) (*sources)[(size_t)current.wide_index * Width + i] = slots[i];
+      }
+    }
+    return wide;
+  }
+
+  // Ordered closest-hit traversal with the same contract as
+  // BVHTree::traverse_leaves. With AnyHit it returns at the first leaf that
+  // reports a hit instead. Works on WideBVHNodes and WideMotionBVHNodes.
+  template <bool AnyHit = false, typename WideNode, typename IntersectLeaf>
+  inline bool traverse(const SharedArray<WideNode>& nodes, const Ray& ray,
+                       Interval ray_t, IntersectLeaf&& intersect_leaf) {
+    constexpr int Width = WideNode::width;
+    if (nodes.empty()) return false;
+
+    struct Entry {
+      std::uint32_t child;
+      std::uint32_t count;
+      float entry;
+    };
+    Entry stack[64 * Width];
+    int stack_size = 0;
+    stack[stack_size++] = Entry{0, 0, -std::numeric_limits<float>::infinity()};
+
+    const WideRay wide_ray(ray);
+    bool hit_anything = false;
+    Statistics::TraversalTally tally;
+
+    while (stack_size > 0) {
+      const Entry current = stack[--stack_size];
+      if (current.entry > ray_t.max) continue; // A closer hit was found meanwhile
+
+      if (current.count > 0) {
+        const bool hit_leaf = intersect_leaf(current.child, current.count, ray_t);
+        if (AnyHit && hit_leaf) return true;
+        hit_anything |= hit_leaf;
+        continue;
+      }
+
+      const WideNode& node = nodes[current.child];
+      // All Width child boxes are tested at once, padding lanes included
+      tally.visit(Width);
+      alignas(32) float entry[Width];
+      unsigned mask = WideBVH::intersect(node, wide_ray, (float)ray_t.min, (float)ray_t.max, entry);
+
+      // Push hit children far to near, so the nearest is popped first
+      const int first = stack_size;
+      while (mask) {
+        const int i = WideBVH::lowest_bit(mask);
+        mask &= mask - 1;
+        Entry pushed{node.child[i], node.count[i], entry[i]};
+        int j = stack_size++;
+        while (j > first && stack[j - 1].entry < pushed.entry) {
+          stack[j] = stack[j - 1];
+          j--;
+        }
+        stack[j] = pushed;
+      }
+    }
+    return hit_anything;
+  }
+}
@@ -1,84 +1,364 @@
-#include <cmath>
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
 #include <iostream>
 #include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
 
+#include "bvh.h"
 #include "camera.h"
 #include "hittable_list.h"
-#include "sphere.h"
-#include "util.h"
+#include "instance.h"
+#include "render_cluster.h"
+#include "scene_file.h"
+#include "scenes.h"
+#include "socket.h"
+#include "sphere_set.h"
+#include "triangle_mesh.h"
 #include "version.h"
-#include "bvh_node.h"
 
-int main() {
+// Everything but the spheres' BVH, which the caller builds or maps
+HittableList build_world(Scene& scene, const std::shared_ptr<SphereBVH>& bvh) {
+  // The spheres' BVH, every mesh with its own BVH, and the instances all go
+  // under one BVH over their boxes, so that a ray only visits the objects
+  // whose box it crosses
+  HittableList objects;
+  if (bvh) objects.add(bvh);
+  for (SceneMesh& mesh : scene.meshes) {
+    objects.add(std::make_shared<TriangleMesh>(std::move(mesh.triangles), mesh.material));
+  }
+  // Models build their BVH once and are shared by their instances (which
+  // always set the material)
+  std::vector<std::shared_ptr<const Hittable>> models;
+  if (!scene.instances.empty()) {
+    for (TriangleSet& model : scene.models) {
+      models.push_back(std::make_shared<TriangleMesh>(std::move(model), 0));
+    }
+  }
+  for (const SceneInstance& instance : scene.instances) {
+    objects.add(std::make_shared<Instance>(models[instance.model], instance.transform, instance.material));
+  }
+
+  HittableList world;
+  if (!objects.objects.empty()) world.add(std::make_shared<BVH>(std::move(objects)));
+  return world;
+}
+
+// pattern with frame written in place of its %d, which may be padded as in
+// %04d, or else before its extension
+std::string frame_path(const std::string& pattern, int frame) {
+  const size_t percent = pattern.find('%');
+  size_t end = percent;
+  int width = 0;
+  if (percent != std::string::npos) {
+    end = percent + 1;
+    while (end < pattern.size() && '0' <= pattern[end] && pattern[end] <= '9') {
+      width = 10 * width + (pattern[end++] - '0');
+    }
+  }
+  if (percent == std::string::npos || end >= pattern.size() || pattern[end] != 'd') {
+    const size_t dot = pattern.rfind('.');
+    const size_t slash = pattern.find_last_of("/\\");
+    const size_t at = dot == std::string::npos || (slash != std::string::npos && dot < slash) ? pattern.size() : dot;
+    return frame_path(pattern.substr(0, at) + "_%04d" + pattern.substr(at), frame);
+  }
+  std::string number = std::to_string(frame);
+  if ((int)number.size() < width) number.insert(0, width - number.size(), '0');
+  return pattern.substr(0, percent) + number + pattern.substr(end + 1);
+}
+
+// Renders frames first to last of an animation, one scene file per frame.
+// The spheres' BVH is refitted to each frame's spheres rather than built
+// again, and the render threads and image buffer stay alive throughout.
+int render_frames(const std::string& scene_pattern, int first, int last, const std::string& output_pattern,
+                  unsigned threads) {
+  using Clock = std::chrono::steady_clock;
+  const auto milliseconds_since = [](Clock::time_point time) {
+    return std::chrono::duration<double, std::milli>(Clock::now() - time).count();
+  };
+
+  const std::shared_ptr<RenderContext> context = std::make_shared<RenderContext>(threads);
+  std::shared_ptr<SphereBVH> bvh;
+  for (int frame = first; frame <= last; frame++) {
+    const Clock::time_point start = Clock::now();
+    std::optional<Scene> loaded = SceneFile::load(frame_path(scene_pattern, frame), context->thread_pool());
+    if (!loaded.has_value()) return 1;
+    Scene& scene = loaded.value();
+    const double load_ms = milliseconds_since(start);
+
+    const Clock::time_point update_start = Clock::now();
+    bool rebuilt = true;
+    if (scene.spheres.size() == 0) {
+      bvh.reset();
+    } else if (bvh) {
+      rebuilt = bvh->update(std::move(scene.spheres), context->thread_pool());
+    } else {
+      bvh = std::make_shared<SphereBVH>(std::move(scene.spheres));
+    }
+    const double update_ms = milliseconds_since(update_start);
+    HittableList world = build_world(scene, bvh);
+
+    Camera& camera = scene.camera;
+    camera.context = context;
+    camera.output_path = frame_path(output_pattern.empty() ? camera.output_path : output_pattern, frame);
+    std::clog << "[LOG] Frame " << frame << ": loaded in " << load_ms << " ms, BVH "
+              << (rebuilt ? "built" : "refitted") << " in " << update_ms << " ms, "
+              << milliseconds_since(start) << " ms before tracing" << std::endl;
+    if (!camera.render(world, scene.materials, scene.lights)) return 1;
+  }
+  return 0;
+}
+
+// Renders the scene file on the workers that connect to address, starting
+// local_workers of them on this host, which share its hardware threads
+int render_distributed(const std::string& program, const std::string& scene_path, const std::string& address,
+                       const std::string& output_path, int local_workers, const RenderCluster::Settings& settings) {
+  std::string host;
+  std::uint16_t port;
+  if (!Socket::parse_address(address, host, port)) {
+    std::cerr << "[ERROR] Cannot read address " << address << std::endl;
+    return 1;
+  }
+  const std::optional<std::uint64_t> scene_hash = SceneFile::content_hash(scene_path);
+  if (!scene_hash.has_value()) return 1;
+  // The workers trace the spheres; the coordinator only needs the camera
+  std::optional<Scene> scene = SceneFile::load(scene_path, 0, false);
+  if (!scene.has_value()) return 1;
+  Camera& camera = scene->camera;
+  if (!output_path.empty()) camera.output_path = output_path;
+
+  std::optional<Socket> listener = Socket::listen(host, port);
+  if (!listener.has_value()) return 1;
+  const unsigned threads = std::max(ThreadPool::hardware_threads() / std::max(local_workers, 1), 1u);
+  const std::string worker_address =
+      (host == "0.0.0.0" || host == "::" ? "localhost" : host) + ":" + std::to_string(listener->port());
+  RenderCluster::LocalWorkers workers(
+      {program, scene_path, "--worker", worker_address, "--threads", std::to_string(threads)}, local_workers);
+  // A local worker that timed out may hang on a core the others could use
+  RenderCluster::Settings cluster_settings = settings;
+  cluster_settings.dropped = [&workers](std::uint32_t process) { workers.stop(process); };
+  const bool rendered = RenderCluster::coordinate(camera, scene_hash.value(), listener.value(), cluster_settings);
+  // Workers not accepted yet then fail instead of waiting, and the others
+  // are stopped as workers goes out of scope
+  listener.reset();
+  return rendered ? 0 : 1;
+}
+
+// Usage: raytracer [scene file] [--output image] [--convert binary scene]
+//                  [--bvh-cache file] [--frames first-last] [--threads n]
+//                  [--coordinator [host:]port [--local-workers n]
+//                   [--worker-timeout seconds]] [--worker host:port]
+//                  [--statistics file] [--checkpoint file [--checkpoint-interval seconds]]
+//                  [--time-budget seconds]
+// Without a scene file, renders the built-in scene. --convert writes the
+// scene file in the binary format instead of rendering. --bvh-cache maps the
+// scene's BVH from file if it was built from the same scene file, and
+// otherwise builds it and saves it there. --frames renders an animation
+// whose frames are the scene files named by the scene file path with the
+// frame number in place of its %d (e.g. frames/%04d.rtsb), into images
+// named likewise after the output path, or with the frame number before its
+// extension if it has no %d. The BVH of the spheres is refitted between
+// frames, and rebuilt once that makes it much slower to trace.
+// --coordinator splits the image between the processes started with
+// --worker and the same scene file (see render_cluster.h), listening on
+// this host only unless given another, e.g. 0.0.0.0:7000; port 0 picks a
+// free one, which suits --local-workers, workers it starts itself.
+// --statistics writes the counters of a build configured with
+// RAYTRACER_STATISTICS as JSON after a render in one process.
+// --checkpoint and --time-budget render progressively (see Camera::progressive):
+// the samples so far are saved to the checkpoint every checkpoint interval
+// (60 s by default), on SIGTERM or SIGINT and at the end, and a later run
+// with the same scene and settings resumes from it. A time budget stops the
+// render once spent and writes the image as it stands.
+int main(int argc, char* argv[]) {
   std::clog << "Raytracer Version " 
             << RAYTRACER_VERSION_MAJOR << "." << RAYTRACER_VERSION_MINOR 
             << std::endl;
 
-  // World
-  HittableList world;
+  std::string scene_path, output_path, convert_path, cache_path, coordinator_address, worker_address;
+  std::string statistics_path, checkpoint_path;
+  double checkpoint_interval = 0, time_budget = 0;
+  std::optional<std::pair<int, int>> frames;
+  int threads = 0, local_workers = 0;
+  RenderCluster::Settings cluster_settings;
+  for (int i = 1; i < argc; i++) {
+    const std::string argument = argv[i];
+    int first, last;
+    char rest;
+    if (argument == "--frames" && i + 1 < argc &&
+        std::sscanf(argv[i + 1], "%d-%d%c", &first, &last, &rest) == 2 && first <= last) {
+      frames = std::make_pair(first, last);
+      i++;
+    } else if (argument == "--output" && i + 1 < argc) {
+      output_path = argv[++i];
+    } else if (argument == "--convert" && i + 1 < argc) {
+      convert_path = argv[++i];
+    } else if (argument == "--bvh-cache" && i + 1 < argc) {
+      cache_path = argv[++i];
+    } else if (argument == "--threads" && i + 1 < argc && std::sscanf(argv[i + 1], "%d%c", &threads, &rest) == 1 &&
+               threads > 0) {
+      i++;
+    } else if (argument == "--coordinator" && i + 1 < argc) {
+      coordinator_address = argv[++i];
+    } else if (argument == "--local-workers" && i + 1 < argc &&
+               std::sscanf(argv[i + 1], "%d%c", &local_workers, &rest) == 1 && local_workers >= 0) {
+      i++;
+    } else if (argument == "--worker-timeout" && i + 1 < argc &&
+               std::sscanf(argv[i + 1], "%lf%c", &cluster_settings.worker_timeout, &rest) == 1 &&
+               cluster_settings.worker_timeout > 0) {
+      i++;
+    } else if (argument == "--worker" && i + 1 < argc) {
+      worker_address = argv[++i];
+    } else if (argument == "--statistics" && i + 1 < argc) {
+      statistics_path = argv[++i];
+    } else if (argument == "--checkpoint" && i + 1 < argc) {
+      checkpoint_path = argv[++i];
+    } else if (argument == "--checkpoint-interval" && i + 1 < argc &&
+               std::sscanf(argv[i + 1], "%lf%c", &checkpoint_interval, &rest) == 1 && checkpoint_interval > 0) {
+      i++;
+    } else if (argument == "--time-budget" && i + 1 < argc &&
+               std::sscanf(argv[i + 1], "%lf%c", &time_budget, &rest) == 1 && time_budget > 0) {
+      i++;
+    } else if (argument[0] != '-' && scene_path.empty()) {
+      scene_path = argument;
+    } else {
+      std::cerr << "Usage: " << argv[0] << " [scene file] [--output image] [--convert binary scene]"
+                << " [--bvh-cache file] [--frames first-last] [--threads n]"
+                << " [--coordinator [host:]port [--local-workers n] [--worker-timeout seconds]]"
+                << " [--worker host:port] [--statistics file]"
+                << " [--checkpoint file [--checkpoint-interval seconds]] [--time-budget seconds]" << std::endl;
+      return 1;
+    }
+  }
+  const bool distributed = !coordinator_address.empty() || !worker_address.empty();
+  if (scene_path.empty() && (!convert_path.empty() || !cache_path.empty() || frames.has_value() || distributed)) {
+    std::cerr << "[ERROR] --convert, --bvh-cache, --frames, --coordinator and --worker need a scene file"
+              << std::endl;
+    return 1;
+  }
+  if (!statistics_path.empty() && !Statistics::enabled) {
+    std::cerr << "[ERROR] --statistics needs a build configured with RAYTRACER_STATISTICS" << std::endl;
+    return 1;
+  }
+  if (!statistics_path.empty() && (frames.has_value() || distributed || !convert_path.empty())) {
+    std::cerr << "[ERROR] --statistics covers one render in one process, without --frames, --coordinator,"
+              << " --worker or --convert" << std::endl;
+    return 1;
+  }
+  const bool progressive = !checkpoint_path.empty() || time_budget > 0;
+  if (checkpoint_interval > 0 && checkpoint_path.empty()) {
+    std::cerr << "[ERROR] --checkpoint-interval needs --checkpoint" << std::endl;
+    return 1;
+  }
+  if (progressive && (frames.has_value() || distributed || !convert_path.empty())) {
+    std::cerr << "[ERROR] --checkpoint and --time-budget cover one render in one process, without --frames,"
+              << " --coordinator, --worker or --convert" << std::endl;
+    return 1;
+  }
+  if (frames.has_value()) {
+    if (!convert_path.empty() || !cache_path.empty() || distributed) {
+      std::cerr << "[ERROR] --frames renders every frame's own scene file, without --convert, --bvh-cache,"
+                << " --coordinator or --worker" << std::endl;
+      return 1;
+    }
+    return render_frames(scene_path, frames->first, frames->second, output_path, (unsigned)threads);
+  }
+  if (distributed && (!convert_path.empty() || (!coordinator_address.empty() && !worker_address.empty()))) {
+    std::cerr << "[ERROR] A process is either the coordinator or a worker, and renders" << std::endl;
+    return 1;
+  }
+  if (!coordinator_address.empty()) {
+    return render_distributed(argv[0], scene_path, coordinator_address, output_path, local_workers,
+                              cluster_settings);
+  }
 
-  // Material
-  const auto material_ground = std::make_shared<Lambertian>(Color(0.5, 0.5, 0.5));
-  world.add(std::make_shared<Sphere>(Point3(0.0, -1000.0, -0.0), 1000.0, material_ground));
-
-  for (int a = -11; a < 11; a++) {
-    for (int b = -11; b < 11; b++) {
-      const double choose_material = Utility::random_double();
-      const Point3 center { 
-          a + 0.9 * Utility::random_double(), 
-          0.2,
-          b + 0.9 * Utility::random_double() 
-      };
-      
-      if ((center - Point3 {4, 0.2, 0}).length() > 0.9) {
-        std::shared_ptr<Material> sphere_material;
-        
-        if (choose_material < 0.8) {
-          // Lambertian
-          const Color albedo = Color::random() * Color::random();
-          sphere_material = std::make_shared<Lambertian>(albedo);
-          const Point3 center2 = center + Vect3{ 0, Utility::random_double(0, 0.5), 0 };
-          world.add(std::make_shared<Sphere>(center, center2, 0.2, sphere_material));
-        } else if (choose_material < 0.95) {
-          // Metal
-          const Color albedo = Color::random(0.5, 1);
-          const double fuzz = Utility::random_double(0, 0.5);
-          sphere_material = std::make_shared<Metal>(albedo, fuzz);
-          world.add(std::make_shared<Sphere>(center, 0.2, sphere_material));
-        } else {
-          sphere_material = std::make_shared<Dielectric>(1.5);
-          world.add(std::make_shared<Sphere>(center, 0.2, sphere_material));
-        }
-      }
+  // Workers connect before loading, so that the coordinator knows they are
+  // coming however long the scene takes
+  std::optional<Socket> coordinator;
+  if (!worker_address.empty()) {
+    std::string host;
+    std::uint16_t port;
+    if (!Socket::parse_address(worker_address, host, port)) {
+      std::cerr << "[ERROR] Cannot read address " << worker_address << std::endl;
+      return 1;
     }
+    coordinator = Socket::connect(host, port);
+    if (!coordinator.has_value()) return 1;
   }
 
-  auto material1 = std::make_shared<Dielectric>(1.5);
-  world.add(std::make_shared<Sphere>(Point3(0, 1, 0), 1.0, material1));
+  // A cache built from this very scene file spares loading its spheres
+  std::shared_ptr<SphereBVH> bvh;
+  std::uint64_t cache_key = 0;
+  std::optional<std::uint64_t> scene_hash;
+  if ((!cache_path.empty() && convert_path.empty()) || coordinator.has_value()) {
+    scene_hash = SceneFile::content_hash(scene_path);
+    if (!scene_hash.has_value()) return 1;
+  }
+  if (!cache_path.empty() && convert_path.empty()) {
+    cache_key = SphereBVH::cache_key(scene_hash.value());
+    bvh = SphereBVH::load_cache(cache_path, cache_key);
+    if (!bvh) std::clog << "[LOG] No up-to-date BVH cache at " << cache_path << std::endl;
+  }
 
-  auto material2 = std::make_shared<Lambertian>(Color{0.4, 0.2, 0.1});
-  world.add(std::make_shared<Sphere>(Point3(-4, 1, 0), 1.0, material2));
+  // World
+  Scene scene;
+  Camera& camera = scene.camera;
+  if (scene_path.empty()) {
+    Scenes::random_spheres(scene.materials, scene.spheres);
+    // No emitters: the sky lights the scene
 
-  auto material3 = std::make_shared<Metal>(Color{0.7, 0.6, 0.5}, 0.0);
-  world.add(std::make_shared<Sphere>(Point3(4, 1, 0), 1.0, material3));
+    camera.samples_per_pixel = 100;  
+    camera.max_ray_depth = 20;
+    camera.image_width = 800;
+    camera.look_from    = { 13, 2, 3 };
+    camera.look_at      = {  0, 0, 0 };
+    camera.v_up         = {  0, 1, 0 };
+    camera.vertical_fov = 20;
 
-  world = HittableList(std::make_shared<BVHNode>(world));
+    camera.defocus_angle = 0.6;
+    camera.focus_distance = 10.0;
+  } else {
+    std::optional<Scene> loaded = SceneFile::load(scene_path, (unsigned)threads, !bvh);
+    if (!loaded.has_value()) return 1;
+    scene = std::move(loaded.value());
+  }
 
-  // Camera
-  Camera camera;
-  camera.samples_per_pixel = 100;  
-  camera.max_ray_depth = 20;
-  camera.image_width = 800;
-  camera.look_from    = { 13, 2, 3 };
-  camera.look_at      = {  0, 0, 0 };
-  camera.v_up         = {  0, 1, 0 };
-  camera.vertical_fov = 20;
+  if (!convert_path.empty()) {
+    return SceneFile::write_binary(convert_path, scene) ? 0 : 1;
+  }
+  if (!output_path.empty()) camera.output_path = output_path;
+  if (threads > 0) camera.thread_count = threads;
+  if (!statistics_path.empty()) camera.statistics_path = statistics_path;
+  if (progressive) {
+    camera.progressive = true;
+    camera.checkpoint_path = checkpoint_path;
+    if (checkpoint_interval > 0) camera.checkpoint_interval = checkpoint_interval;
+    camera.time_budget = time_budget;
+  }
+  // Checkpoints only resume the scene they were taken of
+  if (camera.progressive && !camera.checkpoint_path.empty()) {
+    if (!scene_path.empty() && !scene_hash.has_value()) scene_hash = SceneFile::content_hash(scene_path);
+    if (!scene_path.empty() && !scene_hash.has_value()) return 1;
+    camera.scene_hash = SceneFile::geometry_hash(scene, scene_hash.value_or(0));
+  }
 
-  camera.defocus_angle = 0.6;
-  camera.focus_distance = 10.0;
+  if (bvh) {
+    // Validated when the cache was saved
+    SceneFile::add_lights(bvh->sphere_arrays(), scene.materials, scene.lights);
+  } else if (scene.spheres.size() > 0) {
+    bvh = std::make_shared<SphereBVH>(std::move(scene.spheres));
+    if (!cache_path.empty()) bvh->save_cache(cache_path, cache_key);
+  }
+  HittableList world = build_world(scene, bvh);
 
   // Render
-  camera.render(world);
-
-  return 0;
+  if (coordinator.has_value()) {
+    return RenderCluster::work(camera, world, scene.materials, scene.lights, scene_hash.value(), coordinator.value(),
+                               (unsigned)threads) ? 0 : 1;
+  }
+  return camera.render(world, scene.materials, scene.lights) ? 0 : 1;
 }
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <iostream>
+#include <string>
+
+// Minimal assertions for the test executables: a failed check is reported
+// to cerr and turns the exit status of the test into a failure, without
+// stopping at the first one
+namespace Check {
+  inline int failures = 0;
+
+  inline bool expect(bool condition, const std::string& what) {
+    if (!condition) {
+      failures++;
+      std::cerr << "[ERROR] " << what << std::endl;
+    }
+    return condition;
+  }
+
+  // Exit status of the test
+  inline int result(const std::string& name) {
+    if (failures > 0) {
+      std::cerr << "[ERROR] " << name << ": " << failures << " checks failed" << std::endl;
+      return 1;
+    }
+    std::clog << "[LOG] " << name << ": passed" << std::endl;
+    return 0;
+  }
+}
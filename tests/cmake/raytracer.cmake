@@ -0,0 +1,34 @@
+# Shared by the tests/*.cmake tests, which run the raytracer program:
+#   cmake -DRAYTRACER=program -DDATA=tests/data -DWORK=scratch directory -P test.cmake
+
+foreach(variable RAYTRACER DATA WORK)
+  if(NOT DEFINED ${variable})
+    message(FATAL_ERROR "[ERROR] ${variable} is not set")
+  endif()
+endforeach()
+
+file(REMOVE_RECURSE "${WORK}")
+file(MAKE_DIRECTORY "${WORK}")
+
+# Runs the raytracer with the arguments given in WORK, fails the test if it
+# fails, and leaves its log in render_log
+function(render)
+  execute_process(COMMAND "${RAYTRACER}" ${ARGN}
+                  WORKING_DIRECTORY "${WORK}"
+                  RESULT_VARIABLE result
+                  OUTPUT_VARIABLE log
+                  ERROR_VARIABLE log)
+  if(NOT result EQUAL 0)
+    message(FATAL_ERROR "[ERROR] raytracer ${ARGN} failed (${result}):\n${log}")
+  endif()
+  set(render_log "${log}" PARENT_SCOPE)
+endfunction()
+
+# Fails the test unless the two files in WORK hold the same bytes
+function(expect_same_file first second)
+  execute_process(COMMAND "${CMAKE_COMMAND}" -E compare_files "${WORK}/${first}" "${WORK}/${second}"
+                  RESULT_VARIABLE different)
+  if(different)
+    message(FATAL_ERROR "[ERROR] ${first} and ${second} differ")
+  endif()
+endfunction()
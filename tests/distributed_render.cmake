@@ -0,0 +1,16 @@
+# Renders a small scene on a coordinator with two local workers and checks
+# that the image is the same, byte for byte, as a render in one process.
+# The coordinator traces nothing itself, so every pixel came from a worker.
+
+include("${CMAKE_CURRENT_LIST_DIR}/cmake/raytracer.cmake")
+
+if(CMAKE_HOST_WIN32)
+  message(STATUS "Local workers are not supported on Windows, skipping")
+  return()
+endif()
+
+set(scene "${DATA}/small_scene.txt")
+
+render("${scene}" --threads 1 --output single.pfm)
+render("${scene}" --coordinator 127.0.0.1:0 --local-workers 2 --output distributed.pfm)
+expect_same_file(single.pfm distributed.pfm)
@@ -0,0 +1,114 @@
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "bvh.h"
+#include "check.h"
+#include "constant.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "instance.h"
+#include "sampler.h"
+#include "sphere.h"
+#include "sphere_set.h"
+#include "transform.h"
+#include "triangle_mesh.h"
+#include "vect3.h"
+
+// Hittable::occluded is an any-hit query that each object implements on its
+// own, apart from hit. For random rays and intervals, it has to agree with
+// whether hit finds anything, for every kind of Hittable.
+//
+// Usage: occlusion_test [data directory]
+
+namespace {
+  constexpr int rays_per_object = 50000;
+
+  Point3 random_point(Sampler& sampler, Real extent) {
+    return {(Real)sampler.next_double(-extent, extent), (Real)sampler.next_double(-extent, extent),
+            (Real)sampler.next_double(-extent, extent)};
+  }
+
+  void check_occlusion(const Hittable& object, const std::string& name, std::uint64_t seed) {
+    int hits = 0, mismatches = 0;
+    for (int i = 0; i < rays_per_object; i++) {
+      Sampler sampler(seed, i, 0);
+      const Point3 origin = random_point(sampler, 6);
+      // Aimed into the scene most of the time, so that many rays hit
+      const Point3 target = random_point(sampler, 3);
+      const Vect3 direction = sampler.next_double() < 0.8 ? target - origin : random_unit_vector(sampler);
+      const Ray ray(origin, direction, (Real)sampler.next_double());
+
+      // Open-ended, starting at the origin, or a segment that may stop short
+      // of the objects or start past some of them
+      const Real t_min = sampler.next_double() < 0.5 ? 0 : (Real)sampler.next_double(0, 1);
+      const Real t_max = sampler.next_double() < 0.3 ? Constant::infinity : t_min + (Real)sampler.next_double(0, 1.5);
+      const Interval ray_t(t_min, t_max);
+
+      const bool hit = object.hit(ray, ray_t).has_value();
+      hits += hit;
+      mismatches += object.occluded(ray, ray_t) != hit;
+    }
+    std::clog << "[LOG] " << name << ": " << hits << " of " << rays_per_object << " rays hit" << std::endl;
+    Check::expect(hits > rays_per_object / 20 && hits < rays_per_object - rays_per_object / 20,
+                  name + ": too few rays hit or miss to compare");
+    Check::expect(mismatches == 0, name + ": occluded disagrees with hit for " + std::to_string(mismatches) + " rays");
+  }
+
+  SphereSet random_spheres(Sampler& sampler, int count) {
+    SphereSet spheres;
+    for (int i = 0; i < count; i++) {
+      spheres.add(random_point(sampler, 3), (Real)sampler.next_double(0.05, 0.4), 0);
+    }
+    return spheres;
+  }
+
+  TriangleSet random_triangles(Sampler& sampler, int count) {
+    TriangleSet triangles;
+    for (int i = 0; i < count; i++) {
+      const Point3 center = random_point(sampler, 3);
+      const std::uint32_t a = triangles.add_vertex(center + random_point(sampler, 0.5));
+      const std::uint32_t b = triangles.add_vertex(center + random_point(sampler, 0.5));
+      const std::uint32_t c = triangles.add_vertex(center + random_point(sampler, 0.5));
+      triangles.add(a, b, c);
+    }
+    return triangles;
+  }
+}
+
+int main() {
+  Sampler sampler(1, 0, 0);
+
+  const Sphere sphere(Point3(0.5, -0.2, 0.3), 1.5, 0);
+  check_occlusion(sphere, "Sphere", 1);
+  check_occlusion(Sphere(Point3(-1, 0, 0), Point3(1, 0.5, 0), 1, 0), "moving Sphere", 2);
+
+  const auto spheres = std::make_shared<SphereBVH>(random_spheres(sampler, 200));
+  check_occlusion(*spheres, "SphereBVH", 3);
+
+  const auto mesh = std::make_shared<TriangleMesh>(random_triangles(sampler, 200), 0);
+  check_occlusion(*mesh, "TriangleMesh", 4);
+
+  const Transform transform = Transform::scale(Vect3(0.7, 0.7, 0.7))
+                                  .then(Transform::rotate(1, 30))
+                                  .then(Transform::translate(Vect3(0.5, 1, -0.5)));
+  const auto instance = std::make_shared<Instance>(mesh, transform);
+  check_occlusion(*instance, "Instance", 5);
+
+  HittableList list;
+  list.add(std::make_shared<Sphere>(Point3(2, 2, 2), 0.8, 0));
+  list.add(std::make_shared<SphereBVH>(random_spheres(sampler, 20)));
+  list.add(std::make_shared<TriangleMesh>(random_triangles(sampler, 20), 0));
+  list.add(std::make_shared<Instance>(spheres, Transform::translate(Vect3(0, -3, 1))));
+  check_occlusion(list, "HittableList", 6);
+
+  HittableList objects;
+  for (int i = 0; i < 30; i++) {
+    objects.add(std::make_shared<Sphere>(random_point(sampler, 3), (Real)sampler.next_double(0.1, 0.5), 0));
+  }
+  objects.add(mesh);
+  objects.add(instance);
+  check_occlusion(BVH(std::move(objects)), "BVH", 7);
+
+  return Check::result("occlusion_test");
+}
@@ -0,0 +1,125 @@
+#include <cmath>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <optional>
+#include <string>
+
+#include "camera.h"
+#include "check.h"
+#include "framebuffer.h"
+#include "hittable_list.h"
+#include "image_writer.h"
+#include "light.h"
+#include "material.h"
+#include "sphere_set.h"
+#include "triangle_mesh.h"
+
+// Renders a small fixed scene and compares it with tests/data's reference
+// image, which the double build renders with --update. Float and double
+// builds, and other compilers, trace slightly different paths, so the
+// images have to agree on average rather than bit for bit.
+//
+// Usage: render_test data directory [--update]
+
+namespace {
+  // Spheres of every material on a ground sphere, and a mirror-backed quad
+  Framebuffer render_scene() {
+    MaterialTable materials;
+    const std::uint32_t ground = materials.add(Lambertian(Color(0.5, 0.5, 0.5)));
+    const std::uint32_t red = materials.add(Lambertian(Color(0.7, 0.2, 0.2)));
+    const std::uint32_t metal = materials.add(Metal(Color(0.8, 0.8, 0.7), 0.1));
+    const std::uint32_t glass = materials.add(Dielectric(1.5));
+
+    SphereSet spheres;
+    spheres.add(Point3(0, -1000, 0), 1000, ground);
+    spheres.add(Point3(-2.2, 1, 0), 1, red);
+    spheres.add(Point3(0, 1, 0), 1, glass);
+    spheres.add(Point3(2.2, 1, 0), 1, metal);
+    for (int i = 0; i < 12; i++) {
+      spheres.add(Point3(-3 + 0.55 * i, 0.2, 1.6 + 0.3 * std::sin(i)), 0.2, i % 2 == 0 ? metal : red);
+    }
+
+    TriangleSet quad;
+    const std::uint32_t corners[4] = {quad.add_vertex(Point3(-3, 0, -2)), quad.add_vertex(Point3(3, 0, -2)),
+                                      quad.add_vertex(Point3(3, 2.5, -2.5)), quad.add_vertex(Point3(-3, 2.5, -2.5))};
+    quad.add(corners[0], corners[1], corners[2]);
+    quad.add(corners[0], corners[2], corners[3]);
+
+    HittableList world;
+    world.add(std::make_shared<SphereBVH>(std::move(spheres)));
+    world.add(std::make_shared<TriangleMesh>(std::move(quad), metal));
+    const LightList lights;
+
+    Camera camera;
+    camera.image_width = 96;
+    camera.aspect_ratio = 16.0 / 9.0;
+    camera.samples_per_pixel = 32;
+    camera.max_ray_depth = 8;
+    camera.look_from = {0, 2, 7};
+    camera.look_at = {0, 0.8, 0};
+    camera.vertical_fov = 40;
+    camera.seed = 7;
+    camera.output_path = "";
+    camera.context = std::make_shared<RenderContext>();
+    Check::expect(camera.render(world, materials, lights), "The render failed");
+    return camera.context->framebuffer(camera.image_width, camera.height());
+  }
+
+  // Nothing if path is not a PFM file
+  std::optional<Framebuffer> read_pfm(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    std::string magic;
+    int width = 0, height = 0;
+    double scale = 0;
+    in >> magic >> width >> height >> scale;
+    in.get();
+    if (!in || magic != "PF" || width <= 0 || height <= 0 || scale >= 0) return std::nullopt;
+    Framebuffer image(width, height);
+    // Rows go bottom to top
+    for (int y = height - 1; y >= 0; y--) {
+      in.read(reinterpret_cast<char*>(image.pixel(0, y)), (std::streamsize)width * 3 * sizeof(float));
+    }
+    if (!in) return std::nullopt;
+    return image;
+  }
+}
+
+int main(int argc, char* argv[]) {
+  if (argc < 2) {
+    std::cerr << "Usage: " << argv[0] << " data directory [--update]" << std::endl;
+    return 1;
+  }
+  const std::string reference_path = std::string(argv[1]) + "/render_reference.pfm";
+  const Framebuffer image = render_scene();
+  if (argc > 2 && std::string(argv[2]) == "--update") {
+    return ImageWriter::write(image, reference_path, ImageFormat::PFM) ? 0 : 1;
+  }
+
+  const std::optional<Framebuffer> reference = read_pfm(reference_path);
+  if (!Check::expect(reference.has_value(), "Cannot read " + reference_path)) return Check::result("render_test");
+  if (!Check::expect(reference->width() == image.width() && reference->height() == image.height(),
+                     "The reference has another size")) {
+    return Check::result("render_test");
+  }
+
+  // Mean difference over the image, and share of pixels that are far off
+  const size_t values = (size_t)image.width() * image.height() * 3;
+  double total_difference = 0;
+  size_t outliers = 0;
+  bool finite = true;
+  for (size_t i = 0; i < values; i++) {
+    finite &= std::isfinite(image.data()[i]);
+    const double difference = std::fabs((double)image.data()[i] - reference->data()[i]);
+    total_difference += difference;
+    outliers += difference > 0.25;
+  }
+  const double mean_difference = total_difference / values;
+  std::clog << "[LOG] Mean difference " << mean_difference << ", " << outliers << " of " << values
+            << " values off by more than 0.25" << std::endl;
+  Check::expect(finite, "The image has values that are not finite");
+  Check::expect(mean_difference < 0.01, "The image differs from the reference by " +
+                                            std::to_string(mean_difference) + " on average");
+  Check::expect(outliers < values / 100, std::to_string(outliers) + " values are far off the reference");
+  return Check::result("render_test");
+}
@@ -0,0 +1,20 @@
+# Stops a progressive render as soon as it starts with --time-budget,
+# resumes it from its --checkpoint, and checks that the image is the same,
+# byte for byte, as a render that was never interrupted
+
+include("${CMAKE_CURRENT_LIST_DIR}/cmake/raytracer.cmake")
+
+set(scene "${DATA}/small_scene.txt")
+
+render("${scene}" --threads 2 --checkpoint interrupted.rtab --time-budget 0.001 --output partial.pfm)
+if(NOT render_log MATCHES "Time budget of [0-9.e-]+ s reached")
+  message(FATAL_ERROR "[ERROR] The time budget did not stop the render:\n${render_log}")
+endif()
+
+render("${scene}" --threads 2 --checkpoint interrupted.rtab --output resumed.pfm)
+if(NOT render_log MATCHES "Resuming from interrupted.rtab")
+  message(FATAL_ERROR "[ERROR] The render did not resume from its checkpoint:\n${render_log}")
+endif()
+
+render("${scene}" --threads 2 --checkpoint uninterrupted.rtab --output uninterrupted.pfm)
+expect_same_file(resumed.pfm uninterrupted.pfm)
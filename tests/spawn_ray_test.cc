@@ -0,0 +1,90 @@
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "check.h"
+#include "constant.h"
+#include "hittable.h"
+#include "sampler.h"
+#include "sphere.h"
+#include "sphere_set.h"
+#include "triangle_mesh.h"
+#include "vect3.h"
+
+// Rays spawned at a hit with HitRecord::spawn_origin and traced from t = 0
+// must not find the surface they left. Each object is convex or flat, so a
+// ray leaving it to the side it came from cannot hit it again at all, and
+// one going into a sphere has to come out on the far side, not right at the
+// start. Objects range from tiny to huge and sit away from the origin, where
+// the rounding error of the hit points is largest.
+//
+// Usage: spawn_ray_test [data directory]
+
+namespace {
+  constexpr int rays_per_object = 20000;
+
+  // Fires random rays at object, which lies within radius of center, and
+  // checks the rays spawned at each hit. flat objects have no far side.
+  void check_spawned_rays(const Hittable& object, const Point3& center, Real radius, bool flat,
+                          const std::string& name, std::uint64_t seed) {
+    int hits = 0, self_hits = 0, early_exits = 0;
+    for (int i = 0; i < rays_per_object; i++) {
+      Sampler sampler(seed, i, 0);
+      const Point3 origin = center + 4 * radius * random_unit_vector(sampler);
+      const Point3 target = center + (Real)0.9 * radius * random_unit_vector(sampler);
+      const Ray ray(origin, unit_vector(target - origin));
+      const std::optional<HitRecord> record = object.hit(ray, Interval(0, Constant::infinity));
+      if (!record) continue;
+      hits++;
+
+      // Back to the side the ray came from
+      Vect3 direction = random_unit_vector(sampler);
+      if (dot(direction, record->normal) < 0) direction = -direction;
+      if (object.hit(Ray(record->spawn_origin(direction), direction), Interval(0, Constant::infinity))) {
+        self_hits++;
+      }
+
+      // Through the surface
+      direction = -direction;
+      const std::optional<HitRecord> exit =
+          object.hit(Ray(record->spawn_origin(direction), direction), Interval(0, Constant::infinity));
+      if (flat) {
+        self_hits += exit.has_value();
+        continue;
+      }
+      // Into a sphere, the chord is 2 r cos(angle to the normal)
+      const Real cosine = -dot(direction, record->normal);
+      if (cosine > (Real)0.1 && (!exit || exit->t < radius * cosine)) early_exits++;
+    }
+    std::clog << "[LOG] " << name << ": " << hits << " hits" << std::endl;
+    Check::expect(hits > rays_per_object / 10, name + ": too few rays hit the object");
+    Check::expect(self_hits == 0, name + ": " + std::to_string(self_hits) + " spawned rays hit the surface they left");
+    Check::expect(early_exits == 0, name + ": " + std::to_string(early_exits) +
+                                        " spawned rays missed the far side of the sphere");
+  }
+}
+
+int main() {
+  const Real scales[] = {(Real)0.01, 1, 100, 10000};
+  std::uint64_t seed = 0;
+  for (const Real scale : scales) {
+    const std::string suffix = " at scale " + std::to_string(scale);
+    // Far enough from the origin that the coordinates lose most of their bits
+    const Point3 center = scale * Point3(37, -12, 58);
+
+    check_spawned_rays(Sphere(center, scale, 0), center, scale, false, "Sphere" + suffix, seed++);
+
+    SphereSet spheres;
+    spheres.add(center, scale, 0);
+    check_spawned_rays(SphereBVH(std::move(spheres)), center, scale, false, "SphereBVH" + suffix, seed++);
+
+    TriangleSet triangle;
+    const std::uint32_t a = triangle.add_vertex(center + scale * Vect3(-1, -0.5, 0.2));
+    const std::uint32_t b = triangle.add_vertex(center + scale * Vect3(1, -0.6, -0.3));
+    const std::uint32_t c = triangle.add_vertex(center + scale * Vect3(0.1, 1, 0.1));
+    triangle.add(a, b, c);
+    check_spawned_rays(TriangleMesh(std::move(triangle), 0), center, scale, true, "TriangleMesh" + suffix, seed++);
+  }
+  return Check::result("spawn_ray_test");
+}